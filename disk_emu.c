@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h> 
 #include <string.h>
@@ -6,19 +7,70 @@
 #include "disk_emu.h"
 
 
-FILE* fp = NULL;
+struct disk
+{
+    FILE* fp;
+    int block_size, max_block;
+    /*Held while seeking and writing, so threads can share the disk. Reads use*/
+    /*pread() and need no lock, since every write is flushed to the file.     */
+    pthread_mutex_t lock;
+};
+
 double L, p;
 double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+int MAX_RETRY;
+
+/*Disk used by the calling thread until it selects another one*/
+static struct disk default_disk = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+static __thread struct disk* current_disk = &default_disk;
+
+/*----------------------------------------------------------*/
+/*Allocates a disk that is not opened yet.                   */
+/*----------------------------------------------------------*/
+struct disk* new_disk()
+{
+    struct disk* disk = (struct disk*) calloc(1, sizeof(struct disk));
+    if (disk == NULL)
+    {
+        printf("Could not allocate a new disk\n\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&disk->lock, NULL);
+    return disk;
+}
+
+/*----------------------------------------------------------*/
+/*Frees a disk allocated by new_disk(), closing it first.    */
+/*----------------------------------------------------------*/
+void free_disk(struct disk* disk)
+{
+    struct disk* previous = select_disk(disk);
+    close_disk();
+    select_disk(previous == disk ? &default_disk : previous);
+    pthread_mutex_destroy(&disk->lock);
+    free(disk);
+}
+
+/*----------------------------------------------------------*/
+/*Makes the calling thread use the given disk (or the default*/
+/*one if NULL) and returns the one it was using.             */
+/*----------------------------------------------------------*/
+struct disk* select_disk(struct disk* disk)
+{
+    struct disk* previous = current_disk;
+    current_disk = disk != NULL ? disk : &default_disk;
+    return previous;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
-    if(NULL != fp)
+    if(NULL != current_disk->fp)
     {
-        fclose(fp);
+        fclose(current_disk->fp);
+        current_disk->fp = NULL;
     }
     return 0;
 }
@@ -30,28 +82,29 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
     int i, j;
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
+    current_disk->block_size = block_size;
+    current_disk->max_block = num_blocks;
     
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
     /*Creates a new file*/
-    fp = fopen (filename, "w+b");
+    current_disk->fp = fopen (filename, "w+b");
 
-    if (fp == NULL)
+    if (current_disk->fp == NULL)
     {
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
     
     /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    for (i = 0; i < current_disk->max_block; i++)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
+        for (j = 0; j < current_disk->block_size; j++)
         {
-            fputc(0, fp);
+            fputc(0, current_disk->fp);
         }
     }
+    fflush(current_disk->fp);
     return 0;
 }
 /*----------------------------*/
@@ -59,13 +112,13 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks)
 {
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
+    current_disk->block_size = block_size;
+    current_disk->max_block = num_blocks;
     
     /*Opens a file*/
-    fp = fopen (filename, "r+b");
+    current_disk->fp = fopen (filename, "r+b");
 
-    if (fp == NULL)
+    if (current_disk->fp == NULL)
     {
         printf("Could not open %s\n\n", filename);
         return -1;
@@ -81,28 +134,27 @@ int read_blocks(int start_address, int nblocks, void *buffer)
     int i, s;
     s = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > current_disk->max_block)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
     /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
         s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        char* blockRead = (char *)buffer+(i*current_disk->block_size);
+        off_t offset = (off_t) (start_address + i) * current_disk->block_size;
+        ssize_t n = pread(fileno(current_disk->fp), blockRead, current_disk->block_size, offset);
+        if (n < current_disk->block_size)
+        {
+            /*Past the end of the file*/
+            memset(blockRead + (n > 0 ? n : 0), 0, current_disk->block_size - (n > 0 ? n : 0));
+        }
     }
 
-    free(blockRead);
     return s;
 }
 
@@ -114,17 +166,18 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     int i, s;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+    void* blockWrite = (void*) malloc(current_disk->block_size);
 
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > current_disk->max_block)
     {
         printf("out of bound error\n");
         return -1;
     }
 
     /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    pthread_mutex_lock(&current_disk->lock);
+    fseek(current_disk->fp, start_address * current_disk->block_size, SEEK_SET);
 
     /*For every block requested*/        
     for (i = 0; i < nblocks; ++i)
@@ -132,12 +185,13 @@ int write_blocks(int start_address, int nblocks, void *buffer)
         /*Pause until the latency duration is elapsed*/
         usleep(L);
 
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+        memcpy(blockWrite, (char *)buffer+(i*current_disk->block_size), current_disk->block_size);
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
+        fwrite(blockWrite, current_disk->block_size, 1, current_disk->fp);
+        fflush(current_disk->fp);
         s++;
     }
+    pthread_mutex_unlock(&current_disk->lock);
     free(blockWrite);
     return s;
 }
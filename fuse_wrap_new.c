@@ -20,7 +20,7 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
     
     memset(stbuf, 0, sizeof(struct stat));
     
-    if (strcmp(path, "/") == 0) {
+    if (sfs_isdir(path)) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
     } else if((size = sfs_getfilesize(path)) != -1) {
@@ -33,115 +33,165 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
     return res;
 }
 
-static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-        off_t offset, struct fuse_file_info *fi)
+static int fuse_opendir(const char *path, struct fuse_file_info *fi)
 {
-    char file_name[MAXFILENAME];
+    int res;
     
-    if (strcmp(path, "/") != 0)
+    res = sfs_opendir(path);
+    if (res == -1)
         return -ENOENT;
     
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    
-    while(sfs_getnextfilename(file_name)) {
-        filler(buf, &file_name[1], NULL, 0);
+    fi->fh = res;
+    return 0;
+}
+
+/*
+ * Offsets 1 and 2 are "." and "..", and offset n + 2 resumes the directory
+ * cursor at slot n, so large directories are streamed over several calls.
+ * The sizes come with the entries, so listing them does not need a getattr
+ * per file.
+ */
+static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+        off_t offset, struct fuse_file_info *fi)
+{
+    struct sfs_dirent entries[16];
+    struct stat st;
+    int dirfd = fi->fh;
+    int i, n;
+    
+    if (offset < 1 && filler(buf, ".", NULL, 1))
+        return 0;
+    if (offset < 2 && filler(buf, "..", NULL, 2))
+        return 0;
+    
+    if (sfs_seekdir(dirfd, offset > 2 ? offset - 2 : 0) == -1)
+        return -EBADF;
+    
+    while ((n = sfs_readdir(dirfd, entries, 16)) > 0) {
+        for (i = 0; i < n; i++) {
+            memset(&st, 0, sizeof(struct stat));
+            st.st_mode = entries[i].is_dir ? S_IFDIR | 0755 : S_IFREG | 0666;
+            st.st_size = entries[i].size;
+            if (filler(buf, entries[i].name, &st, entries[i].next_offset + 2))
+                return 0;
+        }
     }
     
+    return n == -1 ? -EBADF : 0;
+}
+
+static int fuse_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    sfs_closedir(fi->fh);
     return 0;
 }
 
 static int fuse_unlink(const char *path)
 {
     int res;
-    char filename[MAXFILENAME];
     
-    strcpy(filename, path);
-    res = sfs_remove(filename);
+    res = sfs_remove(path);
     if (res == -1)
         return -errno;
     
     return 0;
 }
 
+/*
+ * Each open file holds a reference to the descriptor of the file, which is
+ * kept in fi->fh and dropped by fuse_release(). The other file operations use
+ * it instead of looking the path up again.
+ */
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
     int res;
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
     
-    res = sfs_fopen(filename);
+    res = sfs_open(path);
     if (res == -1)
-        return -errno;
+        return -ENOENT;
     
-    sfs_fclose(res);
+    fi->fh = res;
+    return 0;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    sfs_release(fi->fh);
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fread(fd, buf, size);
+    res = sfs_pread(fi->fh, buf, size, offset);
     if (res == -1)
         return -errno;
     
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fwrite(fd, buf, size);
+    res = sfs_pwrite(fi->fh, buf, size, offset);
     if (res == -1)
         return -errno;
     
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_truncate(const char *path, off_t size)
 {
-    char filename[MAXFILENAME];
     int fd;
+    int res;
     
-    strcpy(filename, path);
-    
-    fd = sfs_remove(filename);
+    fd = sfs_open(path);
     if (fd == -1)
+        return -ENOENT;
+    
+    res = sfs_ftruncate(fd, size);
+    sfs_release(fd);
+    if (res == -1)
+        return -EFBIG;
+    
+    return 0;
+}
+
+static int fuse_ftruncate(const char *path, off_t size,
+        struct fuse_file_info *fi)
+{
+    if (sfs_ftruncate(fi->fh, size) == -1)
+        return -EFBIG;
+    
+    return 0;
+}
+
+static int fuse_fsync(const char *path, int isdatasync,
+        struct fuse_file_info *fi)
+{
+    if (sfs_fflush(fi->fh) == -1)
+        return -EIO;
+    
+    return 0;
+}
+
+static int fuse_mkdir(const char *path, mode_t mode)
+{
+    if (sfs_mkdir(path) == -1)
+        return -errno;
+    
+    return 0;
+}
+
+static int fuse_rmdir(const char *path)
+{
+    if (sfs_rmdir(path) == -1)
         return -errno;
     
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
     return 0;
 }
 
@@ -155,27 +205,34 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
     return 0;
 }
 
-static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
+static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-    char filename[MAXFILENAME];
-    int fd;
+    int res;
     
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    res = sfs_open(path);
+    if (res == -1)
+        return -ENOSPC;
     
-    sfs_fclose(fd);
+    fi->fh = res;
     return 0;
 }
 
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
+    .opendir = fuse_opendir,
     .readdir = fuse_readdir,
+    .releasedir = fuse_releasedir,
     .mknod = fuse_mknod,
     .unlink = fuse_unlink,
+    .mkdir = fuse_mkdir,
+    .rmdir = fuse_rmdir,
     .truncate = fuse_truncate,
+    .ftruncate = fuse_ftruncate,
     .open = fuse_open, 
     .read = fuse_read, 
     .write = fuse_write, 
+    .release = fuse_release,
+    .fsync = fuse_fsync,
     .access = fuse_access,
     .create = fuse_create,
 };
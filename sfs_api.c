@@ -1,182 +1,2184 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "disk_emu.h"
 #include "sfs_api.h"
 #include "sfs_base.h"
+#include "sfs_cache.h"
+#include "sfs_dcache.h"
 #include "sfs_directory.h"
 #include "sfs_freebitmap.h"
 #include "sfs_inode.h"
+#include "sfs_ioqueue.h"
 #include "sfs_ofdt.h"
+#include "sfs_workers.h"
 
 
-static struct super_block super_block;
-static struct inode_table inode_table;
-static struct freebitmap free_bitmap;
-static struct directory directory;
-static struct ofdt ofdt;
-// Index of the current file in sfs_getnextfilename()
-static int current_file_idx;
+// Number of blocks that sfs_read_borrow() may keep pinned at once, so that
+// one reader cannot leave no room in the cache for the others
+#define MAX_BORROWED_BLOCKS (CACHE_SIZE / 2)
+// Number of components in the deepest path that sfs_getfilesize() looks up
+// without locks
+#define MAX_UNLOCKED_DEPTH 16
+
+// Position of an open directory handle (see sfs_opendir())
+struct dir_cursor {
+	// Whether this cursor is in use
+	int active;
+	// Directory being listed, or INODE_NULL if it has been removed
+	inode_idx dir_inode;
+	// Slot to read next. Slots never move, so removing entries during a
+	// listing does not make it skip or repeat the others.
+	int offset;
+};
+
+/*
+ * A mounted volume (see sfs_mount()). Nothing is shared between volumes except
+ * the asynchronous request workers, so different volumes can be used from
+ * different threads in parallel.
+ *
+ * Calls into the same volume run in parallel too. Each file is guarded by the
+ * lock of its inode (see sfs_inode_read_lock()), so reads of a file share it
+ * and only writes wait for each other. The locks are always taken in this
+ * order: dir_lock, the locks of inodes (by increasing index when there are
+ * two), then one of ofdt_lock, borrow_lock and ring_lock, and last the locks
+ * inside the inode table, free bitmap and disk.
+ *
+ * sfs_getfilesize() and sfs_pread() first try to do without any lock: they
+ * read the dentry cache, the OFDT and the inode optimistically and check
+ * afterwards that nothing they used changed (see sfs_dcache_lookup_unlocked(),
+ * sfs_ofdt_peek_inode() and sfs_inode_snapshot()), so readers of stable files
+ * never write to shared memory.
+ */
+struct sfs {
+	// Disk the volume is stored on. Every call into the volume selects it for
+	// the calling thread (see ENTER_FS()).
+	struct disk *disk;
+	struct super_block super_block;
+	struct inode_table inode_table;
+	struct freebitmap free_bitmap;
+	// Cache of the blocks of directories and their hash indexes
+	struct block_cache block_cache;
+	// Cache of the blocks of regular files pinned by sfs_read_borrow(), kept
+	// apart from block_cache so that borrowing never waits for dir_lock
+	struct block_cache borrow_cache;
+	// Directories that have been loaded into memory, indexed by inode. The
+	// entry is NULL if the inode is not a directory or has not been loaded yet.
+	struct directory **directories;
+	struct dcache dcache;
+	struct ofdt ofdt;
+	// Directory and index of the current file in sfs_getnextfilename_in()
+	inode_idx current_dir_inode;
+	int current_file_idx;
+	// Number of blocks pinned by sfs_read_borrow() and not released yet
+	// (protected by borrow_lock)
+	int num_borrowed_blocks;
+	// Number of entries in dir_cursors
+	int num_dir_cursors;
+	struct dir_cursor *dir_cursors;
+	// Queues set up by sfs_ring_setup(), indexed by ring. The entry is NULL if
+	// the ring is not in use. (protected by ring_lock)
+	int num_rings;
+	struct ioqueue **rings;
+	// Protects the directories, the dentry cache, block_cache, the directory
+	// cursors and the state of sfs_getnextfilename_in(), and is held whenever
+	// a file is created or removed
+	pthread_mutex_t dir_lock;
+	pthread_mutex_t ofdt_lock;
+	pthread_mutex_t borrow_lock;
+	pthread_mutex_t ring_lock;
+	// Number of asynchronous requests on this volume that are not done yet
+	// (protected by aio_lock)
+	int num_aio_pending;
+	// Next volume in the list of mounted volumes
+	sfs_t *next_mounted;
+};
+
+// Volume used by mksfs() and by the functions that take no sfs_t
+static sfs_t *default_fs;
+
+// Protects the list of mounted volumes, which are unmounted at exit
+static pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER;
+static sfs_t *mounted;
 // Whether the exit handler has already been registered
 static int exit_func_registered = 0;
 
+// Operation taken off a submission queue, with its position in the
+// submission so that reordering keeps the order of operations on one file
+struct pending_op {
+	struct sfs_sqe sqe;
+	int position;
+	// Result to post on the completion queue
+	int result;
+};
 
-static void reset_in_memory_system() {
-	sfs_inode_free_table(&inode_table);
+// Number of threads that perform asynchronous requests (for every volume)
+#define AIO_NUM_WORKERS 4
 
-	sfs_freebitmap_free(&free_bitmap);
+// Asynchronous request (see sfs_aread())
+struct aio_request {
+	// Whether this entry is in use
+	int active;
+	// Volume the request is on
+	sfs_t *fs;
+	int is_write;
+	int fd;
+	char *buffer;
+	int length;
+	int offset;
+	sfs_aio_callback callback;
+	void *arg;
+	// Whether the request has been performed, and its result
+	int done;
+	int result;
+	// Next entry in the free list if this entry is not in use
+	int next_free;
+};
 
-	sfs_directory_free(&directory);
+// Protects everything below. The requests are only touched while holding it,
+// never while holding a lock of a volume.
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a request is done
+static pthread_cond_t aio_done = PTHREAD_COND_INITIALIZER;
+static int num_aio_requests;
+static struct aio_request *aio_requests;
+// First entry of the free list of aio_requests, or -1 if every entry is in use
+static int aio_first_free = -1;
+// Started by the first asynchronous request
+static struct worker_pool aio_workers;
+static int aio_workers_started;
+// eventfd incremented by every completion, or -1 until sfs_aio_eventfd() is
+// first called
+static int aio_event_fd = -1;
 
-	sfs_ofdt_free(&ofdt);
 
-	sfs_base_super_block_free(&super_block);
+static void restore_disk(struct disk **previous_disk) {
+	select_disk(*previous_disk);
+}
+
+// Makes the calling thread use the disk of the given volume until the end of
+// the enclosing block
+#define ENTER_FS(fs) struct disk *previous_disk __attribute__((cleanup(restore_disk))) = select_disk((fs)->disk)
 
-	close_disk();
+static pthread_mutex_t *lock_mutex(pthread_mutex_t *mutex) {
+	pthread_mutex_lock(mutex);
+	return mutex;
 }
 
+static void unlock_mutex(pthread_mutex_t **mutex) {
+	pthread_mutex_unlock(*mutex);
+}
 
-void mksfs(int fresh) {
-	if (!exit_func_registered) {
-		atexit(reset_in_memory_system);
-		exit_func_registered = 1;
-	}
+// Holds dir_lock of the given volume until the end of the enclosing block
+#define LOCK_DIRS(fs) pthread_mutex_t *dir_lock_holder __attribute__((cleanup(unlock_mutex))) = lock_mutex(&(fs)->dir_lock)
+
+// Holds ring_lock of the given volume until the end of the enclosing block
+#define HOLD_RING_LOCK(fs) pthread_mutex_t *ring_lock_holder __attribute__((cleanup(unlock_mutex))) = lock_mutex(&(fs)->ring_lock)
 
-	reset_in_memory_system();
+// Inode of an open file locked by lock_fd() (see LOCK_FD())
+struct fd_lock {
+	sfs_t *fs;
+	// INODE_NULL if the file descriptor is not open
+	inode_idx inode_idx;
+};
+
+/*
+ * Returns the inode open as the given file descriptor, or INODE_NULL if the
+ * descriptor is not open.
+ */
+static inode_idx get_fd_inode(sfs_t *fs, int fd) {
+	pthread_mutex_lock(&fs->ofdt_lock);
+	struct ofdt_entry *ofdt_entry = sfs_ofdt_get_active_entry(&fs->ofdt, fd);
+	inode_idx inode_idx = ofdt_entry != NULL ? ofdt_entry->inode_idx : INODE_NULL;
+	pthread_mutex_unlock(&fs->ofdt_lock);
+	return inode_idx;
+}
+
+/*
+ * Locks the inode open as the given file descriptor for reading, or for
+ * writing if exclusive is nonzero. The descriptor is checked again once the
+ * inode is locked, since the file may have been closed (and even removed)
+ * while waiting for the lock.
+ */
+static struct fd_lock lock_fd(sfs_t *fs, int fd, int exclusive) {
+	struct fd_lock lock = {fs, get_fd_inode(fs, fd)};
+	if (lock.inode_idx == INODE_NULL) {
+		return lock;
+	}
 
-	if (fresh) {
-		super_block = sfs_base_init_fresh_disk();
-		inode_table = sfs_inode_new_table(&super_block, &free_bitmap);
-		free_bitmap = sfs_freebitmap_new(&super_block);
-		directory = sfs_directory_new(&super_block, &inode_table);
+	if (exclusive) {
+		sfs_inode_write_lock(&fs->inode_table, lock.inode_idx);
 	}
 	else {
-		super_block = sfs_base_init_old_disk();
-		inode_table = sfs_inode_table_from_disk(&super_block, &free_bitmap);
-		free_bitmap = sfs_freebitmap_from_disk(&super_block);
-		directory = sfs_directory_from_disk(&super_block, &inode_table);
+		sfs_inode_read_lock(&fs->inode_table, lock.inode_idx);
 	}
+	if (get_fd_inode(fs, fd) != lock.inode_idx) {
+		sfs_inode_unlock(&fs->inode_table, lock.inode_idx);
+		lock.inode_idx = INODE_NULL;
+	}
+	return lock;
+}
 
-	ofdt = sfs_ofdt_new();
+static void unlock_fd(struct fd_lock *lock) {
+	if (lock->inode_idx != INODE_NULL) {
+		sfs_inode_unlock(&lock->fs->inode_table, lock->inode_idx);
+	}
 }
 
-int sfs_getnextfilename(char *filename) {
-	if (current_file_idx >= directory.size) {
-		current_file_idx = 0;
+// Holds the lock of the inode open as the given file descriptor, as name, until
+// the end of the enclosing block. name.inode_idx is INODE_NULL if the file
+// descriptor is not open.
+#define LOCK_FD(name, fs, fd, exclusive) struct fd_lock name __attribute__((cleanup(unlock_fd))) = lock_fd(fs, fd, exclusive)
+
+/*
+ * Returns the file pointer of the given file descriptor, or a negative number
+ * if the descriptor is not open.
+ */
+static rw_pointer get_rw_pointer(sfs_t *fs, int fd) {
+	pthread_mutex_lock(&fs->ofdt_lock);
+	struct ofdt_entry *ofdt_entry = sfs_ofdt_get_active_entry(&fs->ofdt, fd);
+	rw_pointer rw_pointer = ofdt_entry != NULL ? ofdt_entry->rw_pointer : -1;
+	pthread_mutex_unlock(&fs->ofdt_lock);
+	return rw_pointer;
+}
+
+static void set_rw_pointer(sfs_t *fs, int fd, rw_pointer rw_pointer) {
+	pthread_mutex_lock(&fs->ofdt_lock);
+	struct ofdt_entry *ofdt_entry = sfs_ofdt_get_active_entry(&fs->ofdt, fd);
+	if (ofdt_entry != NULL) {
+		ofdt_entry->rw_pointer = rw_pointer;
+	}
+	pthread_mutex_unlock(&fs->ofdt_lock);
+}
+
+/*
+ * Locks two files for writing, the one with the lower inode first so that two
+ * threads locking the same files never wait for each other. Both may be the
+ * same file.
+ */
+static void write_lock_pair(sfs_t *fs, inode_idx a, inode_idx b) {
+	sfs_inode_write_lock(&fs->inode_table, a < b ? a : b);
+	if (a != b) {
+		sfs_inode_write_lock(&fs->inode_table, a < b ? b : a);
+	}
+}
+
+static void unlock_pair(sfs_t *fs, inode_idx a, inode_idx b) {
+	sfs_inode_unlock(&fs->inode_table, a);
+	if (a != b) {
+		sfs_inode_unlock(&fs->inode_table, b);
+	}
+}
+
+/*
+ * Drops the blocks of the given file from the cache of sfs_read_borrow(), so
+ * that later borrowers see the file as it is now. Blocks borrowed before keep
+ * the old contents.
+ */
+static void forget_borrowed_blocks(sfs_t *fs, inode_idx inode_idx) {
+	pthread_mutex_lock(&fs->borrow_lock);
+	sfs_cache_forget_inode(&fs->borrow_cache, inode_idx);
+	pthread_mutex_unlock(&fs->borrow_lock);
+}
+
+static void init_locks(sfs_t *fs) {
+	pthread_mutex_init(&fs->dir_lock, NULL);
+	pthread_mutex_init(&fs->ofdt_lock, NULL);
+	pthread_mutex_init(&fs->borrow_lock, NULL);
+	pthread_mutex_init(&fs->ring_lock, NULL);
+}
+
+static void destroy_locks(sfs_t *fs) {
+	pthread_mutex_destroy(&fs->dir_lock);
+	pthread_mutex_destroy(&fs->ofdt_lock);
+	pthread_mutex_destroy(&fs->borrow_lock);
+	pthread_mutex_destroy(&fs->ring_lock);
+}
+
+
+/*
+ * Waits for the asynchronous requests on the given volume to be done, writes
+ * out anything that is still buffered, frees the volume and closes its disk.
+ * No other thread may be using the volume otherwise.
+ */
+static void unmount(sfs_t *fs) {
+	// The workers would use the volume after it is freed
+	pthread_mutex_lock(&aio_lock);
+	while (fs->num_aio_pending > 0) {
+		pthread_cond_wait(&aio_done, &aio_lock);
+	}
+	pthread_mutex_unlock(&aio_lock);
+
+	pthread_mutex_lock(&mount_lock);
+	sfs_t **link = &mounted;
+	while (*link != fs) {
+		link = &(*link)->next_mounted;
+	}
+	*link = fs->next_mounted;
+	pthread_mutex_unlock(&mount_lock);
+
+	if (default_fs == fs) {
+		default_fs = NULL;
+	}
+
+	{
+		ENTER_FS(fs);
+
+		sfs_inode_flush_all_buffered(&fs->inode_table);
+		sfs_freebitmap_flush(&fs->free_bitmap);
+		sfs_freebitmap_free(&fs->free_bitmap);
+
+		for (inode_idx i = 0; i < fs->inode_table.size; i++) {
+			if (fs->directories[i] != NULL) {
+				sfs_directory_free(fs->directories[i]);
+				free(fs->directories[i]);
+			}
+		}
+		free(fs->directories);
+
+		sfs_dcache_free(&fs->dcache);
+
+		if (fs->dir_cursors != NULL) {
+			free(fs->dir_cursors);
+		}
+
+		if (fs->rings != NULL) {
+			for (int i = 0; i < fs->num_rings; i++) {
+				if (fs->rings[i] != NULL) {
+					sfs_ioqueue_free(fs->rings[i]);
+					free(fs->rings[i]);
+				}
+			}
+			free(fs->rings);
+		}
+
+		sfs_cache_free(&fs->block_cache);
+		sfs_cache_free(&fs->borrow_cache);
+		sfs_inode_free_table(&fs->inode_table);
+		sfs_ofdt_free(&fs->ofdt);
+		sfs_base_super_block_free(&fs->super_block);
+	}
+
+	free_disk(fs->disk);
+	destroy_locks(fs);
+	free(fs);
+}
+
+/*
+ * Unmounts every volume that is still mounted at exit, which waits for their
+ * asynchronous requests, and then stops the workers.
+ */
+static void unmount_all() {
+	while (mounted != NULL) {
+		unmount(mounted);
+	}
+
+	pthread_mutex_lock(&aio_lock);
+	int workers_started = aio_workers_started;
+	aio_workers_started = 0;
+	pthread_mutex_unlock(&aio_lock);
+	if (workers_started) {
+		sfs_workers_stop(&aio_workers);
+	}
+
+	if (aio_requests != NULL) {
+		free(aio_requests);
+		aio_requests = NULL;
+	}
+	num_aio_requests = 0;
+	aio_first_free = -1;
+}
+
+/*
+ * Checks whether the given inode is a directory. The root directory of disks
+ * formatted before inodes had types is marked as a regular file, so it is
+ * special-cased. The caller must hold dir_lock, which keeps the type of every
+ * inode from changing.
+ */
+static int is_directory(sfs_t *fs, inode_idx inode_idx) {
+	if (inode_idx < 0 || inode_idx >= fs->inode_table.size) {
 		return 0;
 	}
+	return inode_idx == fs->super_block.dir_inode_idx || fs->inode_table.entries[inode_idx].type == INODE_TYPE_DIRECTORY;
+}
 
-	strcpy(filename, directory.entries[current_file_idx].filename);
+/*
+ * Returns the directory held by the given inode, opening it the first time it
+ * is needed. Returns NULL if the inode is not a directory.
+ */
+static struct directory *get_directory(sfs_t *fs, inode_idx inode_idx) {
+	if (!is_directory(fs, inode_idx)) {
+		return NULL;
+	}
 
-	current_file_idx++;
+	if (fs->directories[inode_idx] == NULL) {
+		fs->directories[inode_idx] = calloc_or_exit(1, sizeof(struct directory));
+		*fs->directories[inode_idx] = sfs_directory_from_disk(&fs->super_block, &fs->inode_table, &fs->block_cache, inode_idx);
+		// Opening a directory in the old format converts it
+		sfs_freebitmap_flush(&fs->free_bitmap);
+	}
+	return fs->directories[inode_idx];
+}
 
-	return 1;
+/*
+ * Looks up the given name in the given directory, going through the dentry
+ * cache. Returns INODE_NULL if there is no such file.
+ */
+static inode_idx lookup(sfs_t *fs, struct directory *dir, const char *name) {
+	inode_idx result;
+	if (!sfs_dcache_lookup(&fs->dcache, dir->inode_idx, name, &result)) {
+		result = sfs_directory_get_inode(dir, name);
+		sfs_dcache_insert(&fs->dcache, dir->inode_idx, name, result);
+	}
+	return result;
 }
 
-int sfs_getfilesize(const char *filename) {
-	inode_idx inode_idx = sfs_directory_get_inode(&directory, filename);
-	if (inode_idx == INODE_NULL) {
-		return -1;
+/*
+ * Walks the given path up to its last component. Components are separated by
+ * one or more slashes, and leading and trailing slashes are ignored (so "a",
+ * "/a" and "/a/" are the same path).
+ *
+ * Copies the last component into name and returns the directory that should
+ * hold it. The last component is empty only for the root directory itself.
+ * Returns NULL if any component is too long, or if any component other than
+ * the last one does not exist or is not a directory, and sets errno to
+ * ENAMETOOLONG, ENOENT or ENOTDIR accordingly.
+ */
+static struct directory *resolve_parent(sfs_t *fs, const char *path, char name[MAXFILENAME]) {
+	struct directory *dir = get_directory(fs, fs->super_block.dir_inode_idx);
+
+	const char *component = path;
+	while (*component == '/') {
+		component++;
+	}
+
+	while (1) {
+		const char *end = strchr(component, '/');
+		if (end == NULL) {
+			end = component + strlen(component);
+		}
+
+		int length = end - component;
+		if (length >= MAXFILENAME) {
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+		memcpy(name, component, length);
+		name[length] = '\0';
+
+		while (*end == '/') {
+			end++;
+		}
+		if (*end == '\0') {
+			return dir;
+		}
+
+		inode_idx inode_idx = lookup(fs, dir, name);
+		dir = get_directory(fs, inode_idx);
+		if (dir == NULL) {
+			errno = inode_idx == INODE_NULL ? ENOENT : ENOTDIR;
+			return NULL;
+		}
+		component = end;
 	}
+}
 
-	return inode_table.entries[inode_idx].size;
+/*
+ * Returns the inode at the given path, or INODE_NULL if there is none.
+ */
+static inode_idx resolve_path(sfs_t *fs, const char *path) {
+	char name[MAXFILENAME];
+	struct directory *dir = resolve_parent(fs, path, name);
+	if (dir == NULL) {
+		return INODE_NULL;
+	}
+	if (name[0] == '\0') {
+		return dir->inode_idx;
+	}
+	return lookup(fs, dir, name);
 }
 
-int sfs_fopen(const char* filename) {
-	inode_idx inode_idx = sfs_directory_get_inode(&directory, filename);
+/*
+ * Returns the total length of the given buffers, or a negative number if it
+ * is invalid.
+ */
+static int get_iovec_length(const struct iovec *iov, int iovcnt) {
+	if (iovcnt < 0) {
+		return -1;
+	}
 
-	rw_pointer rw_pointer;
-	if (inode_idx == INODE_NULL) {
-		inode_idx = sfs_directory_add_file(&directory, filename);
-		if (inode_idx == INODE_NULL) {
+	long total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+		if (total > INT_MAX) {
 			return -1;
 		}
+	}
+	return total;
+}
 
-		rw_pointer = 0;
+static struct ioqueue *get_ring(sfs_t *fs, int ring) {
+	if (ring < 0 || ring >= fs->num_rings) {
+		return NULL;
+	}
+	return fs->rings[ring];
+}
+
+// Puts the given asynchronous request back on the free list. The caller must
+// hold aio_lock.
+static void release_aio_request(int request) {
+	memset(aio_requests + request, 0, sizeof(struct aio_request));
+	aio_requests[request].next_free = aio_first_free;
+	aio_first_free = request;
+}
+
+/*
+ * Performs the asynchronous request whose index is given (cast to a pointer).
+ * Runs on one of the aio_workers.
+ */
+static void run_aio_request(void *arg) {
+	int request = (intptr_t) arg;
+
+	pthread_mutex_lock(&aio_lock);
+	struct aio_request r = aio_requests[request];
+	pthread_mutex_unlock(&aio_lock);
+
+	int result;
+	if (r.is_write) {
+		result = sfs_fs_pwrite(r.fs, r.fd, r.buffer, r.length, r.offset);
 	}
 	else {
-		rw_pointer = inode_table.entries[inode_idx].size;
+		result = sfs_fs_pread(r.fs, r.fd, r.buffer, r.length, r.offset);
+	}
+
+	// The handle is only reused once the callback is done with it, so that it
+	// never names two requests at once
+	if (r.callback != NULL) {
+		r.callback(request, result, r.arg);
+	}
+
+	pthread_mutex_lock(&aio_lock);
+	r.fs->num_aio_pending--;
+	if (r.callback != NULL) {
+		// Nobody will ask for the result, so the entry can be reused now
+		release_aio_request(request);
+	}
+	else {
+		aio_requests[request].done = 1;
+		aio_requests[request].result = result;
+	}
+	// Wakes up unmount() as well as sfs_aio_wait()
+	pthread_cond_broadcast(&aio_done);
+	int event_fd = aio_event_fd;
+	pthread_mutex_unlock(&aio_lock);
+
+	if (event_fd >= 0) {
+		uint64_t one = 1;
+		if (write(event_fd, &one, sizeof one) != sizeof one) {
+			fprintf(stderr, "WARNING: failed to signal the completion of request %d.\n", request);
+		}
+	}
+}
+
+static int start_aio_request(sfs_t *fs, int is_write, int fd, char *buffer, int length, int offset, sfs_aio_callback callback, void *arg) {
+	pthread_mutex_lock(&aio_lock);
+
+	if (!aio_workers_started) {
+		sfs_workers_start(&aio_workers, AIO_NUM_WORKERS);
+		aio_workers_started = 1;
+	}
+
+	if (aio_first_free < 0) {
+		int new_num_aio_requests = num_aio_requests > 0 ? 2 * num_aio_requests : 16;
+		struct aio_request *new_aio_requests = calloc_or_exit(new_num_aio_requests, sizeof(struct aio_request));
+		if (aio_requests != NULL) {
+			memcpy(new_aio_requests, aio_requests, num_aio_requests * sizeof(struct aio_request));
+			free(aio_requests);
+		}
+		for (int i = new_num_aio_requests - 1; i >= num_aio_requests; i--) {
+			new_aio_requests[i].next_free = aio_first_free;
+			aio_first_free = i;
+		}
+		aio_requests = new_aio_requests;
+		num_aio_requests = new_num_aio_requests;
+	}
+
+	int request = aio_first_free;
+	struct aio_request *r = aio_requests + request;
+	aio_first_free = r->next_free;
+	r->active = 1;
+	r->fs = fs;
+	r->is_write = is_write;
+	r->fd = fd;
+	r->buffer = buffer;
+	r->length = length;
+	r->offset = offset;
+	r->callback = callback;
+	r->arg = arg;
+	r->done = 0;
+	r->result = 0;
+	fs->num_aio_pending++;
+
+	pthread_mutex_unlock(&aio_lock);
+
+	sfs_workers_submit(&aio_workers, run_aio_request, (void *) (intptr_t) request);
+	return request;
+}
+
+/*
+ * Returns the asynchronous request with the given handle if its result can be
+ * collected (it is in use and has no callback), otherwise returns NULL. The
+ * caller must hold aio_lock.
+ */
+static struct aio_request *get_pollable_aio_request(int request) {
+	if (request < 0 || request >= num_aio_requests) {
+		return NULL;
+	}
+
+	struct aio_request *r = aio_requests + request;
+	if (!r->active || r->callback != NULL) {
+		return NULL;
+	}
+	return r;
+}
+
+static int compare_pending_ops(const void *a, const void *b) {
+	const struct pending_op *op_a = a;
+	const struct pending_op *op_b = b;
+	if (op_a->sqe.fd != op_b->sqe.fd) {
+		return op_a->sqe.fd < op_b->sqe.fd ? -1 : 1;
 	}
+	return op_a->position - op_b->position;
+}
+
+static struct dir_cursor *get_active_dir_cursor(sfs_t *fs, int dirfd) {
+	if (dirfd < 0 || dirfd >= fs->num_dir_cursors || !fs->dir_cursors[dirfd].active) {
+		return NULL;
+	}
+	return fs->dir_cursors + dirfd;
+}
 
-	// Reuse the existing file descriptor if there is one
-	int existing_fd = sfs_ofdt_find_by_inode(&ofdt, inode_idx);
-	if (existing_fd >= 0) {
-		return existing_fd;
+/*
+ * Returns a file descriptor for the given inode, reusing the existing one if
+ * the file is already open, in which case a reference is added to it if
+ * add_ref is nonzero. If is_new is not NULL, it is set to whether a new
+ * descriptor was added.
+ */
+static int open_inode(sfs_t *fs, inode_idx inode_idx, rw_pointer rw_pointer, int add_ref, int *is_new) {
+	pthread_mutex_lock(&fs->ofdt_lock);
+	int fd = sfs_ofdt_find_by_inode(&fs->ofdt, inode_idx);
+	if (is_new != NULL) {
+		*is_new = fd < 0;
 	}
+	if (fd < 0) {
+		fd = sfs_ofdt_add_entry(&fs->ofdt, inode_idx, rw_pointer);
+	}
+	else if (add_ref) {
+		sfs_ofdt_ref_entry(&fs->ofdt, fd);
+	}
+	pthread_mutex_unlock(&fs->ofdt_lock);
 
-	int fd = sfs_ofdt_add_entry(&ofdt, inode_idx, rw_pointer);
 	return fd;
 }
 
-int sfs_fclose(int fd) {
-	int success = sfs_ofdt_remove_entry(&ofdt, fd);
+/*
+ * Does the work of sfs_pwrite() on the given file, which the caller must have
+ * locked for writing.
+ */
+static int write_file(sfs_t *fs, inode_idx inode_idx, const char *buffer, int length, int offset) {
+	// Same rule as sfs_fseek(): writing may extend the file but not leave a gap
+	if (offset < 0 || offset > fs->inode_table.entries[inode_idx].size) {
+		return -1;
+	}
 
-	return success ? 0 : -1;
+	// Blocks for new data are only assigned when the data is flushed, so
+	// that many small appends still end up contiguous on disk
+	int num_bytes_written = sfs_inode_buffered_write(&fs->inode_table, inode_idx, offset, length, buffer);
+	sfs_freebitmap_flush(&fs->free_bitmap);
+	forget_borrowed_blocks(fs, inode_idx);
+
+	return num_bytes_written;
 }
 
-int sfs_fwrite(int fd, const char *buffer, int length) {
-	struct ofdt_entry *ofdt_entry = sfs_ofdt_get_active_entry(&ofdt, fd);
-	if (ofdt_entry == NULL) {
+/*
+ * Does the work of sfs_pread() on the given file, which the caller must have
+ * locked.
+ */
+static int read_file(sfs_t *fs, inode_idx inode_idx, char *buffer, int length, int offset) {
+	if (offset < 0) {
 		return -1;
 	}
+	return sfs_inode_read(&fs->inode_table, inode_idx, offset, length, buffer);
+}
 
-	int num_bytes_written = sfs_inode_write(&inode_table, ofdt_entry->inode_idx, ofdt_entry->rw_pointer, length, buffer);
+/*
+ * Does the work of sfs_getfilesize() without taking any lock, using only the
+ * dentry cache and the published inodes (see sfs_inode_snapshot()). Each entry
+ * of the dentry cache that the walk used is checked again once the inode has
+ * been read, so the answer held at that point.
+ *
+ * Returns zero if the path must be looked up under dir_lock instead: a
+ * component is not in the cache, the path is too deep or names a directory, or
+ * something changed during the walk. Otherwise, returns a nonzero number and
+ * sets *size to the size of the file, or to -1 if it does not exist.
+ */
+static int get_file_size_unlocked(sfs_t *fs, const char *path, int *size) {
+	struct {
+		inode_idx parent;
+		char name[MAXFILENAME];
+		unsigned int version;
+	} components[MAX_UNLOCKED_DEPTH];
+	int depth = 0;
 
-	if (num_bytes_written > 0) {
-		ofdt_entry->rw_pointer += num_bytes_written;
+	inode_idx inode_idx = fs->super_block.dir_inode_idx;
+	const char *component = path;
+	while (*component == '/') {
+		component++;
 	}
+	while (*component != '\0') {
+		const char *end = strchr(component, '/');
+		if (end == NULL) {
+			end = component + strlen(component);
+		}
 
-	return num_bytes_written;
+		int length = end - component;
+		if (length >= MAXFILENAME || depth == MAX_UNLOCKED_DEPTH) {
+			return 0;
+		}
+		components[depth].parent = inode_idx;
+		memcpy(components[depth].name, component, length);
+		components[depth].name[length] = '\0';
+		if (!sfs_dcache_lookup_unlocked(&fs->dcache, inode_idx, components[depth].name, &inode_idx, &components[depth].version)) {
+			return 0;
+		}
+		depth++;
+		if (inode_idx == INODE_NULL) {
+			// Only the files of directories that exist are cached, so a
+			// negative entry anywhere in the path means it does not exist
+			break;
+		}
+
+		while (*end == '/') {
+			end++;
+		}
+		component = end;
+	}
+
+	struct inode inode;
+	if (inode_idx != INODE_NULL) {
+		if (inode_idx == fs->super_block.dir_inode_idx || !sfs_inode_snapshot(&fs->inode_table, inode_idx, &inode) || inode.type != INODE_TYPE_FILE) {
+			return 0;
+		}
+	}
+	for (int i = 0; i < depth; i++) {
+		if (!sfs_dcache_unchanged(&fs->dcache, components[i].parent, components[i].name, components[i].version)) {
+			return 0;
+		}
+	}
+
+	*size = inode_idx != INODE_NULL ? inode.size : -1;
+	return 1;
 }
 
-int sfs_fread(int fd, char *buffer, int length) {
-	struct ofdt_entry *ofdt_entry = sfs_ofdt_get_active_entry(&ofdt, fd);
-	if (ofdt_entry == NULL) {
+/*
+ * Returns the size of the given regular file. The caller must hold dir_lock,
+ * which keeps the file from being removed.
+ */
+static int get_file_size(sfs_t *fs, inode_idx inode_idx) {
+	sfs_inode_read_lock(&fs->inode_table, inode_idx);
+	int size = fs->inode_table.entries[inode_idx].size;
+	sfs_inode_unlock(&fs->inode_table, inode_idx);
+	return size;
+}
+
+
+/*
+ * Each volume has its own disk and in-memory state, and its own locks, so
+ * calls into different volumes do not wait for each other. Volumes that are
+ * still mounted at exit are unmounted then.
+ */
+sfs_t *sfs_mount(const char *path, const struct sfs_options *options) {
+	sfs_t *fs = calloc_or_exit(1, sizeof(sfs_t));
+	init_locks(fs);
+	fs->disk = new_disk();
+
+	{
+		ENTER_FS(fs);
+
+		int fresh = options != NULL && options->fresh;
+		fs->super_block = fresh ? sfs_base_init_fresh_disk(path) : sfs_base_init_old_disk(path);
+		if (fs->super_block.block_size > 0) {
+			if (fresh) {
+				fs->inode_table = sfs_inode_new_table(&fs->super_block, &fs->free_bitmap);
+				fs->free_bitmap = sfs_freebitmap_new(&fs->super_block);
+				fs->block_cache = sfs_cache_new(&fs->inode_table);
+				fs->borrow_cache = sfs_cache_new(&fs->inode_table);
+				fs->directories = calloc_or_exit(fs->inode_table.size, sizeof(struct directory *));
+				fs->directories[fs->super_block.dir_inode_idx] = calloc_or_exit(1, sizeof(struct directory));
+				*fs->directories[fs->super_block.dir_inode_idx] = sfs_directory_new(&fs->super_block, &fs->inode_table, &fs->block_cache);
+				sfs_freebitmap_flush(&fs->free_bitmap);
+			}
+			else {
+				fs->inode_table = sfs_inode_table_from_disk(&fs->super_block, &fs->free_bitmap);
+				fs->free_bitmap = sfs_freebitmap_from_disk(&fs->super_block);
+				fs->block_cache = sfs_cache_new(&fs->inode_table);
+				fs->borrow_cache = sfs_cache_new(&fs->inode_table);
+				// Directories are read from the disk as paths reach them
+				fs->directories = calloc_or_exit(fs->inode_table.size, sizeof(struct directory *));
+			}
+
+			fs->dcache = sfs_dcache_new();
+			fs->ofdt = sfs_ofdt_new(fs->inode_table.size);
+			fs->current_dir_inode = INODE_NULL;
+			fs->current_file_idx = 0;
+		}
+	}
+
+	// The disk could not be opened
+	if (fs->super_block.block_size == 0) {
+		free_disk(fs->disk);
+		destroy_locks(fs);
+		free(fs);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&mount_lock);
+	if (!exit_func_registered) {
+		atexit(unmount_all);
+		exit_func_registered = 1;
+	}
+	fs->next_mounted = mounted;
+	mounted = fs;
+	pthread_mutex_unlock(&mount_lock);
+
+	return fs;
+}
+
+int sfs_unmount(sfs_t *fs) {
+	// The workers would use the volume after it is freed
+	pthread_mutex_lock(&aio_lock);
+	int num_aio_pending = fs->num_aio_pending;
+	pthread_mutex_unlock(&aio_lock);
+	if (num_aio_pending > 0) {
 		return -1;
 	}
 
-	int num_bytes_read = sfs_inode_read(&inode_table, ofdt_entry->inode_idx, ofdt_entry->rw_pointer, length, buffer);
+	unmount(fs);
+	return 0;
+}
 
-	if (num_bytes_read > 0) {
-		ofdt_entry->rw_pointer += num_bytes_read;
+void mksfs(int fresh) {
+	if (default_fs != NULL) {
+		unmount(default_fs);
 	}
 
-	return num_bytes_read;
+	struct sfs_options options = {fresh};
+	default_fs = sfs_mount(SFS_FILENAME, &options);
+	if (default_fs == NULL) {
+		exit(EXIT_FAILURE);
+	}
 }
 
-int sfs_fseek(int fd, int location) {
-	struct ofdt_entry *ofdt_entry = sfs_ofdt_get_active_entry(&ofdt, fd);
-	if (ofdt_entry == NULL) {
+int sfs_fs_getnextfilename(sfs_t *fs, char *filename) {
+	return sfs_fs_getnextfilename_in(fs, "/", filename);
+}
+
+int sfs_fs_getnextfilename_in(sfs_t *fs, const char *path, char *filename) {
+	ENTER_FS(fs);
+	LOCK_DIRS(fs);
+
+	struct directory *dir = get_directory(fs, resolve_path(fs, path));
+	if (dir == NULL) {
+		return 0;
+	}
+
+	// Start over when switching to another directory
+	if (dir->inode_idx != fs->current_dir_inode) {
+		fs->current_dir_inode = dir->inode_idx;
+		fs->current_file_idx = 0;
+	}
+
+	// Skip the free slots left behind by removed files
+	while (fs->current_file_idx < dir->header.num_slots) {
+		inode_idx inode_idx = sfs_directory_read_slot(dir, fs->current_file_idx, filename);
+		fs->current_file_idx++;
+		if (inode_idx != INODE_NULL) {
+			return 1;
+		}
+	}
+
+	fs->current_file_idx = 0;
+	return 0;
+}
+
+int sfs_fs_opendir(sfs_t *fs, const char *path) {
+	ENTER_FS(fs);
+	LOCK_DIRS(fs);
+
+	struct directory *dir = get_directory(fs, resolve_path(fs, path));
+	if (dir == NULL) {
 		return -1;
 	}
 
-	// Don't allow seeking past the end of the file and obviously don't allow seeking to negative location
-	struct inode *inode = inode_table.entries + ofdt_entry->inode_idx;
-	if (location < 0 || location > inode->size) {
+	int dirfd = 0;
+	while (dirfd < fs->num_dir_cursors && fs->dir_cursors[dirfd].active) {
+		dirfd++;
+	}
+	if (dirfd == fs->num_dir_cursors) {
+		int new_num_dir_cursors = fs->num_dir_cursors > 0 ? 2 * fs->num_dir_cursors : 4;
+		struct dir_cursor *new_dir_cursors = calloc_or_exit(new_num_dir_cursors, sizeof(struct dir_cursor));
+		if (fs->dir_cursors != NULL) {
+			memcpy(new_dir_cursors, fs->dir_cursors, fs->num_dir_cursors * sizeof(struct dir_cursor));
+			free(fs->dir_cursors);
+		}
+		fs->dir_cursors = new_dir_cursors;
+		fs->num_dir_cursors = new_num_dir_cursors;
+	}
+
+	fs->dir_cursors[dirfd].active = 1;
+	fs->dir_cursors[dirfd].dir_inode = dir->inode_idx;
+	fs->dir_cursors[dirfd].offset = 0;
+
+	return dirfd;
+}
+
+int sfs_fs_readdir(sfs_t *fs, int dirfd, struct sfs_dirent *entries, int max_entries) {
+	ENTER_FS(fs);
+	LOCK_DIRS(fs);
+
+	struct dir_cursor *cursor = get_active_dir_cursor(fs, dirfd);
+	if (cursor == NULL || max_entries < 0) {
 		return -1;
 	}
 
-	ofdt_entry->rw_pointer = location;
+	// The directory was removed while it was open
+	struct directory *dir = get_directory(fs, cursor->dir_inode);
+	if (dir == NULL) {
+		return 0;
+	}
 
-	return 0;
+	int num_entries = 0;
+	while (num_entries < max_entries && cursor->offset < dir->header.num_slots) {
+		struct sfs_dirent *entry = entries + num_entries;
+		inode_idx inode_idx = sfs_directory_read_slot(dir, cursor->offset, entry->name);
+		cursor->offset++;
+		if (inode_idx == INODE_NULL) {
+			continue;
+		}
+
+		entry->is_dir = is_directory(fs, inode_idx);
+		entry->size = entry->is_dir ? fs->inode_table.entries[inode_idx].size : get_file_size(fs, inode_idx);
+		entry->next_offset = cursor->offset;
+		num_entries++;
+	}
+
+	return num_entries;
 }
 
-int sfs_remove(const char *filename) {
-	// File not found
-	inode_idx inode_idx = sfs_directory_get_inode(&directory, filename);
-	if (inode_idx == INODE_NULL) {
+int sfs_fs_telldir(sfs_t *fs, int dirfd) {
+	LOCK_DIRS(fs);
+
+	struct dir_cursor *cursor = get_active_dir_cursor(fs, dirfd);
+	return cursor != NULL ? cursor->offset : -1;
+}
+
+int sfs_fs_seekdir(sfs_t *fs, int dirfd, int offset) {
+	LOCK_DIRS(fs);
+
+	struct dir_cursor *cursor = get_active_dir_cursor(fs, dirfd);
+	if (cursor == NULL || offset < 0) {
 		return -1;
 	}
 
-	// Don't remove open files
-	if (sfs_ofdt_find_by_inode(&ofdt, inode_idx) >= 0) {
+	cursor->offset = offset;
+	return 0;
+}
+
+int sfs_fs_closedir(sfs_t *fs, int dirfd) {
+	LOCK_DIRS(fs);
+
+	struct dir_cursor *cursor = get_active_dir_cursor(fs, dirfd);
+	if (cursor == NULL) {
 		return -1;
 	}
 
-	int success = sfs_directory_remove_file(&directory, filename);
+	memset(cursor, 0, sizeof *cursor);
+	return 0;
+}
 
-	// TODO: Should things get flushed automatically here? Check every occurrence of sfs_freebitmap_flush()
-	sfs_freebitmap_flush(&free_bitmap);
+/*
+ * Paths that are in the dentry cache are answered without taking any lock,
+ * so that stat-heavy callers do not wait for each other. The rest are looked
+ * up under dir_lock, which also caches them.
+ */
+int sfs_fs_getfilesize(sfs_t *fs, const char *filename) {
+	ENTER_FS(fs);
 
-	return success ? 0 : -1;
+	int size;
+	if (get_file_size_unlocked(fs, filename, &size)) {
+		return size;
+	}
+
+	inode_idx inode_idx;
+	{
+		LOCK_DIRS(fs);
+
+		inode_idx = resolve_path(fs, filename);
+		if (inode_idx == INODE_NULL) {
+			return -1;
+		}
+		// Directories only change while holding dir_lock
+		if (is_directory(fs, inode_idx)) {
+			return fs->inode_table.entries[inode_idx].size;
+		}
+	}
+
+	// The file is read without holding dir_lock, so that a long write to it
+	// does not hold up every path lookup. If the file was removed in the
+	// meantime, its inode is free or is a new regular file.
+	sfs_inode_read_lock(&fs->inode_table, inode_idx);
+	struct inode *inode = fs->inode_table.entries + inode_idx;
+	size = inode->type == INODE_TYPE_FILE ? inode->size : -1;
+	sfs_inode_unlock(&fs->inode_table, inode_idx);
+
+	return size;
+}
+
+int sfs_fs_isdir(sfs_t *fs, const char *path) {
+	ENTER_FS(fs);
+	LOCK_DIRS(fs);
+
+	return is_directory(fs, resolve_path(fs, path));
+}
+
+/*
+ * Does the work of sfs_fopen() and sfs_open(), which differ in whether opening
+ * a file that is already open adds a reference to its descriptor.
+ */
+static int open_file(sfs_t *fs, const char *filename, int add_ref) {
+	ENTER_FS(fs);
+	LOCK_DIRS(fs);
+
+	char name[MAXFILENAME];
+	struct directory *dir = resolve_parent(fs, filename, name);
+	if (dir == NULL || name[0] == '\0') {
+		return -1;
+	}
+
+	inode_idx inode_idx = lookup(fs, dir, name);
+
+	rw_pointer rw_pointer;
+	if (inode_idx == INODE_NULL) {
+		inode_idx = sfs_directory_add_file(dir, name);
+		sfs_freebitmap_flush(&fs->free_bitmap);
+		if (inode_idx == INODE_NULL) {
+			return -1;
+		}
+		sfs_dcache_insert(&fs->dcache, dir->inode_idx, name, inode_idx);
+
+		rw_pointer = 0;
+	}
+	else if (is_directory(fs, inode_idx)) {
+		return -1;
+	}
+	else {
+		rw_pointer = get_file_size(fs, inode_idx);
+	}
+
+	return open_inode(fs, inode_idx, rw_pointer, add_ref, NULL);
+}
+
+int sfs_fs_fopen(sfs_t *fs, const char* filename) {
+	return open_file(fs, filename, 0);
+}
+
+/*
+ * Same as sfs_fopen(), except that every call adds a reference to the
+ * descriptor and the file stays open until each one is dropped with
+ * sfs_release(). This lets independent users, like the open files of the FUSE
+ * wrappers, share the single descriptor of a file.
+ */
+int sfs_fs_open(sfs_t *fs, const char *filename) {
+	return open_file(fs, filename, 1);
+}
+
+/*
+ * If the directory blocks cannot be written at the end, every descriptor that
+ * the call opened is closed again (files that were already open stay open),
+ * their entries in fds are set to -1 and -1 is returned.
+ */
+int sfs_fs_create_many(sfs_t *fs, const char **filenames, int n, int *fds) {
+	ENTER_FS(fs);
+	pthread_mutex_lock(&fs->dir_lock);
+
+	// Find the names that need to be created and how many go in each
+	// directory, so that everything can be reserved up front
+	struct directory **dirs = calloc_or_exit(n + 1, sizeof(struct directory *));
+	char (*names)[MAXFILENAME] = calloc_or_exit(n + 1, MAXFILENAME);
+	int *num_new_in_dir = calloc_or_exit(fs->inode_table.size, sizeof(int));
+	int num_new = 0;
+	for (int i = 0; i < n; i++) {
+		fds[i] = -1;
+		dirs[i] = resolve_parent(fs, filenames[i], names[i]);
+		if (dirs[i] == NULL || names[i][0] == '\0') {
+			dirs[i] = NULL;
+		}
+		else if (lookup(fs, dirs[i], names[i]) == INODE_NULL) {
+			num_new_in_dir[dirs[i]->inode_idx]++;
+			num_new++;
+		}
+	}
+
+	inode_idx *new_inodes = calloc_or_exit(num_new + 1, sizeof(inode_idx));
+	int num_unused = 0;
+	int reserved = sfs_inode_reserve_inodes(&fs->inode_table, INODE_TYPE_FILE, num_new, new_inodes);
+	if (reserved) {
+		num_unused = num_new;
+	}
+	for (inode_idx d = 0; d < fs->inode_table.size && reserved; d++) {
+		if (num_new_in_dir[d] > 0) {
+			reserved = sfs_directory_reserve(fs->directories[d], num_new_in_dir[d]);
+		}
+	}
+
+	int num_opened = 0;
+	int success = 1;
+	// Whether each descriptor in fds was added by this call
+	int *opened_here = calloc_or_exit(n + 1, sizeof(int));
+	if (reserved) {
+		// Every directory block is written once, at the end of the batch
+		sfs_cache_begin_batch(&fs->block_cache);
+		int next_inode = 0;
+		for (int i = 0; i < n; i++) {
+			if (dirs[i] == NULL) {
+				continue;
+			}
+
+			// Look the name up again, since it may appear twice
+			inode_idx inode_idx = lookup(fs, dirs[i], names[i]);
+			rw_pointer rw_pointer = 0;
+			if (inode_idx == INODE_NULL) {
+				if (next_inode < num_new && sfs_directory_link(dirs[i], names[i], new_inodes[next_inode])) {
+					inode_idx = new_inodes[next_inode];
+					next_inode++;
+					sfs_dcache_insert(&fs->dcache, dirs[i]->inode_idx, names[i], inode_idx);
+				}
+			}
+			else if (is_directory(fs, inode_idx)) {
+				inode_idx = INODE_NULL;
+			}
+			else {
+				rw_pointer = get_file_size(fs, inode_idx);
+			}
+
+			if (inode_idx != INODE_NULL) {
+				fds[i] = open_inode(fs, inode_idx, rw_pointer, 0, opened_here + i);
+				num_opened++;
+			}
+		}
+		success = sfs_cache_end_batch(&fs->block_cache);
+		num_unused = num_new - next_inode;
+	}
+
+	if (!success) {
+		pthread_mutex_lock(&fs->ofdt_lock);
+		for (int i = 0; i < n; i++) {
+			if (!opened_here[i]) {
+				continue;
+			}
+			// A name given twice has the same descriptor both times
+			sfs_ofdt_remove_entry(&fs->ofdt, fds[i]);
+			for (int j = n - 1; j >= i; j--) {
+				if (fds[j] == fds[i]) {
+					fds[j] = -1;
+				}
+			}
+		}
+		pthread_mutex_unlock(&fs->ofdt_lock);
+	}
+
+	// Release the inodes that were not needed after all
+	for (int i = num_new - num_unused; i < num_new; i++) {
+		sfs_inode_write_lock(&fs->inode_table, new_inodes[i]);
+		sfs_inode_delete_file(&fs->inode_table, new_inodes[i]);
+		sfs_inode_unlock(&fs->inode_table, new_inodes[i]);
+	}
+	sfs_freebitmap_flush(&fs->free_bitmap);
+	pthread_mutex_unlock(&fs->dir_lock);
+
+	if (!reserved) {
+		// Not enough space to do it all at once, so create the files one by one
+		for (int i = 0; i < n; i++) {
+			fds[i] = sfs_fs_fopen(fs, filenames[i]);
+			if (fds[i] >= 0) {
+				num_opened++;
+			}
+		}
+	}
+
+	free(opened_here);
+	free(new_inodes);
+	free(num_new_in_dir);
+	free(names);
+	free(dirs);
+
+	return success ? num_opened : -1;
+}
+
+int sfs_fs_fclose(sfs_t *fs, int fd) {
+	pthread_mutex_lock(&fs->ofdt_lock);
+	int success = sfs_ofdt_remove_entry(&fs->ofdt, fd);
+	pthread_mutex_unlock(&fs->ofdt_lock);
+
+	return success ? 0 : -1;
+}
+
+/*
+ * Drops a reference added by sfs_open() (or the one sfs_fopen() starts with)
+ * and closes the file once no reference is left. sfs_fclose() closes the file
+ * right away, whatever its references.
+ */
+int sfs_fs_release(sfs_t *fs, int fd) {
+	pthread_mutex_lock(&fs->ofdt_lock);
+	int success = sfs_ofdt_unref_entry(&fs->ofdt, fd);
+	pthread_mutex_unlock(&fs->ofdt_lock);
+
+	return success ? 0 : -1;
+}
+
+int sfs_fs_fwrite(sfs_t *fs, int fd, const char *buffer, int length) {
+	ENTER_FS(fs);
+	LOCK_FD(file, fs, fd, 1);
+	if (file.inode_idx == INODE_NULL) {
+		return -1;
+	}
+
+	rw_pointer rw_pointer = get_rw_pointer(fs, fd);
+	int num_bytes_written = write_file(fs, file.inode_idx, buffer, length, rw_pointer);
+
+	if (num_bytes_written > 0) {
+		set_rw_pointer(fs, fd, rw_pointer + num_bytes_written);
+	}
+
+	return num_bytes_written;
+}
+
+int sfs_fs_fread(sfs_t *fs, int fd, char *buffer, int length) {
+	ENTER_FS(fs);
+	LOCK_FD(file, fs, fd, 0);
+	if (file.inode_idx == INODE_NULL) {
+		return -1;
+	}
+
+	rw_pointer rw_pointer = get_rw_pointer(fs, fd);
+	int num_bytes_read = read_file(fs, file.inode_idx, buffer, length, rw_pointer);
+
+	if (num_bytes_read > 0) {
+		set_rw_pointer(fs, fd, rw_pointer + num_bytes_read);
+	}
+
+	return num_bytes_read;
+}
+
+int sfs_fs_pwrite(sfs_t *fs, int fd, const char *buffer, int length, int offset) {
+	ENTER_FS(fs);
+	LOCK_FD(file, fs, fd, 1);
+	if (file.inode_idx == INODE_NULL) {
+		return -1;
+	}
+
+	return write_file(fs, file.inode_idx, buffer, length, offset);
+}
+
+/*
+ * Files whose blocks are all on disk are read without taking any lock (see
+ * sfs_inode_read_unlocked()), and the descriptor is checked again after the
+ * read, as lock_fd() does. Otherwise, or if a writer got in the way, only the
+ * read lock of the file is taken, so any number of threads can read it at
+ * once.
+ */
+int sfs_fs_pread(sfs_t *fs, int fd, char *buffer, int length, int offset) {
+	ENTER_FS(fs);
+
+	inode_idx inode_idx = sfs_ofdt_peek_inode(&fs->ofdt, fd);
+	if (inode_idx != INODE_NULL) {
+		int num_bytes_read = sfs_inode_read_unlocked(&fs->inode_table, inode_idx, offset, length, buffer);
+		if (num_bytes_read >= 0 && sfs_ofdt_peek_inode(&fs->ofdt, fd) == inode_idx) {
+			return num_bytes_read;
+		}
+	}
+
+	LOCK_FD(file, fs, fd, 0);
+	if (file.inode_idx == INODE_NULL) {
+		return -1;
+	}
+
+	return read_file(fs, file.inode_idx, buffer, length, offset);
+}
+
+/*
+ * The buffers are gathered into one and written in a single call, as with
+ * sfs_pwrite(), so the block map is resolved, the data written and the inode
+ * and free bitmap flushed once for the whole request.
+ */
+int sfs_fs_writev(sfs_t *fs, int fd, const struct iovec *iov, int iovcnt) {
+	ENTER_FS(fs);
+	LOCK_FD(file, fs, fd, 1);
+	int length = get_iovec_length(iov, iovcnt);
+	if (file.inode_idx == INODE_NULL || length < 0) {
+		return -1;
+	}
+	if (length == 0) {
+		return 0;
+	}
+
+	char *buffer = malloc(length);
+	if (buffer == NULL) {
+		return -1;
+	}
+	int position = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(buffer + position, iov[i].iov_base, iov[i].iov_len);
+		position += iov[i].iov_len;
+	}
+
+	rw_pointer rw_pointer = get_rw_pointer(fs, fd);
+	int num_bytes_written = write_file(fs, file.inode_idx, buffer, length, rw_pointer);
+	free(buffer);
+
+	if (num_bytes_written > 0) {
+		set_rw_pointer(fs, fd, rw_pointer + num_bytes_written);
+	}
+
+	return num_bytes_written;
+}
+
+/*
+ * Reads the whole range at once, as with sfs_pread(), and scatters it into the
+ * buffers.
+ */
+int sfs_fs_readv(sfs_t *fs, int fd, const struct iovec *iov, int iovcnt) {
+	ENTER_FS(fs);
+	LOCK_FD(file, fs, fd, 0);
+	int length = get_iovec_length(iov, iovcnt);
+	if (file.inode_idx == INODE_NULL || length < 0) {
+		return -1;
+	}
+	if (length == 0) {
+		return 0;
+	}
+
+	char *buffer = malloc(length);
+	if (buffer == NULL) {
+		return -1;
+	}
+	rw_pointer rw_pointer = get_rw_pointer(fs, fd);
+	int num_bytes_read = read_file(fs, file.inode_idx, buffer, length, rw_pointer);
+
+	int position = 0;
+	for (int i = 0; i < iovcnt && position < num_bytes_read; i++) {
+		int n = num_bytes_read - position;
+		if (n > (int) iov[i].iov_len) {
+			n = iov[i].iov_len;
+		}
+		memcpy(iov[i].iov_base, buffer + position, n);
+		position += n;
+	}
+	free(buffer);
+
+	if (num_bytes_read > 0) {
+		set_rw_pointer(fs, fd, rw_pointer + num_bytes_read);
+	}
+
+	return num_bytes_read;
+}
+
+/*
+ * Each segment is the part of one block that falls in the range, pinned in a
+ * cache of file blocks, so the data is never copied past the cache. The number of
+ * blocks pinned at once is limited by MAX_BORROWED_BLOCKS, so fewer segments
+ * than asked for may be returned.
+ */
+int sfs_fs_read_borrow(sfs_t *fs, int fd, int offset, int length, struct sfs_segment *segments, int max_segments) {
+	ENTER_FS(fs);
+
+	const int block_size = fs->super_block.block_size;
+
+	LOCK_FD(file, fs, fd, 0);
+	if (file.inode_idx == INODE_NULL || offset < 0 || length < 0 || max_segments < 0) {
+		return -1;
+	}
+
+	struct inode *inode = fs->inode_table.entries + file.inode_idx;
+	int end = offset + length < inode->size ? offset + length : inode->size;
+
+	pthread_mutex_lock(&fs->borrow_lock);
+	int num_segments = 0;
+	while (offset < end && num_segments < max_segments && fs->num_borrowed_blocks < MAX_BORROWED_BLOCKS) {
+		int block_num = offset / block_size;
+		char *block = sfs_cache_try_get_block(&fs->borrow_cache, file.inode_idx, block_num);
+		if (block == NULL) {
+			break;
+		}
+		fs->num_borrowed_blocks++;
+
+		int block_end = (block_num + 1) * block_size;
+		segments[num_segments].data = block + offset % block_size;
+		segments[num_segments].length = (end < block_end ? end : block_end) - offset;
+		offset += segments[num_segments].length;
+		num_segments++;
+	}
+	pthread_mutex_unlock(&fs->borrow_lock);
+
+	// Nothing could be pinned
+	if (num_segments == 0 && offset < end && max_segments > 0) {
+		return -1;
+	}
+
+	return num_segments;
+}
+
+int sfs_fs_read_release(sfs_t *fs, struct sfs_segment *segments, int num_segments) {
+	pthread_mutex_lock(&fs->borrow_lock);
+	int success = 1;
+	for (int i = 0; i < num_segments; i++) {
+		if (sfs_cache_release(&fs->borrow_cache, segments[i].data)) {
+			fs->num_borrowed_blocks--;
+		}
+		else {
+			success = 0;
+		}
+	}
+	pthread_mutex_unlock(&fs->borrow_lock);
+
+	return success ? 0 : -1;
+}
+
+int sfs_fs_fseek(sfs_t *fs, int fd, int location) {
+	LOCK_FD(file, fs, fd, 0);
+	if (file.inode_idx == INODE_NULL) {
+		return -1;
+	}
+
+	// Don't allow seeking past the end of the file and obviously don't allow seeking to negative location
+	struct inode *inode = fs->inode_table.entries + file.inode_idx;
+	if (location < 0 || location > inode->size) {
+		return -1;
+	}
+
+	set_rw_pointer(fs, fd, location);
+
+	return 0;
+}
+
+int sfs_fs_fflush(sfs_t *fs, int fd) {
+	ENTER_FS(fs);
+	LOCK_FD(file, fs, fd, 1);
+	if (file.inode_idx == INODE_NULL) {
+		return -1;
+	}
+
+	sfs_inode_sync(&fs->inode_table, file.inode_idx);
+	sfs_freebitmap_flush(&fs->free_bitmap);
+
+	return 0;
+}
+
+int sfs_fs_fallocate(sfs_t *fs, int fd, int offset, int length) {
+	ENTER_FS(fs);
+	LOCK_FD(file, fs, fd, 1);
+	if (file.inode_idx == INODE_NULL) {
+		return -1;
+	}
+
+	int success = sfs_inode_allocate(&fs->inode_table, file.inode_idx, offset, length);
+	sfs_freebitmap_flush(&fs->free_bitmap);
+
+	return success ? 0 : -1;
+}
+
+int sfs_fs_ftruncate(sfs_t *fs, int fd, int size) {
+	ENTER_FS(fs);
+	LOCK_FD(file, fs, fd, 1);
+	if (file.inode_idx == INODE_NULL) {
+		return -1;
+	}
+
+	int success = sfs_inode_truncate(&fs->inode_table, file.inode_idx, size);
+	sfs_freebitmap_flush(&fs->free_bitmap);
+	forget_borrowed_blocks(fs, file.inode_idx);
+
+	// The file pointer never points past the end of the file (see sfs_fseek())
+	if (success && get_rw_pointer(fs, fd) > size) {
+		set_rw_pointer(fs, fd, size);
+	}
+
+	return success ? 0 : -1;
+}
+
+/*
+ * The data never leaves the file system: blocks that line up in both files are
+ * shared (see sfs_clone()) and the rest is copied a few blocks at a time. As
+ * with sfs_pwrite(), off_out may extend the file but not leave a gap, and
+ * neither file pointer moves.
+ */
+int sfs_fs_copy_range(sfs_t *fs, int fd_in, int off_in, int fd_out, int off_out, int length) {
+	ENTER_FS(fs);
+
+	inode_idx in_inode_idx = get_fd_inode(fs, fd_in);
+	inode_idx out_inode_idx = get_fd_inode(fs, fd_out);
+	if (in_inode_idx == INODE_NULL || out_inode_idx == INODE_NULL) {
+		return -1;
+	}
+
+	// Either file may have been closed while waiting for the locks (see
+	// lock_fd())
+	write_lock_pair(fs, in_inode_idx, out_inode_idx);
+	int num_bytes_copied = -1;
+	if (get_fd_inode(fs, fd_in) == in_inode_idx && get_fd_inode(fs, fd_out) == out_inode_idx) {
+		num_bytes_copied = sfs_inode_copy_range(&fs->inode_table, in_inode_idx, off_in, out_inode_idx, off_out, length);
+		sfs_freebitmap_flush(&fs->free_bitmap);
+		forget_borrowed_blocks(fs, out_inode_idx);
+	}
+	unlock_pair(fs, in_inode_idx, out_inode_idx);
+
+	return num_bytes_copied;
+}
+
+int sfs_fs_ring_setup(sfs_t *fs, int num_entries) {
+	HOLD_RING_LOCK(fs);
+
+	if (num_entries <= 0) {
+		return -1;
+	}
+
+	int ring = 0;
+	while (ring < fs->num_rings && fs->rings[ring] != NULL) {
+		ring++;
+	}
+	if (ring == fs->num_rings) {
+		int new_num_rings = fs->num_rings > 0 ? 2 * fs->num_rings : 4;
+		struct ioqueue **new_rings = calloc_or_exit(new_num_rings, sizeof(struct ioqueue *));
+		if (fs->rings != NULL) {
+			memcpy(new_rings, fs->rings, fs->num_rings * sizeof(struct ioqueue *));
+			free(fs->rings);
+		}
+		fs->rings = new_rings;
+		fs->num_rings = new_num_rings;
+	}
+
+	fs->rings[ring] = calloc_or_exit(1, sizeof(struct ioqueue));
+	*fs->rings[ring] = sfs_ioqueue_new(num_entries);
+
+	return ring;
+}
+
+struct sfs_sqe *sfs_fs_ring_get_sqe(sfs_t *fs, int ring) {
+	HOLD_RING_LOCK(fs);
+
+	struct ioqueue *queue = get_ring(fs, ring);
+	return queue != NULL ? sfs_ioqueue_get_sqe(queue) : NULL;
+}
+
+/*
+ * Performs a run of reads and writes. They are sorted by file descriptor
+ * (keeping the order of operations on the same file, which may overlap), and
+ * consecutive writes to the same file where each one starts where the last
+ * one ended are merged into a single write.
+ */
+static void submit_io_run(sfs_t *fs, struct pending_op *ops, int num_ops) {
+	qsort(ops, num_ops, sizeof(struct pending_op), compare_pending_ops);
+
+	int i = 0;
+	while (i < num_ops) {
+		struct sfs_sqe *sqe = &ops[i].sqe;
+		if (sqe->opcode == SFS_OP_PREAD) {
+			ops[i].result = sfs_fs_pread(fs, sqe->fd, sqe->buffer, sqe->length, sqe->offset);
+			i++;
+			continue;
+		}
+
+		// Only writes of at least one byte are merged. The others are passed
+		// to sfs_pwrite() alone, which decides what they return.
+		int length = sqe->length;
+		int end = i + 1;
+		while (length > 0
+				&& end < num_ops
+				&& ops[end].sqe.opcode == SFS_OP_PWRITE
+				&& ops[end].sqe.fd == sqe->fd
+				&& ops[end].sqe.offset == sqe->offset + length
+				&& ops[end].sqe.length > 0
+				&& ops[end].sqe.length <= INT_MAX - length) {
+			length += ops[end].sqe.length;
+			end++;
+		}
+
+		int result;
+		if (end == i + 1) {
+			result = sfs_fs_pwrite(fs, sqe->fd, sqe->buffer, sqe->length, sqe->offset);
+		}
+		else {
+			char *buffer = calloc_or_exit(length, 1);
+			int position = 0;
+			for (int j = i; j < end; j++) {
+				memcpy(buffer + position, ops[j].sqe.buffer, ops[j].sqe.length);
+				position += ops[j].sqe.length;
+			}
+			result = sfs_fs_pwrite(fs, sqe->fd, buffer, length, sqe->offset);
+			free(buffer);
+		}
+
+		// Split a merged write's result between the writes in it
+		int remaining = result > 0 ? result : 0;
+		for (int j = i; j < end; j++) {
+			int n = ops[j].sqe.length < remaining ? ops[j].sqe.length : remaining;
+			remaining -= n;
+			if (end > i + 1 && n == 0) {
+				n = -1;
+			}
+			ops[j].result = end == i + 1 ? result : n;
+		}
+		i = end;
+	}
+}
+
+/*
+ * Every operation is performed right away (in the calling thread), but the
+ * inode flushes they make are deferred to the end of the submission so that an
+ * inode changed by many operations is written once. Other threads, including
+ * ones calling sfs_fflush(), still write their inodes through. Runs of reads
+ * and writes between other operations are reordered and merged by
+ * submit_io_run(). The completions are posted once every operation is done, in
+ * the order they were performed.
+ */
+int sfs_fs_ring_submit(sfs_t *fs, int ring) {
+	struct pending_op *ops;
+	int num_ops;
+	{
+		HOLD_RING_LOCK(fs);
+
+		struct ioqueue *queue = get_ring(fs, ring);
+		if (queue == NULL) {
+			return -1;
+		}
+
+		// Only take as many operations as there is room for completions
+		num_ops = queue->sq_count < sfs_ioqueue_cq_space(queue) ? queue->sq_count : sfs_ioqueue_cq_space(queue);
+		if (num_ops == 0) {
+			return 0;
+		}
+		ops = calloc_or_exit(num_ops, sizeof(struct pending_op));
+		for (int i = 0; i < num_ops; i++) {
+			sfs_ioqueue_pop_sqe(queue, &ops[i].sqe);
+			ops[i].position = i;
+		}
+	}
+
+	// The operations lock what they use themselves
+	ENTER_FS(fs);
+	sfs_inode_begin_batch(&fs->inode_table);
+
+	int i = 0;
+	while (i < num_ops) {
+		struct sfs_sqe *sqe = &ops[i].sqe;
+		if (sqe->opcode == SFS_OP_PREAD || sqe->opcode == SFS_OP_PWRITE) {
+			int end = i + 1;
+			while (end < num_ops && (ops[end].sqe.opcode == SFS_OP_PREAD || ops[end].sqe.opcode == SFS_OP_PWRITE)) {
+				end++;
+			}
+			submit_io_run(fs, ops + i, end - i);
+			i = end;
+			continue;
+		}
+
+		int result;
+		switch (sqe->opcode) {
+			case SFS_OP_NOP:
+				result = 0;
+				break;
+			case SFS_OP_OPEN:
+				result = sfs_fs_fopen(fs, sqe->path);
+				break;
+			case SFS_OP_CLOSE:
+				result = sfs_fs_fclose(fs, sqe->fd);
+				break;
+			case SFS_OP_REMOVE:
+				result = sfs_fs_remove(fs, sqe->path);
+				break;
+			default:
+				result = -1;
+				break;
+		}
+		ops[i].result = result;
+		i++;
+	}
+
+	sfs_inode_end_batch(&fs->inode_table);
+
+	{
+		HOLD_RING_LOCK(fs);
+
+		// The ring may have been destroyed in the meantime
+		struct ioqueue *queue = get_ring(fs, ring);
+		for (int i = 0; i < num_ops && queue != NULL; i++) {
+			sfs_ioqueue_push_cqe(queue, ops[i].sqe.user_data, ops[i].result);
+		}
+	}
+
+	free(ops);
+	return num_ops;
+}
+
+int sfs_fs_ring_reap(sfs_t *fs, int ring, struct sfs_cqe *cqes, int max_cqes) {
+	HOLD_RING_LOCK(fs);
+
+	struct ioqueue *queue = get_ring(fs, ring);
+	if (queue == NULL || max_cqes < 0) {
+		return -1;
+	}
+
+	int num_cqes = 0;
+	while (num_cqes < max_cqes && sfs_ioqueue_pop_cqe(queue, cqes + num_cqes)) {
+		num_cqes++;
+	}
+	return num_cqes;
+}
+
+int sfs_fs_ring_destroy(sfs_t *fs, int ring) {
+	HOLD_RING_LOCK(fs);
+
+	struct ioqueue *queue = get_ring(fs, ring);
+	if (queue == NULL) {
+		return -1;
+	}
+
+	sfs_ioqueue_free(queue);
+	free(queue);
+	fs->rings[ring] = NULL;
+	return 0;
+}
+
+/*
+ * sfs_aread() and sfs_awrite() queue an sfs_pread() or sfs_pwrite() for the
+ * worker threads and return its handle right away. The buffer must stay valid
+ * until the request completes. If a callback is given, it is called with the
+ * result and the handle is released. Otherwise the result is collected with
+ * sfs_aio_poll() or sfs_aio_wait(). Either way, every completion increments
+ * the counter of the eventfd returned by sfs_aio_eventfd().
+ */
+int sfs_fs_aread(sfs_t *fs, int fd, char *buffer, int length, int offset, sfs_aio_callback callback, void *arg) {
+	return start_aio_request(fs, 0, fd, buffer, length, offset, callback, arg);
+}
+
+int sfs_fs_awrite(sfs_t *fs, int fd, const char *buffer, int length, int offset, sfs_aio_callback callback, void *arg) {
+	return start_aio_request(fs, 1, fd, (char *) buffer, length, offset, callback, arg);
+}
+
+int sfs_aio_poll(int request, int *result) {
+	pthread_mutex_lock(&aio_lock);
+
+	struct aio_request *r = get_pollable_aio_request(request);
+	int status = r == NULL ? -1 : r->done;
+	if (status == 1) {
+		*result = r->result;
+		release_aio_request(request);
+	}
+
+	pthread_mutex_unlock(&aio_lock);
+	return status;
+}
+
+int sfs_aio_wait(int request) {
+	pthread_mutex_lock(&aio_lock);
+
+	struct aio_request *r = get_pollable_aio_request(request);
+	int result = -1;
+	if (r != NULL) {
+		while (!aio_requests[request].done) {
+			pthread_cond_wait(&aio_done, &aio_lock);
+		}
+		// The requests may have been moved while waiting
+		result = aio_requests[request].result;
+		release_aio_request(request);
+	}
+
+	pthread_mutex_unlock(&aio_lock);
+	return result;
+}
+
+int sfs_aio_eventfd() {
+	pthread_mutex_lock(&aio_lock);
+	if (aio_event_fd < 0) {
+		aio_event_fd = eventfd(0, EFD_CLOEXEC);
+	}
+	int event_fd = aio_event_fd;
+	pthread_mutex_unlock(&aio_lock);
+
+	return event_fd;
+}
+
+int sfs_fs_remove(sfs_t *fs, const char *filename) {
+	ENTER_FS(fs);
+	LOCK_DIRS(fs);
+
+	// File not found
+	char name[MAXFILENAME];
+	struct directory *dir = resolve_parent(fs, filename, name);
+	if (dir == NULL || name[0] == '\0') {
+		return -1;
+	}
+	inode_idx inode_idx = lookup(fs, dir, name);
+	if (inode_idx == INODE_NULL) {
+		return -1;
+	}
+
+	// Directories are removed with sfs_rmdir()
+	if (is_directory(fs, inode_idx)) {
+		return -1;
+	}
+
+	// Don't remove open files. The file cannot be opened again while
+	// dir_lock is held.
+	pthread_mutex_lock(&fs->ofdt_lock);
+	int is_open = sfs_ofdt_find_by_inode(&fs->ofdt, inode_idx) >= 0;
+	pthread_mutex_unlock(&fs->ofdt_lock);
+	if (is_open) {
+		return -1;
+	}
+
+	// Wait for the calls that were still using the file
+	sfs_inode_write_lock(&fs->inode_table, inode_idx);
+	int success = sfs_directory_remove_file(dir, name);
+	forget_borrowed_blocks(fs, inode_idx);
+	sfs_inode_unlock(&fs->inode_table, inode_idx);
+	sfs_freebitmap_flush(&fs->free_bitmap);
+	if (success) {
+		sfs_dcache_insert(&fs->dcache, dir->inode_idx, name, INODE_NULL);
+	}
+
+	return success ? 0 : -1;
+}
+
+/*
+ * Creates dst as a copy of the regular file src without copying its data: the
+ * two files share their blocks until one of them writes to a block, at which
+ * point that file gets its own copy. dst must not exist yet.
+ */
+int sfs_fs_clone(sfs_t *fs, const char *src, const char *dst) {
+	ENTER_FS(fs);
+	LOCK_DIRS(fs);
+
+	inode_idx src_inode_idx = resolve_path(fs, src);
+	if (src_inode_idx == INODE_NULL || is_directory(fs, src_inode_idx)) {
+		return -1;
+	}
+
+	char name[MAXFILENAME];
+	struct directory *dir = resolve_parent(fs, dst, name);
+	if (dir == NULL || name[0] == '\0') {
+		return -1;
+	}
+
+	// Something with that name already exists
+	if (lookup(fs, dir, name) != INODE_NULL) {
+		return -1;
+	}
+
+	inode_idx inode_idx = sfs_directory_add_file(dir, name);
+	if (inode_idx == INODE_NULL) {
+		sfs_freebitmap_flush(&fs->free_bitmap);
+		return -1;
+	}
+
+	write_lock_pair(fs, src_inode_idx, inode_idx);
+	int success = sfs_inode_clone(&fs->inode_table, src_inode_idx, inode_idx);
+	if (!success) {
+		sfs_directory_remove_file(dir, name);
+	}
+	unlock_pair(fs, src_inode_idx, inode_idx);
+
+	sfs_freebitmap_flush(&fs->free_bitmap);
+	if (!success) {
+		return -1;
+	}
+	sfs_dcache_insert(&fs->dcache, dir->inode_idx, name, inode_idx);
+
+	return 0;
+}
+
+/*
+ * On failure, errno is set to EEXIST if the path already exists and ENOSPC if
+ * the inode table or the disk is full, or as resolve_parent() sets it.
+ */
+int sfs_fs_mkdir(sfs_t *fs, const char *path) {
+	ENTER_FS(fs);
+	LOCK_DIRS(fs);
+
+	char name[MAXFILENAME];
+	struct directory *dir = resolve_parent(fs, path, name);
+	if (dir == NULL) {
+		return -1;
+	}
+
+	// Something with that name already exists (or it is the root directory)
+	if (name[0] == '\0' || lookup(fs, dir, name) != INODE_NULL) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	inode_idx inode_idx = sfs_directory_add_subdirectory(dir, name);
+	sfs_freebitmap_flush(&fs->free_bitmap);
+	if (inode_idx == INODE_NULL) {
+		errno = ENOSPC;
+		return -1;
+	}
+	sfs_dcache_insert(&fs->dcache, dir->inode_idx, name, inode_idx);
+
+	return 0;
+}
+
+/*
+ * On failure, errno is set to EBUSY for the root directory, ENOENT if the
+ * path does not exist, ENOTDIR if it is not a directory, ENOTEMPTY if the
+ * directory still holds files and EIO if it could not be removed, or as
+ * resolve_parent() sets it.
+ */
+int sfs_fs_rmdir(sfs_t *fs, const char *path) {
+	ENTER_FS(fs);
+	LOCK_DIRS(fs);
+
+	char name[MAXFILENAME];
+	struct directory *dir = resolve_parent(fs, path, name);
+	if (dir == NULL) {
+		return -1;
+	}
+	// The root directory cannot be removed
+	if (name[0] == '\0') {
+		errno = EBUSY;
+		return -1;
+	}
+
+	inode_idx inode_idx = lookup(fs, dir, name);
+	struct directory *subdir = get_directory(fs, inode_idx);
+	if (subdir == NULL) {
+		errno = inode_idx == INODE_NULL ? ENOENT : ENOTDIR;
+		return -1;
+	}
+	if (subdir->header.num_files > 0) {
+		errno = ENOTEMPTY;
+		return -1;
+	}
+
+	sfs_directory_free(subdir);
+	free(subdir);
+	fs->directories[inode_idx] = NULL;
+	if (fs->current_dir_inode == inode_idx) {
+		fs->current_dir_inode = INODE_NULL;
+	}
+	for (int i = 0; i < fs->num_dir_cursors; i++) {
+		if (fs->dir_cursors[i].dir_inode == inode_idx) {
+			fs->dir_cursors[i].dir_inode = INODE_NULL;
+		}
+	}
+
+	// The dentry cache needs no other changes: every name that was in the
+	// subdirectory has already been replaced by a negative entry, which
+	// stays correct if the inode is reused for a new (empty) directory. The
+	// write lock publishes the inode as free (see sfs_inode_snapshot()).
+	sfs_inode_write_lock(&fs->inode_table, inode_idx);
+	int success = sfs_directory_remove_file(dir, name);
+	sfs_inode_unlock(&fs->inode_table, inode_idx);
+	sfs_freebitmap_flush(&fs->free_bitmap);
+	if (!success) {
+		errno = EIO;
+		return -1;
+	}
+	sfs_dcache_insert(&fs->dcache, dir->inode_idx, name, INODE_NULL);
+
+	return 0;
+}
+
+int sfs_fs_getdirstats(sfs_t *fs, const char *path, struct sfs_dirstats *stats) {
+	ENTER_FS(fs);
+	LOCK_DIRS(fs);
+
+	struct directory *dir = get_directory(fs, resolve_path(fs, path));
+	if (dir == NULL) {
+		return -1;
+	}
+
+	stats->num_lookups = dir->stats.num_lookups;
+	stats->num_filtered = dir->stats.num_filtered;
+	stats->num_false_positives = dir->stats.num_false_positives;
+	int num_misses = dir->stats.num_filtered + dir->stats.num_false_positives;
+	stats->false_positive_rate = num_misses > 0 ? (double) dir->stats.num_false_positives / num_misses : 0;
+	stats->filter_memory = dir->filter.counters != NULL ? sfs_bloom_memory_usage(&dir->filter) : 0;
+
+	return 0;
+}
+
+
+// The original API works on the volume set up by mksfs()
+
+int sfs_getnextfilename(char *filename) {
+	return sfs_fs_getnextfilename(default_fs, filename);
+}
+
+int sfs_getnextfilename_in(const char *path, char *filename) {
+	return sfs_fs_getnextfilename_in(default_fs, path, filename);
+}
+
+int sfs_opendir(const char *path) {
+	return sfs_fs_opendir(default_fs, path);
+}
+
+int sfs_readdir(int dirfd, struct sfs_dirent *entries, int max_entries) {
+	return sfs_fs_readdir(default_fs, dirfd, entries, max_entries);
+}
+
+int sfs_telldir(int dirfd) {
+	return sfs_fs_telldir(default_fs, dirfd);
+}
+
+int sfs_seekdir(int dirfd, int offset) {
+	return sfs_fs_seekdir(default_fs, dirfd, offset);
+}
+
+int sfs_closedir(int dirfd) {
+	return sfs_fs_closedir(default_fs, dirfd);
+}
+
+int sfs_getfilesize(const char *filename) {
+	return sfs_fs_getfilesize(default_fs, filename);
+}
+
+int sfs_isdir(const char *path) {
+	return sfs_fs_isdir(default_fs, path);
+}
+
+int sfs_fopen(const char* filename) {
+	return sfs_fs_fopen(default_fs, filename);
+}
+
+int sfs_open(const char *filename) {
+	return sfs_fs_open(default_fs, filename);
+}
+
+int sfs_create_many(const char **filenames, int n, int *fds) {
+	return sfs_fs_create_many(default_fs, filenames, n, fds);
+}
+
+int sfs_fclose(int fd) {
+	return sfs_fs_fclose(default_fs, fd);
+}
+
+int sfs_release(int fd) {
+	return sfs_fs_release(default_fs, fd);
+}
+
+int sfs_fwrite(int fd, const char *buffer, int length) {
+	return sfs_fs_fwrite(default_fs, fd, buffer, length);
+}
+
+int sfs_fread(int fd, char *buffer, int length) {
+	return sfs_fs_fread(default_fs, fd, buffer, length);
+}
+
+int sfs_pwrite(int fd, const char *buffer, int length, int offset) {
+	return sfs_fs_pwrite(default_fs, fd, buffer, length, offset);
+}
+
+int sfs_pread(int fd, char *buffer, int length, int offset) {
+	return sfs_fs_pread(default_fs, fd, buffer, length, offset);
+}
+
+int sfs_writev(int fd, const struct iovec *iov, int iovcnt) {
+	return sfs_fs_writev(default_fs, fd, iov, iovcnt);
+}
+
+int sfs_readv(int fd, const struct iovec *iov, int iovcnt) {
+	return sfs_fs_readv(default_fs, fd, iov, iovcnt);
+}
+
+int sfs_read_borrow(int fd, int offset, int length, struct sfs_segment *segments, int max_segments) {
+	return sfs_fs_read_borrow(default_fs, fd, offset, length, segments, max_segments);
+}
+
+int sfs_read_release(struct sfs_segment *segments, int num_segments) {
+	return sfs_fs_read_release(default_fs, segments, num_segments);
+}
+
+int sfs_fseek(int fd, int location) {
+	return sfs_fs_fseek(default_fs, fd, location);
+}
+
+int sfs_fflush(int fd) {
+	return sfs_fs_fflush(default_fs, fd);
+}
+
+int sfs_fallocate(int fd, int offset, int length) {
+	return sfs_fs_fallocate(default_fs, fd, offset, length);
+}
+
+int sfs_ftruncate(int fd, int size) {
+	return sfs_fs_ftruncate(default_fs, fd, size);
+}
+
+int sfs_copy_range(int fd_in, int off_in, int fd_out, int off_out, int length) {
+	return sfs_fs_copy_range(default_fs, fd_in, off_in, fd_out, off_out, length);
+}
+
+int sfs_ring_setup(int num_entries) {
+	return sfs_fs_ring_setup(default_fs, num_entries);
+}
+
+struct sfs_sqe *sfs_ring_get_sqe(int ring) {
+	return sfs_fs_ring_get_sqe(default_fs, ring);
+}
+
+int sfs_ring_submit(int ring) {
+	return sfs_fs_ring_submit(default_fs, ring);
+}
+
+int sfs_ring_reap(int ring, struct sfs_cqe *cqes, int max_cqes) {
+	return sfs_fs_ring_reap(default_fs, ring, cqes, max_cqes);
+}
+
+int sfs_ring_destroy(int ring) {
+	return sfs_fs_ring_destroy(default_fs, ring);
+}
+
+int sfs_aread(int fd, char *buffer, int length, int offset, sfs_aio_callback callback, void *arg) {
+	return sfs_fs_aread(default_fs, fd, buffer, length, offset, callback, arg);
+}
+
+int sfs_awrite(int fd, const char *buffer, int length, int offset, sfs_aio_callback callback, void *arg) {
+	return sfs_fs_awrite(default_fs, fd, buffer, length, offset, callback, arg);
+}
+
+int sfs_remove(const char *filename) {
+	return sfs_fs_remove(default_fs, filename);
+}
+
+int sfs_clone(const char *src, const char *dst) {
+	return sfs_fs_clone(default_fs, src, dst);
+}
+
+int sfs_mkdir(const char *path) {
+	return sfs_fs_mkdir(default_fs, path);
+}
+
+int sfs_rmdir(const char *path) {
+	return sfs_fs_rmdir(default_fs, path);
+}
+
+int sfs_getdirstats(const char *path, struct sfs_dirstats *stats) {
+	return sfs_fs_getdirstats(default_fs, path, stats);
 }
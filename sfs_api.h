@@ -2,27 +2,230 @@
 #define SFS_API_H
 
 
+#include <sys/uio.h>
+
 #include "sfs_base.h"
+#include "sfs_ioqueue.h"
 
 // You can add more into this file.
 
+// Lookup statistics of a directory. Lookups answered by the dentry cache
+// never reach the directory and are not counted.
+struct sfs_dirstats {
+	int num_lookups;
+	// Lookups of missing names answered by the Bloom filter alone
+	int num_filtered;
+	// Lookups of missing names that the Bloom filter let through
+	int num_false_positives;
+	// num_false_positives / (num_filtered + num_false_positives)
+	double false_positive_rate;
+	// Memory used by the Bloom filter, in bytes
+	int filter_memory;
+};
+
+// Mounted volume (see sfs_mount())
+typedef struct sfs sfs_t;
+
+// Options for sfs_mount()
+struct sfs_options {
+	// Nonzero to create a new empty volume instead of opening an existing one
+	int fresh;
+};
+
 void mksfs(int fresh);
 
+// Directory entry returned by sfs_readdir()
+struct sfs_dirent {
+	char name[MAXFILENAME];
+	// Size in bytes
+	int size;
+	// Nonzero if the entry is a directory
+	int is_dir;
+	// Offset to pass to sfs_seekdir() to resume right after this entry
+	int next_offset;
+};
+
+// Read-only part of a file returned by sfs_read_borrow()
+struct sfs_segment {
+	const char *data;
+	int length;
+};
+
+// Called on a worker thread when an asynchronous request completes
+typedef void (*sfs_aio_callback)(int request, int result, void *arg);
+
 int sfs_getnextfilename(char *filename);
 
+int sfs_getnextfilename_in(const char *path, char *filename);
+
+int sfs_opendir(const char *path);
+
+int sfs_readdir(int dirfd, struct sfs_dirent *entries, int max_entries);
+
+int sfs_telldir(int dirfd);
+
+int sfs_seekdir(int dirfd, int offset);
+
+int sfs_closedir(int dirfd);
+
 int sfs_getfilesize(const char *filename);
 
+int sfs_isdir(const char *path);
+
 int sfs_fopen(const char *filename);
 
+int sfs_open(const char *filename);
+
+int sfs_create_many(const char **filenames, int n, int *fds);
+
 int sfs_fclose(int fd);
 
+int sfs_release(int fd);
+
 int sfs_fwrite(int fd, const char *buffer, int length);
 
 int sfs_fread(int fd, char *buffer, int length);
 
+int sfs_pwrite(int fd, const char *buffer, int length, int offset);
+
+int sfs_pread(int fd, char *buffer, int length, int offset);
+
+int sfs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+int sfs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+int sfs_read_borrow(int fd, int offset, int length, struct sfs_segment *segments, int max_segments);
+
+int sfs_read_release(struct sfs_segment *segments, int num_segments);
+
 int sfs_fseek(int fd, int location);
 
+int sfs_fflush(int fd);
+
+int sfs_fallocate(int fd, int offset, int length);
+
+int sfs_ftruncate(int fd, int size);
+
+int sfs_copy_range(int fd_in, int off_in, int fd_out, int off_out, int length);
+
+// sfs_ring_submit() performs the queued operations in the calling thread and
+// returns once all of them have completed. Use sfs_aread() and sfs_awrite() to
+// wait for I/O on another thread instead.
+int sfs_ring_setup(int num_entries);
+
+struct sfs_sqe *sfs_ring_get_sqe(int ring);
+
+int sfs_ring_submit(int ring);
+
+int sfs_ring_reap(int ring, struct sfs_cqe *cqes, int max_cqes);
+
+int sfs_ring_destroy(int ring);
+
+int sfs_aread(int fd, char *buffer, int length, int offset, sfs_aio_callback callback, void *arg);
+
+int sfs_awrite(int fd, const char *buffer, int length, int offset, sfs_aio_callback callback, void *arg);
+
+int sfs_aio_poll(int request, int *result);
+
+int sfs_aio_wait(int request);
+
+int sfs_aio_eventfd();
+
 int sfs_remove(const char *filename);
 
+int sfs_clone(const char *src, const char *dst);
+
+int sfs_mkdir(const char *path);
+
+int sfs_rmdir(const char *path);
+
+int sfs_getdirstats(const char *path, struct sfs_dirstats *stats);
+
+// Each of the functions above, except the sfs_aio_*() ones (whose request
+// handles are shared by every volume), works on the volume set up by mksfs().
+// The ones below work on any mounted volume instead.
+
+sfs_t *sfs_mount(const char *path, const struct sfs_options *options);
+
+int sfs_unmount(sfs_t *fs);
+
+int sfs_fs_getnextfilename(sfs_t *fs, char *filename);
+
+int sfs_fs_getnextfilename_in(sfs_t *fs, const char *path, char *filename);
+
+int sfs_fs_opendir(sfs_t *fs, const char *path);
+
+int sfs_fs_readdir(sfs_t *fs, int dirfd, struct sfs_dirent *entries, int max_entries);
+
+int sfs_fs_telldir(sfs_t *fs, int dirfd);
+
+int sfs_fs_seekdir(sfs_t *fs, int dirfd, int offset);
+
+int sfs_fs_closedir(sfs_t *fs, int dirfd);
+
+int sfs_fs_getfilesize(sfs_t *fs, const char *filename);
+
+int sfs_fs_isdir(sfs_t *fs, const char *path);
+
+int sfs_fs_fopen(sfs_t *fs, const char* filename);
+
+int sfs_fs_open(sfs_t *fs, const char *filename);
+
+int sfs_fs_create_many(sfs_t *fs, const char **filenames, int n, int *fds);
+
+int sfs_fs_fclose(sfs_t *fs, int fd);
+
+int sfs_fs_release(sfs_t *fs, int fd);
+
+int sfs_fs_fwrite(sfs_t *fs, int fd, const char *buffer, int length);
+
+int sfs_fs_fread(sfs_t *fs, int fd, char *buffer, int length);
+
+int sfs_fs_pwrite(sfs_t *fs, int fd, const char *buffer, int length, int offset);
+
+int sfs_fs_pread(sfs_t *fs, int fd, char *buffer, int length, int offset);
+
+int sfs_fs_writev(sfs_t *fs, int fd, const struct iovec *iov, int iovcnt);
+
+int sfs_fs_readv(sfs_t *fs, int fd, const struct iovec *iov, int iovcnt);
+
+int sfs_fs_read_borrow(sfs_t *fs, int fd, int offset, int length, struct sfs_segment *segments, int max_segments);
+
+int sfs_fs_read_release(sfs_t *fs, struct sfs_segment *segments, int num_segments);
+
+int sfs_fs_fseek(sfs_t *fs, int fd, int location);
+
+int sfs_fs_fflush(sfs_t *fs, int fd);
+
+int sfs_fs_fallocate(sfs_t *fs, int fd, int offset, int length);
+
+int sfs_fs_ftruncate(sfs_t *fs, int fd, int size);
+
+int sfs_fs_copy_range(sfs_t *fs, int fd_in, int off_in, int fd_out, int off_out, int length);
+
+int sfs_fs_ring_setup(sfs_t *fs, int num_entries);
+
+struct sfs_sqe *sfs_fs_ring_get_sqe(sfs_t *fs, int ring);
+
+int sfs_fs_ring_submit(sfs_t *fs, int ring);
+
+int sfs_fs_ring_reap(sfs_t *fs, int ring, struct sfs_cqe *cqes, int max_cqes);
+
+int sfs_fs_ring_destroy(sfs_t *fs, int ring);
+
+int sfs_fs_aread(sfs_t *fs, int fd, char *buffer, int length, int offset, sfs_aio_callback callback, void *arg);
+
+int sfs_fs_awrite(sfs_t *fs, int fd, const char *buffer, int length, int offset, sfs_aio_callback callback, void *arg);
+
+int sfs_fs_remove(sfs_t *fs, const char *filename);
+
+int sfs_fs_clone(sfs_t *fs, const char *src, const char *dst);
+
+int sfs_fs_mkdir(sfs_t *fs, const char *path);
+
+int sfs_fs_rmdir(sfs_t *fs, const char *path);
+
+int sfs_fs_getdirstats(sfs_t *fs, const char *path, struct sfs_dirstats *stats);
+
 
 #endif
@@ -25,6 +25,15 @@ int ceil_div(int numerator, int denominator) {
 	return result;
 }
 
+unsigned int hash_string(const char *s) {
+	unsigned int hash = 2166136261u;
+	for (const char *c = s; *c != '\0'; c++) {
+		hash ^= (unsigned char) *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 void read_contiguous_bytes_from_disk(disk_ptr start_block, int num_bytes, void *data, const int block_size) {
 	int num_blocks = ceil_div(num_bytes, block_size);
 
@@ -46,7 +55,7 @@ void write_contiguous_bytes_to_disk(disk_ptr start_block, int num_bytes, void *d
 	write_blocks(start_block, num_blocks, buffer);
 }
 
-struct super_block sfs_base_init_fresh_disk() {
+struct super_block sfs_base_init_fresh_disk(const char *filename) {
 	struct super_block sb;
 
 	sb.block_size = BLOCK_SIZE;
@@ -54,21 +63,23 @@ struct super_block sfs_base_init_fresh_disk() {
 	sb.num_inode_blocks = NUM_INODE_BLOCKS;
 	sb.dir_inode_idx = 0;
 
-	int success = init_fresh_disk(SFS_FILENAME, sb.block_size, sb.num_blocks);
+	int success = init_fresh_disk((char *) filename, sb.block_size, sb.num_blocks);
 	if (success < 0) {
-		exit(EXIT_FAILURE);
+		memset(&sb, 0, sizeof sb);
+		return sb;
 	}
 	write_contiguous_bytes_to_disk(0, sizeof sb, &sb, sb.block_size);
 
 	return sb;
 }
 
-struct super_block sfs_base_init_old_disk() {
+struct super_block sfs_base_init_old_disk(const char *filename) {
 	struct super_block sb;
 
-	int success = init_disk(SFS_FILENAME, BLOCK_SIZE, NUM_BLOCKS);
+	int success = init_disk((char *) filename, BLOCK_SIZE, NUM_BLOCKS);
 	if (success < 0) {
-		exit(EXIT_FAILURE);
+		memset(&sb, 0, sizeof sb);
+		return sb;
 	}
 	read_contiguous_bytes_from_disk(0, sizeof sb, &sb, BLOCK_SIZE);
 
@@ -76,9 +87,10 @@ struct super_block sfs_base_init_old_disk() {
 	// I think this should always work as long as BLOCK_SIZE is not less than sizeof(struct super_block)
 	if (sb.block_size != BLOCK_SIZE || sb.num_blocks != NUM_BLOCKS) {
 		close_disk();
-		success = init_disk(SFS_FILENAME, sb.block_size, sb.num_blocks);
+		success = init_disk((char *) filename, sb.block_size, sb.num_blocks);
 		if (success < 0) {
-			exit(EXIT_FAILURE);
+			memset(&sb, 0, sizeof sb);
+			return sb;
 		}
 		write_contiguous_bytes_to_disk(0, sizeof sb, &sb, sb.block_size);
 	}
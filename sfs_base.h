@@ -50,6 +50,11 @@ void *calloc_or_exit(size_t nmemb, size_t size);
  */
 int ceil_div(int numerator, int denominator);
 
+/*
+ * Returns the FNV-1a hash of the given null-terminated string.
+ */
+unsigned int hash_string(const char *s);
+
 /*
  * Reads the requested number of bytes from the disk into the buffer. If more
  * than one block is needed, successive blocks are used.
@@ -67,15 +72,21 @@ void read_contiguous_bytes_from_disk(disk_ptr start_block, int num_bytes, void *
 void write_contiguous_bytes_to_disk(disk_ptr start_block, int num_bytes, void *data, const int block_size);
 
 /*
- * Initializes a fresh disk, creates a new super block with the default values,
+ * Initializes a fresh disk in the given file (on the disk selected with
+ * select_disk()), creates a new super block with the default values,
 * and flushes the super block to the disk.
+ *
+ * Returns a zeroed-out super block if the file could not be created.
  */
-struct super_block sfs_base_init_fresh_disk();
+struct super_block sfs_base_init_fresh_disk(const char *filename);
 
 /*
- * Reads the existing disk and returns its super block.
+ * Reads the existing disk in the given file (on the disk selected with
+ * select_disk()) and returns its super block.
+ *
+ * Returns a zeroed-out super block if the file could not be opened.
  */
-struct super_block sfs_base_init_old_disk();
+struct super_block sfs_base_init_old_disk(const char *filename);
 
 /*
  * Zeroes out the memory for the super block.
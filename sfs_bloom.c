@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_bloom.h"
+
+
+#define MAX_COUNT 15
+
+
+/*
+ * Returns the ith counter for the given hash. The counters are picked by
+ * double hashing, with the second hash derived from the first by a
+ * multiplicative mix (made odd so that it cycles through every counter).
+ */
+static int get_counter_idx(struct bloom_filter *filter, unsigned int hash, int i) {
+	unsigned int step = ((hash >> 16) | (hash << 16)) * 2654435761u | 1;
+	return (hash + i * step) & (filter->num_counters - 1);
+}
+
+static int get_count(struct bloom_filter *filter, int idx) {
+	unsigned char byte = filter->counters[idx / 2];
+	return idx % 2 == 0 ? byte & 0x0f : byte >> 4;
+}
+
+static void set_count(struct bloom_filter *filter, int idx, int count) {
+	unsigned char *byte = filter->counters + idx / 2;
+	if (idx % 2 == 0) {
+		*byte = (*byte & 0xf0) | count;
+	}
+	else {
+		*byte = (*byte & 0x0f) | (count << 4);
+	}
+}
+
+
+struct bloom_filter sfs_bloom_new(int capacity) {
+	struct bloom_filter filter;
+
+	filter.capacity = capacity > BLOOM_MIN_CAPACITY ? capacity : BLOOM_MIN_CAPACITY;
+	filter.num_counters = 2;
+	while (filter.num_counters < filter.capacity * BLOOM_COUNTERS_PER_ENTRY) {
+		filter.num_counters *= 2;
+	}
+	filter.counters = calloc_or_exit(filter.num_counters / 2, 1);
+
+	return filter;
+}
+
+void sfs_bloom_free(struct bloom_filter *filter) {
+	if (filter->counters != NULL) {
+		free(filter->counters);
+	}
+	memset(filter, 0, sizeof *filter);
+}
+
+void sfs_bloom_add(struct bloom_filter *filter, unsigned int hash) {
+	for (int i = 0; i < BLOOM_NUM_HASHES; i++) {
+		int idx = get_counter_idx(filter, hash, i);
+		int count = get_count(filter, idx);
+		if (count < MAX_COUNT) {
+			set_count(filter, idx, count + 1);
+		}
+	}
+}
+
+void sfs_bloom_remove(struct bloom_filter *filter, unsigned int hash) {
+	for (int i = 0; i < BLOOM_NUM_HASHES; i++) {
+		int idx = get_counter_idx(filter, hash, i);
+		int count = get_count(filter, idx);
+		if (count > 0 && count < MAX_COUNT) {
+			set_count(filter, idx, count - 1);
+		}
+	}
+}
+
+int sfs_bloom_may_contain(struct bloom_filter *filter, unsigned int hash) {
+	for (int i = 0; i < BLOOM_NUM_HASHES; i++) {
+		if (get_count(filter, get_counter_idx(filter, hash, i)) == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int sfs_bloom_memory_usage(struct bloom_filter *filter) {
+	return sizeof *filter + filter->num_counters / 2;
+}
@@ -0,0 +1,66 @@
+#ifndef SFS_BLOOM_H
+#define SFS_BLOOM_H
+
+
+#include "sfs_base.h"
+
+
+// Number of counters per entry the filter is sized for
+#define BLOOM_COUNTERS_PER_ENTRY 10
+// Number of counters set by each entry
+#define BLOOM_NUM_HASHES 5
+// Smallest number of entries a filter is sized for
+#define BLOOM_MIN_CAPACITY 64
+
+
+/*
+ * Counting Bloom filter over 32-bit hashes. Each entry increments
+ * BLOOM_NUM_HASHES 4-bit counters, so entries can be removed as well as
+ * added. A counter that reaches its maximum value stays there, since it is no
+ * longer known how many entries share it.
+ *
+ * With BLOOM_COUNTERS_PER_ENTRY counters per entry, the false-positive rate is
+ * about 1% as long as the filter holds at most the number of entries it was
+ * sized for.
+ */
+struct bloom_filter {
+	// Number of entries the filter was sized for
+	int capacity;
+	// Number of counters (a power of two)
+	int num_counters;
+	// Counters, two per byte
+	unsigned char *counters;
+};
+
+
+/*
+ * Initializes an empty filter sized for the given number of entries.
+ */
+struct bloom_filter sfs_bloom_new(int capacity);
+
+/*
+ * Frees any dynamically-allocated memory and zeroes out the memory for the
+ * filter.
+ */
+void sfs_bloom_free(struct bloom_filter *filter);
+
+void sfs_bloom_add(struct bloom_filter *filter, unsigned int hash);
+
+/*
+ * Removes an entry that was previously added with the same hash.
+ */
+void sfs_bloom_remove(struct bloom_filter *filter, unsigned int hash);
+
+/*
+ * Returns zero if no entry with the given hash was added, and a nonzero number
+ * if one may have been.
+ */
+int sfs_bloom_may_contain(struct bloom_filter *filter, unsigned int hash);
+
+/*
+ * Returns the number of bytes of memory used by the filter.
+ */
+int sfs_bloom_memory_usage(struct bloom_filter *filter);
+
+
+#endif
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_cache.h"
+
+
+static struct cached_block *find_cached_block(struct block_cache *cache, inode_idx inode_idx, int block_num) {
+	for (int i = 0; i < cache->size; i++) {
+		struct cached_block *entry = cache->entries + i;
+		if (entry->inode_idx == inode_idx && entry->block_num == block_num && !entry->invalid) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static struct cached_block *find_by_data(struct block_cache *cache, const char *data) {
+	const int block_size = cache->inode_table->super_block->block_size;
+
+	for (int i = 0; i < cache->size; i++) {
+		char *block = cache->entries[i].data;
+		if (data >= block && data < block + block_size) {
+			return cache->entries + i;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns an unused entry if there is one, otherwise the least-recently-used
+ * entry that is not pinned. Returns NULL if every entry is pinned.
+ */
+static struct cached_block *choose_victim(struct block_cache *cache) {
+	struct cached_block *victim = NULL;
+	for (int i = 0; i < cache->size; i++) {
+		struct cached_block *entry = cache->entries + i;
+		if (entry->inode_idx == INODE_NULL) {
+			return entry;
+		}
+		if (entry->pin_count == 0 && (victim == NULL || entry->last_used < victim->last_used)) {
+			victim = entry;
+		}
+	}
+	return victim;
+}
+
+static void drop_entry(struct cached_block *entry) {
+	entry->inode_idx = INODE_NULL;
+	entry->block_num = 0;
+	entry->pin_count = 0;
+	entry->invalid = 0;
+	entry->dirty = 0;
+}
+
+static int write_entry(struct block_cache *cache, struct cached_block *entry) {
+	const int block_size = cache->inode_table->super_block->block_size;
+
+	int num_bytes_written = sfs_inode_write(cache->inode_table, entry->inode_idx, entry->block_num * block_size, block_size, entry->data);
+	entry->dirty = 0;
+	if (num_bytes_written != block_size) {
+		if (entry->pin_count == 0) {
+			drop_entry(entry);
+		}
+		else {
+			entry->invalid = 1;
+		}
+		return 0;
+	}
+
+	return 1;
+}
+
+
+struct block_cache sfs_cache_new(struct inode_table *table) {
+	struct block_cache cache;
+
+	cache.inode_table = table;
+	cache.size = CACHE_SIZE;
+	cache.clock = 0;
+	cache.in_batch = 0;
+	cache.entries = calloc_or_exit(cache.size, sizeof(struct cached_block));
+	for (int i = 0; i < cache.size; i++) {
+		drop_entry(cache.entries + i);
+		cache.entries[i].data = calloc_or_exit(1, table->super_block->block_size);
+	}
+
+	return cache;
+}
+
+void sfs_cache_free(struct block_cache *cache) {
+	if (cache->entries != NULL) {
+		for (int i = 0; i < cache->size; i++) {
+			free(cache->entries[i].data);
+		}
+		free(cache->entries);
+	}
+	memset(cache, 0, sizeof *cache);
+}
+
+char *sfs_cache_get_block(struct block_cache *cache, inode_idx inode_idx, int block_num) {
+	char *data = sfs_cache_try_get_block(cache, inode_idx, block_num);
+	if (data == NULL) {
+		fprintf(stderr, "Every block in the block cache is pinned.\n");
+		exit(1);
+	}
+	return data;
+}
+
+char *sfs_cache_try_get_block(struct block_cache *cache, inode_idx inode_idx, int block_num) {
+	const int block_size = cache->inode_table->super_block->block_size;
+
+	struct cached_block *entry = find_cached_block(cache, inode_idx, block_num);
+	if (entry == NULL) {
+		entry = choose_victim(cache);
+		if (entry == NULL) {
+			return NULL;
+		}
+		if (entry->dirty && !write_entry(cache, entry)) {
+			fprintf(stderr, "WARNING: failed to write back block %d of inode %d.\n", entry->block_num, entry->inode_idx);
+		}
+
+		entry->inode_idx = inode_idx;
+		entry->block_num = block_num;
+		entry->pin_count = 0;
+		entry->invalid = 0;
+		memset(entry->data, 0, block_size);
+		sfs_inode_read(cache->inode_table, inode_idx, block_num * block_size, block_size, entry->data);
+	}
+
+	entry->pin_count++;
+	cache->clock++;
+	entry->last_used = cache->clock;
+
+	return entry->data;
+}
+
+int sfs_cache_release(struct block_cache *cache, const char *data) {
+	struct cached_block *entry = find_by_data(cache, data);
+	if (entry == NULL || entry->pin_count == 0) {
+		return 0;
+	}
+
+	entry->pin_count--;
+	if (entry->pin_count == 0 && entry->invalid) {
+		drop_entry(entry);
+	}
+	return 1;
+}
+
+int sfs_cache_write_block(struct block_cache *cache, char *data) {
+	struct cached_block *entry = find_by_data(cache, data);
+	if (entry == NULL || entry->inode_idx == INODE_NULL) {
+		return 0;
+	}
+
+	if (cache->in_batch) {
+		entry->dirty = 1;
+		return 1;
+	}
+	return write_entry(cache, entry);
+}
+
+void sfs_cache_begin_batch(struct block_cache *cache) {
+	cache->in_batch = 1;
+}
+
+int sfs_cache_end_batch(struct block_cache *cache) {
+	int success = 1;
+	for (int i = 0; i < cache->size; i++) {
+		struct cached_block *entry = cache->entries + i;
+		if (entry->dirty && !write_entry(cache, entry)) {
+			success = 0;
+		}
+	}
+	cache->in_batch = 0;
+
+	return success;
+}
+
+void sfs_cache_forget_inode(struct block_cache *cache, inode_idx inode_idx) {
+	for (int i = 0; i < cache->size; i++) {
+		struct cached_block *entry = cache->entries + i;
+		if (entry->inode_idx != inode_idx) {
+			continue;
+		}
+		if (entry->pin_count == 0) {
+			drop_entry(entry);
+		}
+		else {
+			entry->invalid = 1;
+			entry->dirty = 0;
+		}
+	}
+}
@@ -0,0 +1,131 @@
+#ifndef SFS_CACHE_H
+#define SFS_CACHE_H
+
+
+#include "sfs_base.h"
+#include "sfs_inode.h"
+
+
+// Number of blocks held by the block cache
+#define CACHE_SIZE 64
+
+
+struct cached_block {
+	// Inode whose block this is, or INODE_NULL if this entry is unused
+	inode_idx inode_idx;
+	// Index of the block within the inode's file
+	int block_num;
+	// Number of callers currently using the block. Pinned blocks are never
+	// evicted.
+	int pin_count;
+	// Value of the cache's clock when the block was last used
+	unsigned int last_used;
+	// Whether a write failed or the inode was forgotten, so the contents may
+	// not match the disk. An invalid block is dropped once it is released.
+	int invalid;
+	// Whether the block was written during a batch and not flushed yet
+	int dirty;
+	char *data;
+};
+
+/*
+ * Cache of file blocks, addressed by (inode, block within the file) rather than
+ * by disk block so that callers never need to know where a file's blocks are.
+ * It is write-through: sfs_cache_write_block() writes the block to the disk
+ * right away, so the cache never holds anything the disk does not. The only
+ * exception is a batch (see sfs_cache_begin_batch()).
+ *
+ * Blocks are evicted in least-recently-used order. The cache is meant for
+ * metadata files (e.g., directories), which are only written through it.
+ * Regular files are only read through it (see sfs_read_borrow()), and their
+ * blocks are forgotten whenever the file is written.
+ */
+struct block_cache {
+	// Inode table used to read and write blocks
+	struct inode_table *inode_table;
+	// Number of entries
+	int size;
+	struct cached_block *entries;
+	// Incremented every time a block is used
+	unsigned int clock;
+	// Whether writes are being deferred until sfs_cache_end_batch()
+	int in_batch;
+};
+
+
+/*
+ * Initializes a new, empty block cache with CACHE_SIZE entries.
+ */
+struct block_cache sfs_cache_new(struct inode_table *table);
+
+/*
+ * Frees any dynamically-allocated memory and zeroes out the memory for the
+ * cache.
+ */
+void sfs_cache_free(struct block_cache *cache);
+
+/*
+ * Returns the contents of the given block of the given inode, reading it from
+ * the disk if it is not cached. Bytes past the end of the file read as zeroes.
+ * The block is pinned until sfs_cache_release() is called with the returned
+ * pointer. The contents may be modified, but the changes are only written to
+ * the disk by sfs_cache_write_block().
+ *
+ * The program is terminated if every block in the cache is pinned.
+ */
+char *sfs_cache_get_block(struct block_cache *cache, inode_idx inode_idx, int block_num);
+
+/*
+ * Same as sfs_cache_get_block(), but returns NULL instead of terminating the
+ * program if every block in the cache is pinned.
+ */
+char *sfs_cache_try_get_block(struct block_cache *cache, inode_idx inode_idx, int block_num);
+
+/*
+ * Unpins a block returned by sfs_cache_get_block(). data may point anywhere
+ * inside the block.
+ *
+ * Returns zero if data is not in a pinned block and a nonzero number on
+ * success.
+ */
+int sfs_cache_release(struct block_cache *cache, const char *data);
+
+/*
+ * Writes a (pinned) block returned by sfs_cache_get_block() to the disk. The
+ * whole block is written, so the file is extended to the end of the block if
+ * needed.
+ *
+ * The free bitmap is NOT flushed to the disk.
+ *
+ * Returns zero on failure (e.g., the disk is full) and a nonzero number on
+ * success. On failure, the cached copy is dropped once it is released.
+ */
+int sfs_cache_write_block(struct block_cache *cache, char *data);
+
+/*
+ * Starts deferring writes: until sfs_cache_end_batch(), sfs_cache_write_block()
+ * only marks the block as dirty, so a block written many times is written to
+ * the disk once. A dirty block that has to be evicted is written first.
+ *
+ * Deferred writes have nowhere to report failures, so every block written
+ * during a batch must already be allocated on the disk (e.g., with
+ * sfs_inode_allocate()).
+ */
+void sfs_cache_begin_batch(struct block_cache *cache);
+
+/*
+ * Writes every dirty block to the disk and stops deferring writes. Returns
+ * zero if any write failed and a nonzero number on success.
+ */
+int sfs_cache_end_batch(struct block_cache *cache);
+
+/*
+ * Drops every cached block of the given inode. This must be called when the
+ * inode is deleted or its contents are changed without going through the
+ * cache. Blocks that are pinned keep their (now stale) contents until they are
+ * released, but are no longer returned by sfs_cache_get_block().
+ */
+void sfs_cache_forget_inode(struct block_cache *cache, inode_idx inode_idx);
+
+
+#endif
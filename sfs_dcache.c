@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_dcache.h"
+
+
+static struct dentry *get_dentry(struct dcache *dcache, inode_idx parent, const char *name) {
+	unsigned int hash = hash_string(name) ^ ((unsigned int) parent * 2654435761u);
+	return dcache->entries + (hash & (dcache->size - 1));
+}
+
+
+struct dcache sfs_dcache_new() {
+	struct dcache dcache;
+
+	dcache.size = DCACHE_SIZE;
+	dcache.entries = calloc_or_exit(dcache.size, sizeof(struct dentry));
+	for (int i = 0; i < dcache.size; i++) {
+		dcache.entries[i].parent = INODE_NULL;
+	}
+
+	return dcache;
+}
+
+void sfs_dcache_free(struct dcache *dcache) {
+	if (dcache->entries != NULL) {
+		free(dcache->entries);
+	}
+	memset(dcache, 0, sizeof *dcache);
+}
+
+/*
+ * Compares the name in the given entry with name, reading it one byte at a
+ * time with atomic loads since it may be changing. Only
+ * sfs_dcache_lookup_unlocked() needs this.
+ */
+static int name_matches(struct dentry *dentry, const char *name) {
+	for (int i = 0; i < MAXFILENAME; i++) {
+		char c = __atomic_load_n(dentry->name + i, __ATOMIC_RELAXED);
+		if (c != name[i]) {
+			return 0;
+		}
+		if (c == '\0') {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+int sfs_dcache_lookup(struct dcache *dcache, inode_idx parent, const char *name, inode_idx *result) {
+	struct dentry *dentry = get_dentry(dcache, parent, name);
+	if (dentry->parent != parent || strcmp(dentry->name, name) != 0) {
+		return 0;
+	}
+
+	*result = dentry->inode_idx;
+	return 1;
+}
+
+int sfs_dcache_lookup_unlocked(struct dcache *dcache, inode_idx parent, const char *name, inode_idx *result, unsigned int *version) {
+	struct dentry *dentry = get_dentry(dcache, parent, name);
+
+	unsigned int seq = __atomic_load_n(&dentry->seq, __ATOMIC_ACQUIRE);
+	if (seq % 2 != 0) {
+		return 0;
+	}
+	int matches = __atomic_load_n(&dentry->parent, __ATOMIC_RELAXED) == parent && name_matches(dentry, name);
+	inode_idx inode_idx = __atomic_load_n(&dentry->inode_idx, __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (!matches || __atomic_load_n(&dentry->seq, __ATOMIC_RELAXED) != seq) {
+		return 0;
+	}
+	*result = inode_idx;
+	*version = seq;
+	return 1;
+}
+
+int sfs_dcache_unchanged(struct dcache *dcache, inode_idx parent, const char *name, unsigned int version) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&get_dentry(dcache, parent, name)->seq, __ATOMIC_RELAXED) == version;
+}
+
+void sfs_dcache_insert(struct dcache *dcache, inode_idx parent, const char *name, inode_idx inode_idx) {
+	if (strlen(name) >= MAXFILENAME) {
+		return;
+	}
+
+	// Every field is stored atomically, between two increments of seq, since
+	// sfs_dcache_lookup_unlocked() may be reading the entry
+	struct dentry *dentry = get_dentry(dcache, parent, name);
+	__atomic_store_n(&dentry->seq, dentry->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&dentry->parent, parent, __ATOMIC_RELAXED);
+	for (int i = 0; i == 0 || name[i - 1] != '\0'; i++) {
+		__atomic_store_n(dentry->name + i, name[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&dentry->inode_idx, inode_idx, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&dentry->seq, dentry->seq + 1, __ATOMIC_RELEASE);
+}
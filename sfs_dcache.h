@@ -0,0 +1,86 @@
+#ifndef SFS_DCACHE_H
+#define SFS_DCACHE_H
+
+
+#include "sfs_base.h"
+
+
+// Number of entries in the dentry cache (a power of two)
+#define DCACHE_SIZE 4096
+
+
+struct dentry {
+	// Odd while the entry is being changed, and incremented twice by every
+	// change (see sfs_dcache_lookup_unlocked())
+	unsigned int seq;
+	// Inode of the directory that holds the name, or INODE_NULL if this
+	// entry of the cache is unused
+	inode_idx parent;
+	char name[MAXFILENAME];
+	// Inode that the name refers to, or INODE_NULL if the name is known not
+	// to exist in the parent directory (a negative entry)
+	inode_idx inode_idx;
+};
+
+/*
+ * Cache of (directory, name) -> inode lookups made while walking paths. It is
+ * direct-mapped: each (directory, name) pair can only live in one entry, and
+ * a new pair simply replaces whatever was there.
+ *
+ * The cache is not persisted. Changes must be serialized by the caller, but
+ * sfs_dcache_lookup_unlocked() may run at the same time as them.
+ */
+struct dcache {
+	// Number of entries (a power of two)
+	int size;
+	struct dentry *entries;
+};
+
+
+/*
+ * Initializes a new, empty dentry cache with DCACHE_SIZE entries.
+ */
+struct dcache sfs_dcache_new();
+
+/*
+ * Frees any dynamically-allocated memory and zeroes out the memory for the
+ * cache.
+ */
+void sfs_dcache_free(struct dcache *dcache);
+
+/*
+ * Looks up the given name in the given directory. Returns zero if the cache
+ * does not know the answer. Otherwise, returns a nonzero number and sets
+ * *result to the inode of the name, which is INODE_NULL if the name is known
+ * not to exist.
+ */
+int sfs_dcache_lookup(struct dcache *dcache, inode_idx parent, const char *name, inode_idx *result);
+
+/*
+ * Same as sfs_dcache_lookup(), but may be called while another thread is
+ * changing the cache, without any lock: the entry is read optimistically and
+ * checked against its sequence number, so the reader never writes to it.
+ * Returns zero if the cache does not know the answer or the entry was being
+ * changed. Otherwise, also sets *version, which sfs_dcache_unchanged() takes.
+ */
+int sfs_dcache_lookup_unlocked(struct dcache *dcache, inode_idx parent, const char *name, inode_idx *result, unsigned int *version);
+
+/*
+ * Returns a nonzero number if the entry for the given name has not changed
+ * since sfs_dcache_lookup_unlocked() set version, i.e., the answer it gave
+ * still holds.
+ */
+int sfs_dcache_unchanged(struct dcache *dcache, inode_idx parent, const char *name, unsigned int version);
+
+/*
+ * Records that the given name in the given directory refers to the given
+ * inode. Use INODE_NULL to record that the name does not exist.
+ *
+ * Every change to a directory must be recorded here (or the whole cache
+ * cleared), since lookups are answered from the cache without checking the
+ * directory.
+ */
+void sfs_dcache_insert(struct dcache *dcache, inode_idx parent, const char *name, inode_idx inode_idx);
+
+
+#endif
@@ -5,21 +5,65 @@
 #include "sfs_directory.h"
 
 
-static void resize_directory(struct directory *dir) {
-	dir->capacity *= 2;
-	struct directory_entry *new_entries = calloc_or_exit(dir->capacity, sizeof(struct directory_entry));
-	memcpy(new_entries, dir->entries, dir->size * sizeof(struct directory_entry));
-	free(dir->entries);
-	dir->entries = new_entries;
+/*
+ * The hash index of a directory lives in its own inode, in the style of
+ * ext3's HTree. Block 0 is the root: a sorted array of (lowest hash, bucket
+ * block) pairs that covers the whole hash space, so the first pair always
+ * has a lowest hash of 0. Every other block is a bucket holding the
+ * (hash, slot) pairs of the filenames whose hashes fall in its range. When a
+ * bucket is full, it is split in two at its median hash and the new bucket is
+ * added to the root.
+ *
+ * Lookups, inserts and removals therefore touch the root, one bucket and the
+ * block holding the slot. One level is enough: the root has room for
+ * block_size / 8 buckets that are each at least half full, which is more than
+ * the number of slots a directory file can hold.
+ */
+struct index_root_entry {
+	// Lowest hash that belongs in the bucket
+	unsigned int min_hash;
+	// Block of the index file that holds the bucket
+	int block_num;
+};
+
+struct index_pair {
+	unsigned int hash;
+	int slot;
+};
+
+struct index_bucket {
+	int num_pairs;
+	struct index_pair pairs[];
+};
+
+
+static int entries_per_block(struct directory *dir) {
+	return dir->super_block->block_size / sizeof(struct directory_entry);
 }
 
-static int index_of_dir_entry(struct directory *dir, const char filename[MAXFILENAME]) {
-	for (int i = 0; i < dir->size; i++) {
-		if (strcmp(dir->entries[i].filename, filename) == 0) {
-			return i;
-		}
-	}
-	return -1;
+/*
+ * Returns the number of slots that the bitmap in block 0 can describe.
+ */
+static int max_slots(struct directory *dir) {
+	return (dir->super_block->block_size - sizeof(struct directory_header)) * 8;
+}
+
+static int root_capacity(struct directory *dir) {
+	return dir->super_block->block_size / sizeof(struct index_root_entry);
+}
+
+static int bucket_capacity(struct directory *dir) {
+	return (dir->super_block->block_size - sizeof(struct index_bucket)) / sizeof(struct index_pair);
+}
+
+static struct directory_header empty_header() {
+	struct directory_header header;
+	header.magic = DIRECTORY_MAGIC;
+	header.num_slots = 0;
+	header.num_files = 0;
+	header.index_inode = INODE_NULL;
+	header.num_buckets = 0;
+	return header;
 }
 
 /*
@@ -35,72 +79,552 @@ static int is_filename_too_long(const char *filename) {
 	return 1;
 }
 
+/*
+ * Writes the header of a new, empty directory to block 0 of the given inode.
+ * Returns zero on failure and a nonzero number on success.
+ */
+static int format_directory(struct block_cache *cache, inode_idx inode_idx) {
+	const int block_size = cache->inode_table->super_block->block_size;
+	const struct directory_header header = empty_header();
+
+	char *block = sfs_cache_get_block(cache, inode_idx, 0);
+	memset(block, 0, block_size);
+	memcpy(block, &header, sizeof header);
+	int success = sfs_cache_write_block(cache, block);
+	sfs_cache_release(cache, block);
+
+	return success;
+}
+
+/*
+ * Writes the in-memory header to block 0. If slot is not negative, its bit in
+ * the bitmap is updated in the same write.
+ */
+static void flush_header(struct directory *dir, int slot, int is_free) {
+	char *block = sfs_cache_get_block(dir->cache, dir->inode_idx, 0);
+	memcpy(block, &dir->header, sizeof dir->header);
+	if (slot >= 0) {
+		unsigned char *bitmap = (unsigned char *) block + sizeof dir->header;
+		if (is_free) {
+			bitmap[slot / 8] |= 1 << (slot % 8);
+		}
+		else {
+			bitmap[slot / 8] &= ~(1 << (slot % 8));
+		}
+	}
+	sfs_cache_write_block(dir->cache, block);
+	sfs_cache_release(dir->cache, block);
+}
+
+/*
+ * Returns the lowest free slot, or a negative number if there is none.
+ */
+static int find_free_slot(struct directory *dir) {
+	if (dir->header.num_files == dir->header.num_slots) {
+		return -1;
+	}
+
+	char *block = sfs_cache_get_block(dir->cache, dir->inode_idx, 0);
+	unsigned char *bitmap = (unsigned char *) block + sizeof dir->header;
+	int slot = -1;
+	for (int i = 0; i < ceil_div(dir->header.num_slots, 8) && slot < 0; i++) {
+		for (int bit = 0; bit < 8 && bitmap[i] != 0; bit++) {
+			if (bitmap[i] & (1 << bit)) {
+				slot = 8 * i + bit;
+				break;
+			}
+		}
+	}
+	sfs_cache_release(dir->cache, block);
+
+	return slot < dir->header.num_slots ? slot : -1;
+}
+
+static void read_entry(struct directory *dir, int slot, struct directory_entry *entry) {
+	const int per_block = entries_per_block(dir);
+
+	char *block = sfs_cache_get_block(dir->cache, dir->inode_idx, 1 + slot / per_block);
+	memcpy(entry, block + (slot % per_block) * sizeof *entry, sizeof *entry);
+	sfs_cache_release(dir->cache, block);
+}
+
+static int write_entry(struct directory *dir, int slot, const struct directory_entry *entry) {
+	const int per_block = entries_per_block(dir);
+
+	char *block = sfs_cache_get_block(dir->cache, dir->inode_idx, 1 + slot / per_block);
+	memcpy(block + (slot % per_block) * sizeof *entry, entry, sizeof *entry);
+	int success = sfs_cache_write_block(dir->cache, block);
+	sfs_cache_release(dir->cache, block);
+
+	return success;
+}
+
+/*
+ * Returns the position in the root of the bucket that covers the given hash,
+ * i.e., the last bucket whose lowest hash is at most the given hash.
+ */
+static int find_bucket(struct index_root_entry *root, int num_buckets, unsigned int hash) {
+	int low = 0;
+	int high = num_buckets - 1;
+	while (low < high) {
+		int mid = (low + high + 1) / 2;
+		if (root[mid].min_hash <= hash) {
+			low = mid;
+		}
+		else {
+			high = mid - 1;
+		}
+	}
+	return low;
+}
+
+static int get_bucket_block(struct directory *dir, unsigned int hash, int *position) {
+	char *root_block = sfs_cache_get_block(dir->cache, dir->header.index_inode, 0);
+	struct index_root_entry *root = (struct index_root_entry *) root_block;
+	*position = find_bucket(root, dir->header.num_buckets, hash);
+	int block_num = root[*position].block_num;
+	sfs_cache_release(dir->cache, root_block);
+
+	return block_num;
+}
+
+/*
+ * Builds the Bloom filter from the hashes in the hash index, sized for twice
+ * the current number of files.
+ */
+static void build_filter(struct directory *dir) {
+	sfs_bloom_free(&dir->filter);
+	dir->filter = sfs_bloom_new(2 * dir->header.num_files);
+	if (dir->header.index_inode == INODE_NULL) {
+		return;
+	}
+
+	char *root_block = sfs_cache_get_block(dir->cache, dir->header.index_inode, 0);
+	struct index_root_entry *root = (struct index_root_entry *) root_block;
+	for (int i = 0; i < dir->header.num_buckets; i++) {
+		char *block = sfs_cache_get_block(dir->cache, dir->header.index_inode, root[i].block_num);
+		struct index_bucket *bucket = (struct index_bucket *) block;
+		for (int j = 0; j < bucket->num_pairs; j++) {
+			sfs_bloom_add(&dir->filter, bucket->pairs[j].hash);
+		}
+		sfs_cache_release(dir->cache, block);
+	}
+	sfs_cache_release(dir->cache, root_block);
+}
+
+/*
+ * Checks the Bloom filter for the given hash, building the filter first if
+ * needed. Returns zero if the hash is certainly not in the index.
+ */
+static int filter_may_contain(struct directory *dir, unsigned int hash) {
+	if (dir->filter.counters == NULL) {
+		build_filter(dir);
+	}
+	return sfs_bloom_may_contain(&dir->filter, hash);
+}
+
+/*
+ * Looks up the given filename in the hash index and copies its entry into
+ * entry. Returns its slot, or a negative number if there is no such file.
+ * The bucket block and the position of the pair within the bucket are
+ * returned through bucket_block and pair_idx.
+ */
+static int index_lookup(struct directory *dir, const char *filename, struct directory_entry *entry, int *bucket_block, int *pair_idx) {
+	if (dir->header.index_inode == INODE_NULL) {
+		return -1;
+	}
+
+	unsigned int hash = hash_string(filename);
+	int position;
+	int block_num = get_bucket_block(dir, hash, &position);
+
+	char *block = sfs_cache_get_block(dir->cache, dir->header.index_inode, block_num);
+	struct index_bucket *bucket = (struct index_bucket *) block;
+	int slot = -1;
+	for (int i = 0; i < bucket->num_pairs; i++) {
+		if (bucket->pairs[i].hash != hash) {
+			continue;
+		}
+		read_entry(dir, bucket->pairs[i].slot, entry);
+		if (strcmp(entry->filename, filename) == 0) {
+			slot = bucket->pairs[i].slot;
+			*bucket_block = block_num;
+			*pair_idx = i;
+			break;
+		}
+	}
+	sfs_cache_release(dir->cache, block);
+
+	return slot;
+}
+
+/*
+ * Reserves an inode for the hash index and writes a root with a single empty
+ * bucket that covers every hash. The header is not flushed.
+ */
+static int create_index(struct directory *dir) {
+	inode_idx index_inode = sfs_inode_reserve_inode(dir->inode_table, INODE_TYPE_DIRECTORY_INDEX);
+	if (index_inode == INODE_NULL) {
+		return 0;
+	}
+
+	char *root_block = sfs_cache_get_block(dir->cache, index_inode, 0);
+	struct index_root_entry *root = (struct index_root_entry *) root_block;
+	root[0].min_hash = 0;
+	root[0].block_num = 1;
+	char *bucket_block = sfs_cache_get_block(dir->cache, index_inode, 1);
+	((struct index_bucket *) bucket_block)->num_pairs = 0;
+
+	int success = sfs_cache_write_block(dir->cache, root_block) && sfs_cache_write_block(dir->cache, bucket_block);
+	sfs_cache_release(dir->cache, bucket_block);
+	sfs_cache_release(dir->cache, root_block);
+
+	if (!success) {
+		sfs_cache_forget_inode(dir->cache, index_inode);
+		sfs_inode_delete_file(dir->inode_table, index_inode);
+		return 0;
+	}
+
+	dir->header.index_inode = index_inode;
+	dir->header.num_buckets = 1;
+	return 1;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+	unsigned int hash_a = ((const struct index_pair *) a)->hash;
+	unsigned int hash_b = ((const struct index_pair *) b)->hash;
+	return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+/*
+ * Splits the bucket at the given position of the root in two at its median
+ * hash. Pairs with the same hash always stay in the same bucket. The header
+ * is not flushed.
+ *
+ * Returns zero on failure (the root is full, every pair in the bucket has the
+ * same hash, or the disk is full) and a nonzero number on success.
+ */
+static int split_bucket(struct directory *dir, int position) {
+	if (dir->header.num_buckets >= root_capacity(dir)) {
+		return 0;
+	}
+	const inode_idx index_inode = dir->header.index_inode;
+
+	char *root_block = sfs_cache_get_block(dir->cache, index_inode, 0);
+	struct index_root_entry *root = (struct index_root_entry *) root_block;
+	char *old_block = sfs_cache_get_block(dir->cache, index_inode, root[position].block_num);
+	struct index_bucket *old_bucket = (struct index_bucket *) old_block;
+
+	// The order of the pairs within a bucket does not matter, so the sorted
+	// bucket is written back even if the split fails
+	const int n = old_bucket->num_pairs;
+	qsort(old_bucket->pairs, n, sizeof(struct index_pair), compare_pairs);
+
+	// Move the split point off the median if needed so that it falls between
+	// two different hashes
+	int split = n / 2;
+	while (split < n && old_bucket->pairs[split].hash == old_bucket->pairs[split - 1].hash) {
+		split++;
+	}
+	if (split == n) {
+		split = n / 2;
+		while (split > 0 && old_bucket->pairs[split].hash == old_bucket->pairs[split - 1].hash) {
+			split--;
+		}
+	}
+
+	int success = split > 0;
+	const int new_block_num = dir->header.num_buckets + 1;
+	if (success) {
+		char *new_block = sfs_cache_get_block(dir->cache, index_inode, new_block_num);
+		struct index_bucket *new_bucket = (struct index_bucket *) new_block;
+		new_bucket->num_pairs = n - split;
+		memcpy(new_bucket->pairs, old_bucket->pairs + split, (n - split) * sizeof(struct index_pair));
+		success = sfs_cache_write_block(dir->cache, new_block);
+		sfs_cache_release(dir->cache, new_block);
+	}
 
-struct directory sfs_directory_new(struct super_block *sb, struct inode_table *table) {
+	if (success) {
+		old_bucket->num_pairs = split;
+		memmove(root + position + 2, root + position + 1, (dir->header.num_buckets - position - 1) * sizeof *root);
+		root[position + 1].min_hash = old_bucket->pairs[split].hash;
+		root[position + 1].block_num = new_block_num;
+		dir->header.num_buckets++;
+	}
+
+	// The new bucket is written before the root so that the root never
+	// points at a missing bucket
+	sfs_cache_write_block(dir->cache, old_block);
+	if (success) {
+		sfs_cache_write_block(dir->cache, root_block);
+	}
+	sfs_cache_release(dir->cache, old_block);
+	sfs_cache_release(dir->cache, root_block);
+
+	return success;
+}
+
+/*
+ * Adds a (hash, slot) pair to the hash index, creating the index or splitting
+ * a bucket if needed. The header is not flushed.
+ *
+ * Returns zero on failure and a nonzero number on success.
+ */
+static int index_insert(struct directory *dir, unsigned int hash, int slot) {
+	if (dir->header.index_inode == INODE_NULL && !create_index(dir)) {
+		return 0;
+	}
+
+	while (1) {
+		int position;
+		int block_num = get_bucket_block(dir, hash, &position);
+
+		char *block = sfs_cache_get_block(dir->cache, dir->header.index_inode, block_num);
+		struct index_bucket *bucket = (struct index_bucket *) block;
+		if (bucket->num_pairs < bucket_capacity(dir)) {
+			bucket->pairs[bucket->num_pairs].hash = hash;
+			bucket->pairs[bucket->num_pairs].slot = slot;
+			bucket->num_pairs++;
+			int success = sfs_cache_write_block(dir->cache, block);
+			sfs_cache_release(dir->cache, block);
+			return success;
+		}
+		sfs_cache_release(dir->cache, block);
+
+		if (!split_bucket(dir, position)) {
+			return 0;
+		}
+	}
+}
+
+static void index_remove(struct directory *dir, int bucket_block, int pair_idx) {
+	char *block = sfs_cache_get_block(dir->cache, dir->header.index_inode, bucket_block);
+	struct index_bucket *bucket = (struct index_bucket *) block;
+	bucket->num_pairs--;
+	bucket->pairs[pair_idx] = bucket->pairs[bucket->num_pairs];
+	sfs_cache_write_block(dir->cache, block);
+	sfs_cache_release(dir->cache, block);
+}
+
+/*
+ * Adds an entry for the given (existing) inode in the lowest free slot.
+ * Returns zero on failure and a nonzero number on success.
+ */
+static int insert_entry(struct directory *dir, const char *filename, inode_idx inode_idx) {
+	int slot = find_free_slot(dir);
+	const int is_new_slot = slot < 0;
+	if (is_new_slot) {
+		if (dir->header.num_slots >= max_slots(dir)) {
+			return 0;
+		}
+		slot = dir->header.num_slots;
+	}
+
+	struct directory_entry entry;
+	memset(&entry, 0, sizeof entry);
+	strcpy(entry.filename, filename);
+	entry.inode_idx = inode_idx;
+	if (!write_entry(dir, slot, &entry)) {
+		return 0;
+	}
+
+	if (!index_insert(dir, hash_string(filename), slot)) {
+		// Put the slot back the way it was, but keep any changes the index
+		// made to the header
+		memset(&entry, 0, sizeof entry);
+		entry.inode_idx = INODE_NULL;
+		write_entry(dir, slot, &entry);
+		flush_header(dir, -1, 0);
+		return 0;
+	}
+
+	if (is_new_slot) {
+		dir->header.num_slots++;
+	}
+	dir->header.num_files++;
+	flush_header(dir, slot, 0);
+
+	if (dir->filter.counters != NULL) {
+		if (dir->header.num_files > dir->filter.capacity) {
+			// The filter would get too many false positives, so build a
+			// larger one when it is next needed
+			sfs_bloom_free(&dir->filter);
+		}
+		else {
+			sfs_bloom_add(&dir->filter, hash_string(filename));
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Reserves an inode of the given type and adds an entry for it.
+ */
+static inode_idx add_entry(struct directory *dir, const char *filename, int type) {
+	// An empty filename would look like a free slot
+	if (is_filename_too_long(filename) || filename[0] == '\0') {
+		return INODE_NULL;
+	}
+
+	inode_idx new_file_inode = sfs_inode_reserve_inode(dir->inode_table, type);
+	if (new_file_inode == INODE_NULL) {
+		return INODE_NULL;
+	}
+
+	int success = type != INODE_TYPE_DIRECTORY || format_directory(dir->cache, new_file_inode);
+	if (success) {
+		success = insert_entry(dir, filename, new_file_inode);
+	}
+
+	if (!success) {
+		sfs_cache_forget_inode(dir->cache, new_file_inode);
+		sfs_inode_delete_file(dir->inode_table, new_file_inode);
+		return INODE_NULL;
+	}
+
+	return new_file_inode;
+}
+
+/*
+ * Converts a directory written in the old format (a flat array of entries
+ * starting at byte 0, with no index on disk) to the current format. The order
+ * of the entries is kept, but free slots are dropped. The old FUSE wrapper
+ * passed its paths through unchanged, so names may start with '/'; that is
+ * stripped, unless it would leave an empty or duplicate name.
+ */
+static void convert_old_directory(struct directory *dir) {
+	struct inode_table *table = dir->inode_table;
+
+	const int size = table->entries[dir->inode_idx].size;
+	const int num_entries = size / sizeof(struct directory_entry);
+	struct directory_entry *entries = calloc_or_exit(num_entries + 1, sizeof(struct directory_entry));
+	int num_bytes_read = sfs_inode_read(table, dir->inode_idx, 0, size, (char *) entries);
+	if (num_bytes_read < 0) {
+		fprintf(stderr, "WARNING: failed to read directory inode (sfs_inode_read() returned %d).\n", num_bytes_read);
+	}
+
+	sfs_cache_forget_inode(dir->cache, dir->inode_idx);
+	sfs_inode_delete_file(table, dir->inode_idx);
+	sfs_inode_force_reserve(table, dir->inode_idx, INODE_TYPE_DIRECTORY);
+	format_directory(dir->cache, dir->inode_idx);
+	dir->header = empty_header();
+
+	struct directory_entry existing;
+	int bucket_block, pair_idx;
+	for (int i = 0; i < num_entries; i++) {
+		if (entries[i].filename[0] == '\0') {
+			continue;
+		}
+		entries[i].filename[MAXFILENAME - 1] = '\0';
+		const char *name = entries[i].filename;
+		while (*name == '/') {
+			name++;
+		}
+		if (*name == '\0' || index_lookup(dir, name, &existing, &bucket_block, &pair_idx) >= 0) {
+			fprintf(stderr, "WARNING: keeping directory entry %s as is.\n", entries[i].filename);
+			name = entries[i].filename;
+		}
+		if (!insert_entry(dir, name, entries[i].inode_idx)) {
+			fprintf(stderr, "WARNING: failed to convert directory entry %s.\n", entries[i].filename);
+		}
+	}
+
+	free(entries);
+}
+
+
+struct directory sfs_directory_new(struct super_block *sb, struct inode_table *table, struct block_cache *cache) {
 	struct directory dir;
 
 	dir.super_block = sb;
 	dir.inode_table = table;
-	dir.capacity = 10;
-	dir.size = 0;
+	dir.cache = cache;
+	dir.inode_idx = sb->dir_inode_idx;
+	dir.header = empty_header();
+	memset(&dir.filter, 0, sizeof dir.filter);
+	memset(&dir.stats, 0, sizeof dir.stats);
 
-	dir.entries = calloc(dir.capacity, sizeof(struct directory_entry));
-
-	// The rest of the code assumes the directory uses inode 0
-	sfs_inode_force_reserve(table, 0);
+	sfs_inode_force_reserve(table, dir.inode_idx, INODE_TYPE_DIRECTORY);
+	format_directory(cache, dir.inode_idx);
 
 	return dir;
 }
 
-struct directory sfs_directory_from_disk(struct super_block *sb, struct inode_table *table) {
+struct directory sfs_directory_from_disk(struct super_block *sb, struct inode_table *table, struct block_cache *cache, inode_idx inode_idx) {
 	struct directory dir;
 
 	dir.super_block = sb;
 	dir.inode_table = table;
+	dir.cache = cache;
+	dir.inode_idx = inode_idx;
+	memset(&dir.filter, 0, sizeof dir.filter);
+	memset(&dir.stats, 0, sizeof dir.stats);
+
+	// A directory whose header was never written is empty
+	if (table->entries[inode_idx].size == 0) {
+		dir.header = empty_header();
+		format_directory(cache, inode_idx);
+		return dir;
+	}
 
-	struct inode *dir_inode = table->entries + sb->dir_inode_idx;
-	dir.size = dir_inode->size / sizeof(struct directory_entry);
-	dir.capacity = dir.size * 2;
+	char *block = sfs_cache_get_block(cache, inode_idx, 0);
+	memcpy(&dir.header, block, sizeof dir.header);
+	sfs_cache_release(cache, block);
 
-	dir.entries = calloc(dir.capacity, sizeof(struct directory_entry));
-	int num_bytes_read = sfs_inode_read(table, sb->dir_inode_idx, 0, dir_inode->size, (char *) dir.entries);
-	if (num_bytes_read < 0) {
-		fprintf(stderr, "WARNING: failed to read directory inode (sfs_inode_read() returned %d).\n", num_bytes_read);
+	if (dir.header.magic != DIRECTORY_MAGIC) {
+		convert_old_directory(&dir);
 	}
 
 	return dir;
 }
 
 void sfs_directory_free(struct directory *dir) {
-	if (dir->entries != NULL) {
-		free(dir->entries);
-	}
+	sfs_bloom_free(&dir->filter);
 	memset(dir, 0, sizeof *dir);
 }
 
 inode_idx sfs_directory_add_file(struct directory *dir, const char *filename) {
-	if (is_filename_too_long(filename)) {
-		return INODE_NULL;
-	}
+	return add_entry(dir, filename, INODE_TYPE_FILE);
+}
 
-	inode_idx new_file_inode = sfs_inode_reserve_inode(dir->inode_table);
-	if (new_file_inode == INODE_NULL) {
-		return INODE_NULL;
-	}
+inode_idx sfs_directory_add_subdirectory(struct directory *dir, const char *filename) {
+	return add_entry(dir, filename, INODE_TYPE_DIRECTORY);
+}
 
-	if (dir->size >= dir->capacity) {
-		resize_directory(dir);
+int sfs_directory_link(struct directory *dir, const char *filename, inode_idx inode_idx) {
+	if (is_filename_too_long(filename) || filename[0] == '\0') {
+		return 0;
 	}
+	return insert_entry(dir, filename, inode_idx);
+}
 
-	strcpy(dir->entries[dir->size].filename, filename);
-	dir->entries[dir->size].inode_idx = new_file_inode;
+int sfs_directory_reserve(struct directory *dir, int num_entries) {
+	const int block_size = dir->super_block->block_size;
 
-	int start_byte = dir->size * sizeof(struct directory_entry);
-	sfs_inode_write(dir->inode_table, dir->super_block->dir_inode_idx, start_byte, sizeof(struct directory_entry), (char *) (dir->entries + dir->size));
+	int num_slots = dir->header.num_slots + num_entries;
+	if (num_slots > max_slots(dir)) {
+		num_slots = max_slots(dir);
+	}
+	int num_bytes = (1 + ceil_div(num_slots, entries_per_block(dir))) * block_size;
+	if (!sfs_inode_allocate(dir->inode_table, dir->inode_idx, 0, num_bytes)) {
+		return 0;
+	}
 
-	dir->size++;
+	if (dir->header.index_inode == INODE_NULL) {
+		if (!create_index(dir)) {
+			return 0;
+		}
+		flush_header(dir, -1, 0);
+	}
 
-	return new_file_inode;
+	// Buckets are at least half full after a split, except when many names
+	// share a hash
+	int num_buckets = dir->header.num_buckets + ceil_div(2 * num_entries, bucket_capacity(dir));
+	if (num_buckets > root_capacity(dir)) {
+		num_buckets = root_capacity(dir);
+	}
+	return sfs_inode_allocate(dir->inode_table, dir->header.index_inode, 0, (1 + num_buckets) * block_size);
 }
 
 int sfs_directory_remove_file(struct directory *dir, const char *filename) {
@@ -109,29 +633,43 @@ int sfs_directory_remove_file(struct directory *dir, const char *filename) {
 		return 0;
 	}
 
-	int idx_to_remove = index_of_dir_entry(dir, filename);
-	if (idx_to_remove < 0) {
+	struct directory_entry entry;
+	int bucket_block;
+	int pair_idx;
+	int slot = index_lookup(dir, filename, &entry, &bucket_block, &pair_idx);
+	if (slot < 0) {
 		return 0;
 	}
 
+	// A subdirectory takes its hash index with it
+	struct inode_table *table = dir->inode_table;
+	if (table->entries[entry.inode_idx].type == INODE_TYPE_DIRECTORY) {
+		struct directory_header header;
+		char *block = sfs_cache_get_block(dir->cache, entry.inode_idx, 0);
+		memcpy(&header, block, sizeof header);
+		sfs_cache_release(dir->cache, block);
+
+		if (header.magic == DIRECTORY_MAGIC && header.index_inode != INODE_NULL) {
+			sfs_cache_forget_inode(dir->cache, header.index_inode);
+			sfs_inode_delete_file(table, header.index_inode);
+		}
+	}
+
 	// Delete the file itself
-	struct directory_entry *dir_entry = dir->entries + idx_to_remove;
-	sfs_inode_delete_file(dir->inode_table, dir_entry->inode_idx);
+	sfs_cache_forget_inode(dir->cache, entry.inode_idx);
+	sfs_inode_delete_file(table, entry.inode_idx);
 
-	// Update the directory in memory
-	dir->size--;
-	for (int i = idx_to_remove; i < dir->size; i++) {
-		struct directory_entry *dest = dir->entries + i;
-		struct directory_entry *src = dir->entries + i + 1;
-		memcpy(dest, src, sizeof *dest);
+	// Free the slot
+	index_remove(dir, bucket_block, pair_idx);
+	if (dir->filter.counters != NULL) {
+		sfs_bloom_remove(&dir->filter, hash_string(filename));
 	}
-	memset(dir->entries + dir->size, 0, sizeof(struct directory_entry));
+	memset(&entry, 0, sizeof entry);
+	entry.inode_idx = INODE_NULL;
+	write_entry(dir, slot, &entry);
 
-	// Flush the entire directory and its inode
-	// Need to manually reset the size of the file so that existing data after the end of the directory is ignored
-	struct inode *dir_inode = dir->inode_table->entries + dir->super_block->dir_inode_idx;
-	dir_inode->size = dir->size * sizeof(struct directory_entry);
-	sfs_inode_write(dir->inode_table, dir->super_block->dir_inode_idx, 0, dir_inode->size, (char *) dir->entries);
+	dir->header.num_files--;
+	flush_header(dir, slot, 1);
 
 	return 1;
 }
@@ -141,6 +679,36 @@ inode_idx sfs_directory_get_inode(struct directory *dir, const char *filename) {
 		return INODE_NULL;
 	}
 
-	int i = index_of_dir_entry(dir, filename);
-	return i < 0 ? INODE_NULL : dir->entries[i].inode_idx;
+	dir->stats.num_lookups++;
+	// A directory that never had an entry has no index, so there is nothing
+	// for the Bloom filter to answer
+	if (dir->header.index_inode == INODE_NULL) {
+		return INODE_NULL;
+	}
+	if (!filter_may_contain(dir, hash_string(filename))) {
+		dir->stats.num_filtered++;
+		return INODE_NULL;
+	}
+
+	struct directory_entry entry;
+	int bucket_block;
+	int pair_idx;
+	if (index_lookup(dir, filename, &entry, &bucket_block, &pair_idx) < 0) {
+		dir->stats.num_false_positives++;
+		return INODE_NULL;
+	}
+	return entry.inode_idx;
+}
+
+inode_idx sfs_directory_read_slot(struct directory *dir, int slot, char filename[MAXFILENAME]) {
+	if (slot < 0 || slot >= dir->header.num_slots) {
+		filename[0] = '\0';
+		return INODE_NULL;
+	}
+
+	struct directory_entry entry;
+	read_entry(dir, slot, &entry);
+	strcpy(filename, entry.filename);
+
+	return entry.filename[0] == '\0' ? INODE_NULL : entry.inode_idx;
 }
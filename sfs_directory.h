@@ -3,63 +3,160 @@
 
 
 #include "sfs_base.h"
+#include "sfs_bloom.h"
+#include "sfs_cache.h"
 #include "sfs_inode.h"
 
 
+// Value of directory_header.magic. Directories written before this format
+// have none and are converted when they are loaded.
+#define DIRECTORY_MAGIC 0x44534653
+
+
+// A free slot in the directory has an empty filename and INODE_NULL as its
+// inode
 struct directory_entry {
 	char filename[MAXFILENAME];
 	inode_idx inode_idx;
 };
 
+/*
+ * Header at the start of block 0 of every directory file. The rest of block 0
+ * is a bitmap of the slots (1 bit per slot, 1 = free) and the slots start at
+ * block 1, with as many slots per block as fit without crossing a block
+ * boundary.
+ */
+struct directory_header {
+	int magic;
+	// Number of slots in the directory, including free ones
+	int num_slots;
+	// Number of slots that hold a file
+	int num_files;
+	// Inode of the hash index (see sfs_directory.c), or INODE_NULL if the
+	// directory has never held a file
+	inode_idx index_inode;
+	// Number of buckets in the hash index
+	int num_buckets;
+};
+
+struct directory_stats {
+	// Number of lookups made in the directory
+	int num_lookups;
+	// Number of lookups of missing names that the Bloom filter answered
+	// without reading the hash index
+	int num_filtered;
+	// Number of lookups of missing names that the Bloom filter let through
+	int num_false_positives;
+};
+
+/*
+ * A directory that has been opened. Only the header is kept in memory: the
+ * entries and the hash index are read through the block cache when needed, so
+ * opening a directory reads a single block however large it is.
+ */
 struct directory {
 	// Defines the geometry of the disk
 	struct super_block *super_block;
 	// Inode table to use when updating the directory, creating files, etc.
 	struct inode_table *inode_table;
-	// Number of entries (files) in the directory
-	int size;
-	// Number of entries that could fit in the directory before resizing is
-	// required
-	int capacity;
-	struct directory_entry *entries;
+	// Block cache through which the directory and its index are read and
+	// written
+	struct block_cache *cache;
+	// Inode that holds the directory
+	inode_idx inode_idx;
+	// Copy of the header in block 0
+	struct directory_header header;
+	// Counting Bloom filter over the hashes of the filenames, which lets
+	// most lookups of missing names skip the hash index. It is built from the
+	// hash index by the first lookup that needs it and is not persisted.
+	struct bloom_filter filter;
+	struct directory_stats stats;
 };
 
-/* 
- * Initializes a new directory with the given capacity and reserves an inode
- * for it.
+/*
+ * Initializes a new root directory and reserves its inode (the one given by
+ * the super block).
  */
-struct directory sfs_directory_new(struct super_block *sb, struct inode_table *table);
+struct directory sfs_directory_new(struct super_block *sb, struct inode_table *table, struct block_cache *cache);
 
 /*
- * Reads an existing directory from the disk.
+ * Opens the existing directory held by the given inode. Only its header is
+ * read, unless the directory uses the old format (a flat array of entries),
+ * in which case it is converted first.
  */
-struct directory sfs_directory_from_disk(struct super_block *sb, struct inode_table *table);
+struct directory sfs_directory_from_disk(struct super_block *sb, struct inode_table *table, struct block_cache *cache, inode_idx inode_idx);
 
 /*
  * Frees any dynamically-allocated memory and zeroes out the memory for the
- * entire table.
+ * directory. Nothing needs to be written, since every change is written as
+ * soon as it is made.
  */
 void sfs_directory_free(struct directory *dir);
 
 /*
  * Reserves an inode for a new empty file and adds an entry in the given directory.
+ * The lowest free slot is reused if there is one. Only the blocks holding the
+ * header, the new entry and the affected part of the hash index are written.
+ *
+ * The free bitmap is NOT flushed to the disk.
  *
  * Returns the inode index on success, otherwise returns INODE_NULL.
  */
 inode_idx sfs_directory_add_file(struct directory *dir, const char *filename);
 
 /*
- * Deletes the given file and removes its entry from the directory.
+ * Same as sfs_directory_add_file(), but the new inode is an empty directory.
+ * It can be opened with sfs_directory_from_disk().
+ */
+inode_idx sfs_directory_add_subdirectory(struct directory *dir, const char *filename);
+
+/*
+ * Adds an entry for an inode that has already been reserved (e.g., with
+ * sfs_inode_reserve_inodes()).
+ *
+ * Returns zero on failure and a nonzero number on success.
+ */
+int sfs_directory_link(struct directory *dir, const char *filename, inode_idx inode_idx);
+
+/*
+ * Makes sure that the directory file and its hash index have blocks on disk
+ * for the given number of new entries, so that adding them during a batch of
+ * the block cache (see sfs_cache_begin_batch()) only overwrites existing
+ * blocks. The space for the index is an estimate: a bucket split that is
+ * uneven enough may still need one more block.
+ *
+ * The free bitmap is NOT flushed to the disk.
+ *
+ * Returns zero on failure (e.g., the disk is full) and a nonzero number on
+ * success.
+ */
+int sfs_directory_reserve(struct directory *dir, int num_entries);
+
+/*
+ * Deletes the given file and removes its entry from the directory. This is
+ * also used for subdirectories, which the caller must make sure are empty
+ * (their hash index is deleted as well). The slot is marked as free rather
+ * than shifting the following entries, so only the blocks holding the header,
+ * that slot and the affected part of the hash index are written.
+ *
+ * The free bitmap is NOT flushed to the disk.
  *
  * Returns zero on failure and a nonzero number on success.
  */
 int sfs_directory_remove_file(struct directory *dir, const char *filename);
 
 /*
- * Looks up the inode index for the given filename. Returns INODE_NULL if there
- * is no such file.
+ * Looks up the inode index for the given filename using the Bloom filter and
+ * then the hash index. Returns INODE_NULL if there is no such file.
  */
 inode_idx sfs_directory_get_inode(struct directory *dir, const char *filename);
 
+/*
+ * Copies the filename in the given slot into filename and returns its inode.
+ * Returns INODE_NULL (and leaves filename empty) if the slot is free or out
+ * of range.
+ */
+inode_idx sfs_directory_read_slot(struct directory *dir, int slot, char filename[MAXFILENAME]);
+
 
 #endif
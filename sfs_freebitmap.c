@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include "disk_emu.h"
@@ -9,39 +10,160 @@ static int freebitmap_size(int total_num_blocks) {
 }
 
 static int is_block_free(struct freebitmap *fbmp, disk_ptr block_num) {
-	return fbmp->data[block_num];
+	return fbmp->data[block_num] == 1;
+}
+
+static int get_refcount(struct freebitmap *fbmp, disk_ptr block_num) {
+	switch (fbmp->data[block_num]) {
+		case 0:
+			return 1;
+		case 1:
+			return 0;
+		default:
+			return fbmp->data[block_num];
+	}
+}
+
+static void set_refcount(struct freebitmap *fbmp, disk_ptr block_num, int refcount) {
+	char value = refcount == 0 ? 1 : refcount == 1 ? 0 : refcount;
+	if (fbmp->data[block_num] == value) {
+		return;
+	}
+
+	int was_free = is_block_free(fbmp, block_num);
+	fbmp->data[block_num] = value;
+	if (was_free != (refcount == 0)) {
+		fbmp->num_free += was_free ? -1 : 1;
+		sfs_freeindex_set(&fbmp->index, block_num, !was_free);
+	}
+	// Each block has one byte in the free bitmap
+	fbmp->dirty_blocks[block_num / fbmp->super_block->block_size] = 1;
 }
 
 static void mark_block(struct freebitmap *fbmp, disk_ptr block_num, int is_free) {
-	fbmp->data[block_num] = is_free ? 1 : 0;
+	set_refcount(fbmp, block_num, is_free ? 0 : 1);
+}
+
+static disk_ptr first_data_block(struct freebitmap *fbmp) {
+	return 1 + fbmp->super_block->num_inode_blocks;
+}
+
+// One past the last data block
+static disk_ptr first_fbmp_block(struct freebitmap *fbmp) {
+	return fbmp->super_block->num_blocks - fbmp->num_blocks;
+}
+
+/*
+ * Returns the first block at or after start that begins a run of length free
+ * blocks, wrapping around to the start of the data region. Returns DISK_NULL
+ * if there is no such run.
+ */
+static disk_ptr find_free_run(struct freebitmap *fbmp, disk_ptr start, int length) {
+	disk_ptr found = sfs_freeindex_find(&fbmp->index, start, first_fbmp_block(fbmp), length);
+	if (found == DISK_NULL) {
+		found = sfs_freeindex_find(&fbmp->index, first_data_block(fbmp), start, length);
+	}
+	return found;
+}
+
+/*
+ * Returns the number of free blocks starting at start, stopping at the end of
+ * the data region or after max_length blocks.
+ */
+static int free_run_length(struct freebitmap *fbmp, disk_ptr start, int max_length) {
+	int length = 0;
+	while (start + length < first_fbmp_block(fbmp) && length < max_length && is_block_free(fbmp, start + length)) {
+		length++;
+	}
+	return length;
 }
 
+static void move_rotor(struct freebitmap *fbmp, disk_ptr after_last_reserved) {
+	fbmp->rotor = after_last_reserved;
+	if (fbmp->rotor >= first_fbmp_block(fbmp)) {
+		fbmp->rotor = first_data_block(fbmp);
+	}
+}
 
 void sfs_freebitmap_release_block(struct freebitmap *fbmp, disk_ptr block_num) {
-	mark_block(fbmp, block_num, 1);
+	pthread_mutex_lock(&fbmp->lock);
+	int refcount = get_refcount(fbmp, block_num);
+	if (refcount > 0) {
+		set_refcount(fbmp, block_num, refcount - 1);
+	}
+	pthread_mutex_unlock(&fbmp->lock);
+}
+
+int sfs_freebitmap_share_block(struct freebitmap *fbmp, disk_ptr block_num) {
+	pthread_mutex_lock(&fbmp->lock);
+	int refcount = get_refcount(fbmp, block_num);
+	int success = refcount != 0 && refcount != MAX_BLOCK_REFCOUNT;
+	if (success) {
+		set_refcount(fbmp, block_num, refcount + 1);
+	}
+	pthread_mutex_unlock(&fbmp->lock);
+	return success;
+}
+
+int sfs_freebitmap_get_refcount(struct freebitmap *fbmp, disk_ptr block_num) {
+	pthread_mutex_lock(&fbmp->lock);
+	int refcount = get_refcount(fbmp, block_num);
+	pthread_mutex_unlock(&fbmp->lock);
+	return refcount;
 }
 
 void sfs_freebitmap_flush(struct freebitmap *fbmp) {
-	write_contiguous_bytes_to_disk(
-		fbmp->super_block->num_blocks - fbmp->num_blocks,
-		freebitmap_size(fbmp->super_block->num_blocks),
-		fbmp->data,
-		fbmp->super_block->block_size
-	);
+	const int block_size = fbmp->super_block->block_size;
+	const int num_bytes = freebitmap_size(fbmp->super_block->num_blocks);
+
+	pthread_mutex_lock(&fbmp->lock);
+	int i = 0;
+	while (i < fbmp->num_blocks) {
+		if (!fbmp->dirty_blocks[i]) {
+			i++;
+			continue;
+		}
+
+		int num_dirty = 1;
+		while (i + num_dirty < fbmp->num_blocks && fbmp->dirty_blocks[i + num_dirty]) {
+			num_dirty++;
+		}
+
+		int first_byte = i * block_size;
+		int num_bytes_to_write = num_dirty * block_size;
+		if (first_byte + num_bytes_to_write > num_bytes) {
+			num_bytes_to_write = num_bytes - first_byte;
+		}
+		write_contiguous_bytes_to_disk(first_fbmp_block(fbmp) + i, num_bytes_to_write, fbmp->data + first_byte, block_size);
+
+		memset(fbmp->dirty_blocks + i, 0, num_dirty);
+		i += num_dirty;
+	}
+	pthread_mutex_unlock(&fbmp->lock);
 }
 
 struct freebitmap sfs_freebitmap_new(struct super_block *sb) {
 	struct freebitmap fbmp;
 	fbmp.super_block = sb;
+	fbmp.lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
 
 	int num_bytes = sb->num_blocks;
 	fbmp.num_blocks = ceil_div(num_bytes, sb->block_size);
 
+	fbmp.rotor = 1 + sb->num_inode_blocks;
+
+	fbmp.num_free = 0;
+	fbmp.num_claimed = 0;
+
 	fbmp.data = calloc_or_exit(num_bytes, 1);
+	fbmp.dirty_blocks = calloc_or_exit(fbmp.num_blocks, 1);
+	fbmp.index = sfs_freeindex_new(fbmp.data, sb->num_blocks);
 	// Mark all data blocks (i.e., blocks outside SB, inode table, and free bitmap) as free
 	for (int i = 1 + sb->num_inode_blocks; i < sb->num_blocks - fbmp.num_blocks; i++) {
 		mark_block(&fbmp, i, 1);
 	}
+	// Write out the whole bitmap, including the blocks that are entirely used
+	memset(fbmp.dirty_blocks, 1, fbmp.num_blocks);
 
 	sfs_freebitmap_flush(&fbmp);
 
@@ -51,13 +173,33 @@ struct freebitmap sfs_freebitmap_new(struct super_block *sb) {
 struct freebitmap sfs_freebitmap_from_disk(struct super_block *sb) {
 	struct freebitmap fbmp;
 	fbmp.super_block = sb;
+	fbmp.lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
 
 	int num_bytes = sb->num_blocks;
 	fbmp.num_blocks = ceil_div(num_bytes, sb->block_size);
 
+	fbmp.rotor = 1 + sb->num_inode_blocks;
+
 	fbmp.data = calloc_or_exit(num_bytes, 1);
+	fbmp.dirty_blocks = calloc_or_exit(fbmp.num_blocks, 1);
 	read_contiguous_bytes_from_disk(sb->num_blocks - fbmp.num_blocks, num_bytes, fbmp.data, sb->block_size);
 
+	// Shared blocks are not free, even though their byte is nonzero
+	char *is_free = calloc_or_exit(num_bytes, 1);
+	for (disk_ptr i = 0; i < num_bytes; i++) {
+		is_free[i] = is_block_free(&fbmp, i);
+	}
+	fbmp.index = sfs_freeindex_new(is_free, sb->num_blocks);
+	free(is_free);
+
+	fbmp.num_free = 0;
+	fbmp.num_claimed = 0;
+	for (disk_ptr i = first_data_block(&fbmp); i < first_fbmp_block(&fbmp); i++) {
+		if (is_block_free(&fbmp, i)) {
+			fbmp.num_free++;
+		}
+	}
+
 	return fbmp;
 }
 
@@ -65,17 +207,100 @@ void sfs_freebitmap_free(struct freebitmap *fbmp) {
 	if (fbmp->data != NULL) {
 		free(fbmp->data);
 	}
+	if (fbmp->dirty_blocks != NULL) {
+		free(fbmp->dirty_blocks);
+	}
+	sfs_freeindex_free(&fbmp->index);
+	pthread_mutex_destroy(&fbmp->lock);
 	memset(fbmp, 0, sizeof *fbmp);
 }
 
 disk_ptr sfs_freebitmap_reserve_block(struct freebitmap *fbmp) {
-	disk_ptr first_data_block = 1 + fbmp->super_block->num_inode_blocks;
-	disk_ptr first_fbmp_block = fbmp->super_block->num_blocks - fbmp->num_blocks;
-	for (disk_ptr i = first_data_block; i < first_fbmp_block; i++) {
-		if (is_block_free(fbmp, i)) {
-			mark_block(fbmp, i, 0);
-			return i;
+	return sfs_freebitmap_reserve_block_near(fbmp, DISK_NULL);
+}
+
+disk_ptr sfs_freebitmap_reserve_block_near(struct freebitmap *fbmp, disk_ptr goal) {
+	pthread_mutex_lock(&fbmp->lock);
+	if (goal < first_data_block(fbmp) || goal >= first_fbmp_block(fbmp)) {
+		goal = fbmp->rotor;
+	}
+
+	disk_ptr block = DISK_NULL;
+	if (fbmp->num_free - fbmp->num_claimed > 0) {
+		block = find_free_run(fbmp, goal, 1);
+	}
+	if (block != DISK_NULL) {
+		mark_block(fbmp, block, 0);
+		move_rotor(fbmp, block + 1);
+	}
+	pthread_mutex_unlock(&fbmp->lock);
+
+	return block;
+}
+
+static struct block_run reserve_run(struct freebitmap *fbmp, disk_ptr goal, int max_length) {
+	struct block_run run = { DISK_NULL, 0 };
+
+	// Leave the claimed blocks alone
+	if (max_length > fbmp->num_free - fbmp->num_claimed) {
+		max_length = fbmp->num_free - fbmp->num_claimed;
+	}
+	if (max_length <= 0) {
+		return run;
+	}
+
+	if (goal < first_data_block(fbmp) || goal >= first_fbmp_block(fbmp)) {
+		goal = fbmp->rotor;
+	}
+
+	if (is_block_free(fbmp, goal)) {
+		run.start = goal;
+		run.length = free_run_length(fbmp, goal, max_length);
+	}
+	else {
+		// Settle for the longest run on disk if there is no run that is long enough
+		int length = sfs_freeindex_longest_run(&fbmp->index);
+		if (length > max_length) {
+			length = max_length;
 		}
+		run.start = find_free_run(fbmp, goal, length);
+		run.length = run.start == DISK_NULL ? 0 : length;
+	}
+
+	if (run.length == 0) {
+		return run;
+	}
+
+	for (int i = 0; i < run.length; i++) {
+		mark_block(fbmp, run.start + i, 0);
+	}
+	move_rotor(fbmp, run.start + run.length);
+
+	return run;
+}
+
+struct block_run sfs_freebitmap_reserve_run(struct freebitmap *fbmp, disk_ptr goal, int max_length) {
+	pthread_mutex_lock(&fbmp->lock);
+	struct block_run run = reserve_run(fbmp, goal, max_length);
+	pthread_mutex_unlock(&fbmp->lock);
+	return run;
+}
+
+int sfs_freebitmap_claim(struct freebitmap *fbmp, int num_blocks) {
+	pthread_mutex_lock(&fbmp->lock);
+	int success = fbmp->num_free - fbmp->num_claimed >= num_blocks;
+	if (success) {
+		fbmp->num_claimed += num_blocks;
+	}
+	pthread_mutex_unlock(&fbmp->lock);
+	return success;
+}
+
+void sfs_freebitmap_unclaim(struct freebitmap *fbmp, int num_blocks) {
+	pthread_mutex_lock(&fbmp->lock);
+	fbmp->num_claimed -= num_blocks;
+	if (fbmp->num_claimed < 0) {
+		fbmp->num_claimed = 0;
 	}
-	return DISK_NULL;
+	pthread_mutex_unlock(&fbmp->lock);
 }
@@ -2,16 +2,53 @@
 #define SFS_FREEBITMAP_H
 
 
+#include <pthread.h>
+
 #include "sfs_base.h"
+#include "sfs_freeindex.h"
+
 
+// Largest number of files that can share a block (see
+// sfs_freebitmap_share_block())
+#define MAX_BLOCK_REFCOUNT 127
 
+/*
+ * One byte per block: 1 if the block is free, 0 if it is used by a single
+ * file, and the number of files sharing it (2 to MAX_BLOCK_REFCOUNT) if it is
+ * shared. Disks written before blocks could be shared only use 0 and 1.
+ *
+ * Every function below may be called from several threads at once.
+ */
 // TODO: Use an actual bitmap instead of using entire bytes?
 struct freebitmap {
 	// Defines the geometry of the disk
 	struct super_block *super_block;
 	// Number of blocks used for the free bitmap
 	int num_blocks;
+	// Block at which the next search without an explicit goal starts
+	// (next-fit). This is not persisted.
+	disk_ptr rotor;
 	char *data;
+	// Whether each block of the free bitmap has changed since the last flush
+	char *dirty_blocks;
+	// Number of free data blocks
+	int num_free;
+	// Number of free data blocks that have been promised to delayed
+	// allocations and cannot be reserved by anything else
+	int num_claimed;
+	// Index of the free runs, used to find free blocks without scanning
+	struct freeindex index;
+	// Held by every function below, since files on different inodes reserve
+	// and release blocks concurrently
+	pthread_mutex_t lock;
+};
+
+// A run of contiguous blocks on disk
+struct block_run {
+	// First block of the run, or DISK_NULL if the run is empty
+	disk_ptr start;
+	// Number of blocks in the run
+	int length;
 };
 
 /*
@@ -20,7 +57,7 @@ struct freebitmap {
 struct freebitmap sfs_freebitmap_new(struct super_block *sb);
 
 /*
- * Loads an existing free bitmap from the disk.
+ * Loads an existing free bitmap from the disk and rebuilds its index.
  */
 struct freebitmap sfs_freebitmap_from_disk(struct super_block *);
 
@@ -31,23 +68,84 @@ struct freebitmap sfs_freebitmap_from_disk(struct super_block *);
 void sfs_freebitmap_free(struct freebitmap *fbmp);
 
 /*
- * Flushes the entire free bitmap to the disk.
+ * Flushes the blocks of the free bitmap that changed since the last flush.
+ * Adjacent dirty blocks are written together.
  */
 void sfs_freebitmap_flush(struct freebitmap *fbmp);
 
 /*
- * Marks a block as available.
+ * Drops one reference to a block, which becomes available once nothing uses
+ * it anymore.
  *
  * The free bitmap is NOT flushed to the disk.
  */
 void sfs_freebitmap_release_block(struct freebitmap *fbmp, disk_ptr block_num);
 
 /*
- * Marks a block as used and returns a pointer to that block.
+ * Adds a reference to a used block, so that it is only released once every
+ * file sharing it has released it.
+ *
+ * Returns zero if the block already has MAX_BLOCK_REFCOUNT references and a
+ * nonzero number on success.
+ *
+ * The free bitmap is NOT flushed to the disk.
+ */
+int sfs_freebitmap_share_block(struct freebitmap *fbmp, disk_ptr block_num);
+
+/*
+ * Returns the number of files using the given block (zero if it is free).
+ */
+int sfs_freebitmap_get_refcount(struct freebitmap *fbmp, disk_ptr block_num);
+
+/*
+ * Marks a block as used and returns a pointer to that block. Claimed blocks
+ * are never reserved. The search
+ * starts at the rotor (i.e., just after the previously reserved block) and
+ * wraps around to the start of the data region.
  *
  * The free bitmap is NOT flushed to the disk.
  */
 disk_ptr sfs_freebitmap_reserve_block(struct freebitmap *fbmp);
 
+/*
+ * Same as sfs_freebitmap_reserve_block(), except that the search starts at
+ * the given goal block. If the goal is DISK_NULL or outside the data region,
+ * the rotor is used instead.
+ *
+ * The free bitmap is NOT flushed to the disk.
+ */
+disk_ptr sfs_freebitmap_reserve_block_near(struct freebitmap *fbmp, disk_ptr goal);
+
+/*
+ * Marks up to max_length contiguous blocks as used and returns the reserved
+ * run. If the goal block is free, the run starts there. Otherwise, the first
+ * run of max_length free blocks after the goal is used, or the first of the
+ * longest runs on disk if there is no such run. The search wraps around to the
+ * start of the data region and uses the free extent index, so it takes
+ * logarithmic time. If the goal is DISK_NULL or outside the data region, the
+ * rotor is used instead.
+ *
+ * Returns an empty run if the data region is full.
+ *
+ * The free bitmap is NOT flushed to the disk.
+ */
+struct block_run sfs_freebitmap_reserve_run(struct freebitmap *fbmp, disk_ptr goal, int max_length);
+
+
+/*
+ * Sets aside the given number of free blocks without choosing which ones, so
+ * that a later reservation of that many blocks is guaranteed to succeed.
+ *
+ * Returns zero if there are not enough free blocks and a nonzero number on
+ * success.
+ */
+int sfs_freebitmap_claim(struct freebitmap *fbmp, int num_blocks);
+
+/*
+ * Gives back blocks that were set aside by sfs_freebitmap_claim(). This must
+ * be done before the blocks are actually reserved.
+ */
+void sfs_freebitmap_unclaim(struct freebitmap *fbmp, int num_blocks);
+
 
 #endif
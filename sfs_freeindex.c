@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_freeindex.h"
+
+
+static int max(int a, int b) {
+	return a >= b ? a : b;
+}
+
+/*
+ * Recomputes the given internal node from its children, each of which covers
+ * child_size blocks.
+ */
+static void update_node(struct freeindex *index, int node, int child_size) {
+	int left = 2 * node;
+	int right = 2 * node + 1;
+
+	index->prefix[node] = index->prefix[left] == child_size
+		? child_size + index->prefix[right]
+		: index->prefix[left];
+	index->suffix[node] = index->suffix[right] == child_size
+		? child_size + index->suffix[left]
+		: index->suffix[right];
+	index->longest[node] = max(
+		max(index->longest[left], index->longest[right]),
+		index->suffix[left] + index->prefix[right]
+	);
+}
+
+static void set_leaf(struct freeindex *index, disk_ptr block_num, int is_free) {
+	int leaf = index->num_leaves + block_num;
+	int value = is_free ? 1 : 0;
+	index->longest[leaf] = value;
+	index->prefix[leaf] = value;
+	index->suffix[leaf] = value;
+}
+
+/*
+ * Returns the start of the leftmost run of at least length free blocks within
+ * the given node, which must contain such a run.
+ */
+static disk_ptr descend(struct freeindex *index, int node, int node_start, int node_size, int length) {
+	while (node < index->num_leaves) {
+		int left = 2 * node;
+		int right = 2 * node + 1;
+		node_size /= 2;
+
+		if (index->longest[left] >= length) {
+			node = left;
+		}
+		else if (index->suffix[left] + index->prefix[right] >= length) {
+			return node_start + node_size - index->suffix[left];
+		}
+		else {
+			node = right;
+			node_start += node_size;
+		}
+	}
+	return node_start;
+}
+
+/*
+ * Searches the part of the given node that lies within [start, end), from left
+ * to right. *run is the number of free blocks in [start, end) directly before
+ * the node and is updated to include the node if no run is found.
+ */
+static disk_ptr find_in_node(struct freeindex *index, int node, int node_start, int node_size, disk_ptr start, disk_ptr end, int length, int *run) {
+	int node_end = node_start + node_size;
+	if (node_end <= start || node_start >= end) {
+		return DISK_NULL;
+	}
+
+	// The whole node is in range, so its summary can be used directly
+	if (start <= node_start && node_end <= end) {
+		if (*run + index->prefix[node] >= length) {
+			return node_start - *run;
+		}
+		if (index->longest[node] >= length) {
+			return descend(index, node, node_start, node_size, length);
+		}
+		*run = index->prefix[node] == node_size ? *run + node_size : index->suffix[node];
+		return DISK_NULL;
+	}
+
+	int child_size = node_size / 2;
+	disk_ptr found = find_in_node(index, 2 * node, node_start, child_size, start, end, length, run);
+	if (found != DISK_NULL) {
+		return found;
+	}
+	return find_in_node(index, 2 * node + 1, node_start + child_size, child_size, start, end, length, run);
+}
+
+
+struct freeindex sfs_freeindex_new(const char *is_free, int num_blocks) {
+	struct freeindex index;
+
+	index.num_leaves = 1;
+	while (index.num_leaves < num_blocks) {
+		index.num_leaves *= 2;
+	}
+
+	index.longest = calloc_or_exit(2 * index.num_leaves, sizeof(int));
+	index.prefix = calloc_or_exit(2 * index.num_leaves, sizeof(int));
+	index.suffix = calloc_or_exit(2 * index.num_leaves, sizeof(int));
+
+	for (disk_ptr i = 0; i < num_blocks; i++) {
+		set_leaf(&index, i, is_free[i]);
+	}
+
+	// Build the internal nodes bottom-up, one level at a time
+	int child_size = 1;
+	for (int level_start = index.num_leaves / 2; level_start >= 1; level_start /= 2) {
+		for (int node = level_start; node < 2 * level_start; node++) {
+			update_node(&index, node, child_size);
+		}
+		child_size *= 2;
+	}
+
+	return index;
+}
+
+void sfs_freeindex_free(struct freeindex *index) {
+	if (index->longest != NULL) {
+		free(index->longest);
+	}
+	if (index->prefix != NULL) {
+		free(index->prefix);
+	}
+	if (index->suffix != NULL) {
+		free(index->suffix);
+	}
+	memset(index, 0, sizeof *index);
+}
+
+void sfs_freeindex_set(struct freeindex *index, disk_ptr block_num, int is_free) {
+	set_leaf(index, block_num, is_free);
+
+	int child_size = 1;
+	for (int node = (index->num_leaves + block_num) / 2; node >= 1; node /= 2) {
+		update_node(index, node, child_size);
+		child_size *= 2;
+	}
+}
+
+int sfs_freeindex_longest_run(struct freeindex *index) {
+	return index->longest[1];
+}
+
+disk_ptr sfs_freeindex_find(struct freeindex *index, disk_ptr start, disk_ptr end, int length) {
+	if (length <= 0 || start >= end) {
+		return DISK_NULL;
+	}
+
+	int run = 0;
+	return find_in_node(index, 1, 0, index->num_leaves, start, end, length, &run);
+}
@@ -0,0 +1,63 @@
+#ifndef SFS_FREEINDEX_H
+#define SFS_FREEINDEX_H
+
+
+#include "sfs_base.h"
+
+
+/*
+ * Index of the free extents on disk, kept on top of the free bitmap. It is a
+ * segment tree over the blocks in which every node records the longest run of
+ * free blocks in its range as well as the runs touching either end of its
+ * range. This answers "where is the first run of at least N free blocks after
+ * block X?" in logarithmic time.
+ *
+ * The index is not persisted. It is rebuilt from the free bitmap at mount.
+ */
+struct freeindex {
+	// Number of leaves, i.e., the number of blocks rounded up to a power of two.
+	// Leaves past the end of the disk are treated as used.
+	int num_leaves;
+	// Node i has children 2i and 2i + 1. The root is node 1 and block b is
+	// node num_leaves + b.
+	// Longest run of free blocks within each node
+	int *longest;
+	// Run of free blocks at the start of each node
+	int *prefix;
+	// Run of free blocks at the end of each node
+	int *suffix;
+};
+
+
+/*
+ * Builds an index for a disk with the given number of blocks. is_free has one
+ * byte per block, which is nonzero if the block is free (i.e., the format of
+ * the free bitmap).
+ */
+struct freeindex sfs_freeindex_new(const char *is_free, int num_blocks);
+
+/*
+ * Frees any dynamically-allocated memory and zeroes out the memory for the
+ * index.
+ */
+void sfs_freeindex_free(struct freeindex *index);
+
+/*
+ * Records that the given block is now free or used.
+ */
+void sfs_freeindex_set(struct freeindex *index, disk_ptr block_num, int is_free);
+
+/*
+ * Returns the length of the longest run of free blocks on the disk.
+ */
+int sfs_freeindex_longest_run(struct freeindex *index);
+
+/*
+ * Returns the first block b in [start, end) such that the blocks
+ * [b, b + length) are all free and lie within [start, end). Returns DISK_NULL
+ * if there is no such block.
+ */
+disk_ptr sfs_freeindex_find(struct freeindex *index, disk_ptr start, disk_ptr end, int length);
+
+
+#endif
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,259 +7,1445 @@
 #include "sfs_inode.h"
 
 
+// Table whose inode flushes the calling thread is deferring, and the number of
+// batches it has open on it (see sfs_inode_begin_batch())
+static __thread struct inode_table *batch_table = NULL;
+static __thread int batch_depth = 0;
+
 static int max(int a, int b) {
 	return a >= b ? a : b;
 }
 
-static int min(int a, int b) {
-	return a <= b ? a : b;
+static int min(int a, int b) {
+	return a <= b ? a : b;
+}
+
+static struct inode *get_active_inode(struct inode_table *table, inode_idx i) {
+	if (i < 0 || i >= table->size) {
+		return NULL;
+	}
+
+	struct inode *inode = table->entries + i;
+	if (inode->type == INODE_TYPE_FREE) {
+		return NULL;
+	}
+
+	return inode;
+}
+
+/*
+ * Copies an inode with an atomic load and store of each field, since the
+ * published copies are read without locks (see sfs_inode_snapshot()).
+ */
+static void copy_inode_atomically(struct inode *dst, struct inode *src) {
+	__atomic_store_n(&dst->type, __atomic_load_n(&src->type, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_store_n(&dst->size, __atomic_load_n(&src->size, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	for (int i = 0; i < NUM_INODE_DIRECT_PTRS; i++) {
+		__atomic_store_n(dst->direct_pointers + i, __atomic_load_n(src->direct_pointers + i, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&dst->indirect_pointer, __atomic_load_n(&src->indirect_pointer, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+/*
+ * Flushes the entire inode table to the disk.
+ */
+static void flush_inode_table(struct inode_table *table) {
+	memcpy(table->image, table->entries, table->size * sizeof(struct inode));
+	write_contiguous_bytes_to_disk(
+		1,
+		table->size * sizeof(struct inode),
+		table->image,
+		table->super_block->block_size
+	);
+}
+
+/*
+ * Writes blocks [first_block, end_block) of the inode table from its image in
+ * a single write. The caller must hold table->lock.
+ */
+static void write_image_blocks(struct inode_table *table, int first_block, int end_block) {
+	const int block_size = table->super_block->block_size;
+	const int table_num_bytes = table->size * sizeof(struct inode);
+
+	int end_byte = end_block * block_size;
+	if (end_byte > table_num_bytes) {
+		end_byte = table_num_bytes;
+	}
+
+	write_contiguous_bytes_to_disk(
+		1 + first_block,
+		end_byte - first_block * block_size,
+		(char *) table->image + first_block * block_size,
+		block_size
+	);
+}
+
+/*
+ * Flushes only the block(s) of the inode table that hold inodes [first, end)
+ * in a single write, or marks them as dirty if the calling thread is in a
+ * batch and may_defer is nonzero. An inode can straddle two blocks. The caller
+ * must hold table->lock and must have copied the inodes that changed into the
+ * image.
+ */
+static void flush_image_range(struct inode_table *table, inode_idx first, inode_idx end, int may_defer) {
+	const int block_size = table->super_block->block_size;
+
+	const int first_block = first * sizeof(struct inode) / block_size;
+	const int end_block = ceil_div(end * sizeof(struct inode), block_size);
+
+	if (may_defer && batch_table == table) {
+		memset(table->dirty_blocks + first_block, 1, end_block - first_block);
+		return;
+	}
+	write_image_blocks(table, first_block, end_block);
+}
+
+static void flush_inode(struct inode_table *table, inode_idx inode_idx) {
+	pthread_mutex_lock(&table->lock);
+	table->image[inode_idx] = table->entries[inode_idx];
+	flush_image_range(table, inode_idx, inode_idx + 1, 1);
+	pthread_mutex_unlock(&table->lock);
+}
+
+
+/*
+ * Returns the block near which the nth data block of the given inode should be
+ * allocated: right after the file's previous block if it has one, otherwise the
+ * inode's allocation goal.
+ *
+ * The indirect block must already have been fetched if n > NUM_INODE_DIRECT_PTRS.
+ */
+static disk_ptr get_allocation_goal(struct inode_table *table, inode_idx inode_idx, int n, disk_ptr *indirect_block) {
+	struct inode *inode = table->entries + inode_idx;
+
+	disk_ptr previous = DISK_NULL;
+	if (n > 0 && n - 1 < NUM_INODE_DIRECT_PTRS) {
+		previous = inode->direct_pointers[n - 1];
+	}
+	else if (n > 0) {
+		previous = indirect_block[n - 1 - NUM_INODE_DIRECT_PTRS];
+	}
+
+	if (previous != DISK_NULL) {
+		return previous + 1;
+	}
+	return table->alloc_goals[inode_idx];
+}
+
+/*
+ * Reserves a data block for the given inode near the given goal and moves the
+ * inode's allocation goal past it. Returns DISK_NULL if the disk is full.
+ */
+static disk_ptr allocate_block(struct inode_table *table, inode_idx inode_idx, disk_ptr goal) {
+	disk_ptr block = sfs_freebitmap_reserve_block_near(table->free_bitmap, goal);
+	if (block != DISK_NULL) {
+		table->alloc_goals[inode_idx] = block + 1;
+	}
+	return block;
+}
+
+/*
+ * Reserves up to max_length contiguous data blocks for the given inode near the
+ * given goal and moves the inode's allocation goal past them. Returns an empty
+ * run if the disk is full.
+ */
+static struct block_run allocate_run(struct inode_table *table, inode_idx inode_idx, disk_ptr goal, int max_length) {
+	struct block_run run = sfs_freebitmap_reserve_run(table->free_bitmap, goal, max_length);
+	if (run.length > 0) {
+		table->alloc_goals[inode_idx] = run.start + run.length;
+	}
+	return run;
+}
+
+/*
+ * Returns the maximum number of data blocks in a single file.
+ */
+static int max_blocks_per_file(struct super_block *sb) {
+	return NUM_INODE_DIRECT_PTRS + sb->block_size / sizeof(disk_ptr);
+}
+
+/*
+ * Reads the indirect block of the given inode into indirect_block, or zeroes
+ * out indirect_block if the inode does not have an indirect block yet.
+ */
+static void load_indirect_block(struct super_block *sb, struct inode *inode, disk_ptr *indirect_block) {
+	const int disk_ptrs_per_block = sb->block_size / sizeof(disk_ptr);
+
+	if (inode->indirect_pointer == DISK_NULL) {
+		memset(indirect_block, 0, disk_ptrs_per_block * sizeof(disk_ptr));
+	}
+	else {
+		read_contiguous_bytes_from_disk(inode->indirect_pointer, disk_ptrs_per_block * sizeof(disk_ptr), indirect_block, sb->block_size);
+	}
+}
+
+/*
+ * Returns the nth data block in the given inode, or DISK_NULL if that block is
+ * not allocated. The indirect block must already be loaded if
+ * n >= NUM_INODE_DIRECT_PTRS.
+ */
+static disk_ptr get_mapped_block(struct inode *inode, int n, disk_ptr *indirect_block) {
+	if (n < NUM_INODE_DIRECT_PTRS) {
+		return inode->direct_pointers[n];
+	}
+	return indirect_block[n - NUM_INODE_DIRECT_PTRS];
+}
+
+/*
+ * Sets the nth data block in the given inode. The indirect block must already
+ * be loaded if n >= NUM_INODE_DIRECT_PTRS.
+ */
+static void set_mapped_block(struct inode *inode, int n, disk_ptr *indirect_block, disk_ptr block) {
+	if (n < NUM_INODE_DIRECT_PTRS) {
+		inode->direct_pointers[n] = block;
+	}
+	else {
+		indirect_block[n - NUM_INODE_DIRECT_PTRS] = block;
+	}
+}
+
+/*
+ * Returns a pointer to the nth data block in the given inode, or DISK_NULL if
+ * that block is not allocated. The indirect block is loaded on first use.
+ */
+static disk_ptr get_data_block_from_inode(struct inode_table *table, inode_idx inode_idx, int n, disk_ptr *indirect_block, int *indirect_block_fetched) {
+	struct super_block *sb = table->super_block;
+	struct inode *inode = table->entries + inode_idx;
+
+	if (n >= max_blocks_per_file(sb)) {
+		// Reached max file size
+		return DISK_NULL;
+	}
+
+	if (n >= NUM_INODE_DIRECT_PTRS && inode->indirect_pointer == DISK_NULL) {
+		// Block before end of file is not allocated (sparse file?)
+		return DISK_NULL;
+	}
+
+	// Load the indirect block from the disk if it hasn't been loaded yet
+	if (n >= NUM_INODE_DIRECT_PTRS && !(*indirect_block_fetched)) {
+		load_indirect_block(sb, inode, indirect_block);
+		*indirect_block_fetched = 1;
+	}
+
+	return get_mapped_block(inode, n, indirect_block);
+}
+
+/*
+ * Makes sure that data blocks [first_block_idx, end_block_idx) of the given
+ * inode are allocated. Each stretch of unallocated blocks is reserved as a
+ * single run where the free space allows it. The indirect block must already
+ * be loaded if end_block_idx > NUM_INODE_DIRECT_PTRS and *indirect_block_dirty
+ * is set if it changes.
+ *
+ * If newly_mapped is not NULL, newly_mapped[i] is set to whether block
+ * first_block_idx + i was allocated by this call (and so holds whatever a
+ * deleted file left in it).
+ *
+ * Returns the number of blocks, starting from first_block_idx, that are
+ * allocated. This is less than requested if the disk is full.
+ */
+static int map_blocks_for_write(struct inode_table *table, inode_idx inode_idx, int first_block_idx, int end_block_idx, disk_ptr *indirect_block, int *indirect_block_dirty, char *newly_mapped) {
+	struct inode *inode = table->entries + inode_idx;
+
+	if (newly_mapped != NULL) {
+		memset(newly_mapped, 0, end_block_idx - first_block_idx);
+	}
+
+	int n = first_block_idx;
+	while (n < end_block_idx) {
+		if (n >= NUM_INODE_DIRECT_PTRS && inode->indirect_pointer == DISK_NULL) {
+			// Keep the indirect block in line with the data blocks around it
+			disk_ptr goal = get_allocation_goal(table, inode_idx, NUM_INODE_DIRECT_PTRS, indirect_block);
+			inode->indirect_pointer = allocate_block(table, inode_idx, goal);
+			if (inode->indirect_pointer == DISK_NULL) {
+				// No data blocks available
+				break;
+			}
+			*indirect_block_dirty = 1;
+		}
+
+		if (get_mapped_block(inode, n, indirect_block) != DISK_NULL) {
+			n++;
+			continue;
+		}
+
+		// Stop the run where the indirect block still needs to be allocated so
+		// that it can go in between
+		int num_unmapped = 1;
+		while (n + num_unmapped < end_block_idx
+				&& get_mapped_block(inode, n + num_unmapped, indirect_block) == DISK_NULL
+				&& !(n + num_unmapped == NUM_INODE_DIRECT_PTRS && inode->indirect_pointer == DISK_NULL)) {
+			num_unmapped++;
+		}
+
+		disk_ptr goal = get_allocation_goal(table, inode_idx, n, indirect_block);
+		struct block_run run = allocate_run(table, inode_idx, goal, num_unmapped);
+		if (run.length == 0) {
+			// No data blocks available
+			break;
+		}
+
+		for (int i = 0; i < run.length; i++) {
+			set_mapped_block(inode, n + i, indirect_block, run.start + i);
+		}
+		if (newly_mapped != NULL) {
+			memset(newly_mapped + (n - first_block_idx), 1, run.length);
+		}
+		if (n + run.length > NUM_INODE_DIRECT_PTRS) {
+			*indirect_block_dirty = 1;
+		}
+		n += run.length;
+	}
+
+	return n - first_block_idx;
+}
+
+/*
+ * Gives the given inode its own copy of every block in [first_block_idx,
+ * end_block_idx) that it shares with other files (see sfs_inode_clone()), so
+ * that the block can be written without changing the other files. Only the
+ * blocks holding start_byte and end_byte - 1 are copied, since the others are
+ * about to be overwritten entirely. The indirect block must already be loaded
+ * if end_block_idx > NUM_INODE_DIRECT_PTRS and *indirect_block_dirty is set if
+ * it changes.
+ *
+ * Returns the number of blocks, starting from first_block_idx, that the inode
+ * does not share. This is less than requested if the disk is full.
+ */
+static int unshare_blocks(struct inode_table *table, inode_idx inode_idx, int start_byte, int end_byte, disk_ptr *indirect_block, int *indirect_block_dirty) {
+	const int block_size = table->super_block->block_size;
+	struct inode *inode = table->entries + inode_idx;
+
+	const int first_block_idx = start_byte / block_size;
+	const int end_block_idx = ceil_div(end_byte, block_size);
+
+	int n = first_block_idx;
+	for (; n < end_block_idx; n++) {
+		disk_ptr old_block = get_mapped_block(inode, n, indirect_block);
+		if (old_block == DISK_NULL || sfs_freebitmap_get_refcount(table->free_bitmap, old_block) <= 1) {
+			continue;
+		}
+
+		disk_ptr new_block = allocate_block(table, inode_idx, get_allocation_goal(table, inode_idx, n, indirect_block));
+		if (new_block == DISK_NULL) {
+			break;
+		}
+
+		int covers_whole_block = start_byte <= n * block_size && end_byte >= (n + 1) * block_size;
+		if (!covers_whole_block) {
+			char tmp_buffer[block_size];
+			read_blocks(old_block, 1, tmp_buffer);
+			write_blocks(new_block, 1, tmp_buffer);
+		}
+
+		set_mapped_block(inode, n, indirect_block, new_block);
+		sfs_freebitmap_release_block(table->free_bitmap, old_block);
+		if (n >= NUM_INODE_DIRECT_PTRS) {
+			*indirect_block_dirty = 1;
+		}
+	}
+
+	return n - first_block_idx;
+}
+
+/*
+ * Writes bytes [start_byte, start_byte + num_bytes) of the given inode, whose
+ * data blocks must all be allocated already. Blocks that are contiguous on
+ * disk are written with a single call to write_blocks(). Partially-written
+ * blocks are read first so that their existing data is kept, except for the
+ * ones that map_blocks_for_write() just allocated (as reported in
+ * newly_mapped, indexed from the block holding start_byte, which may be NULL
+ * if there are none): the rest of those is zeroed out instead.
+ */
+static void write_mapped_blocks(struct inode_table *table, inode_idx inode_idx, int start_byte, int num_bytes, const char *data, disk_ptr *indirect_block, const char *newly_mapped) {
+	const int block_size = table->super_block->block_size;
+	struct inode *inode = table->entries + inode_idx;
+
+	const int end_byte = start_byte + num_bytes;
+	const int first_block_idx = start_byte / block_size;
+	const int end_block_idx = ceil_div(end_byte, block_size);
+
+	int block_idx = first_block_idx;
+	while (block_idx < end_block_idx) {
+		disk_ptr run_start = get_mapped_block(inode, block_idx, indirect_block);
+		int run_length = 1;
+		while (block_idx + run_length < end_block_idx && get_mapped_block(inode, block_idx + run_length, indirect_block) == run_start + run_length) {
+			run_length++;
+		}
+
+		const int run_first_byte = block_idx * block_size;
+		const int run_end_byte = (block_idx + run_length) * block_size;
+		const int write_from = max(start_byte, run_first_byte);
+		const int write_to = min(end_byte, run_end_byte);
+
+		const int last_idx = block_idx + run_length - 1;
+		const int first_is_new = newly_mapped != NULL && newly_mapped[block_idx - first_block_idx];
+		const int last_is_new = newly_mapped != NULL && newly_mapped[last_idx - first_block_idx];
+
+		char *buffer = calloc_or_exit(run_length, block_size);
+		if (write_from > run_first_byte && !first_is_new) {
+			read_blocks(run_start, 1, buffer);
+		}
+		if (write_to < run_end_byte && (run_length > 1 || write_from == run_first_byte) && !last_is_new) {
+			read_blocks(run_start + run_length - 1, 1, buffer + (run_length - 1) * block_size);
+		}
+		memcpy(buffer + (write_from - run_first_byte), data + (write_from - start_byte), write_to - write_from);
+		write_blocks(run_start, run_length, buffer);
+		free(buffer);
+
+		block_idx += run_length;
+	}
+}
+
+/*
+ * Returns the buffered contents of the nth data block of the given inode, or
+ * NULL if nothing is buffered for that block.
+ */
+static char *get_buffered_block(struct inode_table *table, inode_idx inode_idx, int n) {
+	char **blocks = table->delalloc[inode_idx].blocks;
+	return blocks == NULL ? NULL : blocks[n];
+}
+
+/*
+ * Creates a zeroed-out buffer for the nth data block of the given inode and
+ * claims enough free blocks to back it later. Returns NULL if the disk is
+ * full.
+ */
+static char *create_buffered_block(struct inode_table *table, inode_idx inode_idx, int n) {
+	struct super_block *sb = table->super_block;
+	struct inode *inode = table->entries + inode_idx;
+	struct delalloc_buffer *buffer = table->delalloc + inode_idx;
+
+	int needs_indirect_block = n >= NUM_INODE_DIRECT_PTRS && inode->indirect_pointer == DISK_NULL && !buffer->indirect_claimed;
+	int num_to_claim = needs_indirect_block ? 2 : 1;
+	if (!sfs_freebitmap_claim(table->free_bitmap, num_to_claim)) {
+		return NULL;
+	}
+	buffer->num_claimed += num_to_claim;
+	if (needs_indirect_block) {
+		buffer->indirect_claimed = 1;
+	}
+
+	if (buffer->blocks == NULL) {
+		buffer->blocks = calloc_or_exit(max_blocks_per_file(sb), sizeof(char *));
+	}
+	buffer->blocks[n] = calloc_or_exit(1, sb->block_size);
+	buffer->num_blocks++;
+	pthread_mutex_lock(&table->lock);
+	table->num_buffered_blocks++;
+	pthread_mutex_unlock(&table->lock);
+
+	return buffer->blocks[n];
+}
+
+/*
+ * Frees the buffered data of the given inode and gives back its claimed
+ * blocks.
+ */
+static void discard_buffered_blocks(struct inode_table *table, inode_idx inode_idx) {
+	struct delalloc_buffer *buffer = table->delalloc + inode_idx;
+
+	if (buffer->blocks != NULL) {
+		for (int i = 0; i < max_blocks_per_file(table->super_block); i++) {
+			if (buffer->blocks[i] != NULL) {
+				free(buffer->blocks[i]);
+			}
+		}
+		free(buffer->blocks);
+	}
+
+	pthread_mutex_lock(&table->lock);
+	table->num_buffered_blocks -= buffer->num_blocks;
+	pthread_mutex_unlock(&table->lock);
+	sfs_freebitmap_unclaim(table->free_bitmap, buffer->num_claimed);
+	memset(buffer, 0, sizeof *buffer);
+}
+
+/*
+ * Frees the buffered data for the nth data block of the given inode, if any,
+ * and gives back the block claimed for it.
+ */
+static void discard_buffered_block(struct inode_table *table, inode_idx inode_idx, int n) {
+	struct delalloc_buffer *buffer = table->delalloc + inode_idx;
+	if (buffer->blocks == NULL || buffer->blocks[n] == NULL) {
+		return;
+	}
+
+	free(buffer->blocks[n]);
+	buffer->blocks[n] = NULL;
+	buffer->num_blocks--;
+	pthread_mutex_lock(&table->lock);
+	table->num_buffered_blocks--;
+	pthread_mutex_unlock(&table->lock);
+	sfs_freebitmap_unclaim(table->free_bitmap, 1);
+	buffer->num_claimed--;
+
+	if (buffer->num_blocks == 0) {
+		discard_buffered_blocks(table, inode_idx);
+	}
+}
+
+/*
+ * Zeroes out the part of the block holding byte size - 1 that comes after it,
+ * whether the block is buffered or on disk. This must be done before that part
+ * becomes part of the file, since it may hold stale data. The indirect block
+ * must already be loaded if the block is past the direct pointers and
+ * *indirect_block_dirty is set if it changes.
+ *
+ * Returns zero if the block is shared and could not be copied (the disk is
+ * full) and a nonzero number on success.
+ */
+static int zero_block_tail(struct inode_table *table, inode_idx inode_idx, int size, disk_ptr *indirect_block, int *indirect_block_dirty) {
+	const int block_size = table->super_block->block_size;
+	if (size % block_size == 0) {
+		return 1;
+	}
+
+	const int n = size / block_size;
+	char *buffered_block = get_buffered_block(table, inode_idx, n);
+	if (buffered_block != NULL) {
+		memset(buffered_block + size % block_size, 0, block_size - size % block_size);
+		return 1;
+	}
+
+	if (unshare_blocks(table, inode_idx, size, size + 1, indirect_block, indirect_block_dirty) == 0) {
+		return 0;
+	}
+
+	disk_ptr block = get_mapped_block(table->entries + inode_idx, n, indirect_block);
+	if (block != DISK_NULL) {
+		char tmp_buffer[block_size];
+		read_blocks(block, 1, tmp_buffer);
+		memset(tmp_buffer + size % block_size, 0, block_size - size % block_size);
+		write_blocks(block, 1, tmp_buffer);
+	}
+	return 1;
+}
+
+/*
+ * Makes block dst_n of the dst_idx inode share block src_n of the src_idx
+ * inode, releasing the block it had. A hole in the source leaves a hole in
+ * the destination. Both indirect blocks must already be loaded (they are the
+ * same array if both inodes are the same) and *dst_indirect_block_dirty is set
+ * if the destination's changes.
+ *
+ * Returns zero if the block could not be shared (e.g., the disk is full) and a
+ * nonzero number on success.
+ */
+static int clone_block(struct inode_table *table, inode_idx src_idx, int src_n, disk_ptr *src_indirect_block, inode_idx dst_idx, int dst_n, disk_ptr *dst_indirect_block, int *dst_indirect_block_dirty) {
+	struct inode *dst = table->entries + dst_idx;
+
+	disk_ptr block = get_mapped_block(table->entries + src_idx, src_n, src_indirect_block);
+	disk_ptr old_block = get_mapped_block(dst, dst_n, dst_indirect_block);
+	if (block == old_block) {
+		return 1;
+	}
+
+	if (block != DISK_NULL) {
+		if (dst_n >= NUM_INODE_DIRECT_PTRS && dst->indirect_pointer == DISK_NULL) {
+			disk_ptr goal = get_allocation_goal(table, dst_idx, NUM_INODE_DIRECT_PTRS, dst_indirect_block);
+			dst->indirect_pointer = allocate_block(table, dst_idx, goal);
+			if (dst->indirect_pointer == DISK_NULL) {
+				return 0;
+			}
+			*dst_indirect_block_dirty = 1;
+		}
+		if (!sfs_freebitmap_share_block(table->free_bitmap, block)) {
+			return 0;
+		}
+	}
+
+	if (old_block != DISK_NULL) {
+		sfs_freebitmap_release_block(table->free_bitmap, old_block);
+	}
+	set_mapped_block(dst, dst_n, dst_indirect_block, block);
+	if (dst_n >= NUM_INODE_DIRECT_PTRS) {
+		*dst_indirect_block_dirty = 1;
+	}
+	return 1;
+}
+
+/*
+ * Writes out the buffered data for blocks [first_block_idx, end_block_idx) of
+ * the given inode, which must all be allocated already. Blocks that are
+ * contiguous on disk are written with a single call to write_blocks().
+ */
+static void write_buffered_blocks(struct inode_table *table, inode_idx inode_idx, int first_block_idx, int end_block_idx, disk_ptr *indirect_block) {
+	const int block_size = table->super_block->block_size;
+	struct inode *inode = table->entries + inode_idx;
+
+	int block_idx = first_block_idx;
+	while (block_idx < end_block_idx) {
+		disk_ptr run_start = get_mapped_block(inode, block_idx, indirect_block);
+		int run_length = 1;
+		while (block_idx + run_length < end_block_idx && get_mapped_block(inode, block_idx + run_length, indirect_block) == run_start + run_length) {
+			run_length++;
+		}
+
+		char *buffer = calloc_or_exit(run_length, block_size);
+		for (int i = 0; i < run_length; i++) {
+			memcpy(buffer + i * block_size, get_buffered_block(table, inode_idx, block_idx + i), block_size);
+		}
+		write_blocks(run_start, run_length, buffer);
+		free(buffer);
+
+		block_idx += run_length;
+	}
+}
+
+static void init_locks(struct inode_table *table) {
+	table->locks = calloc_or_exit(table->size, sizeof(pthread_rwlock_t));
+	for (inode_idx i = 0; i < table->size; i++) {
+		pthread_rwlock_init(table->locks + i, NULL);
+	}
+	table->alloc_lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+	table->lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+}
+
+/*
+ * Allocates the published copy of every inode, on cache-line boundaries, and
+ * fills it from the entries.
+ */
+static void init_published(struct inode_table *table) {
+	void *published;
+	if (posix_memalign(&published, sizeof(struct published_inode), table->size * sizeof(struct published_inode)) != 0) {
+		fprintf(stderr, "Failed to allocate memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	table->published = published;
+	memset(table->published, 0, table->size * sizeof(struct published_inode));
+	for (inode_idx i = 0; i < table->size; i++) {
+		table->published[i].inode = table->entries[i];
+	}
+}
+
+struct inode_table sfs_inode_new_table(struct super_block *sb, struct freebitmap *fbmp) {
+	struct inode_table table;
+
+	table.super_block = sb;
+	table.free_bitmap = fbmp;
+
+	table.size = sb->num_inode_blocks * sb->block_size / sizeof(struct inode);
+	table.entries = calloc_or_exit(table.size, sizeof(struct inode));
+	table.alloc_goals = calloc_or_exit(table.size, sizeof(disk_ptr));
+	table.delalloc = calloc_or_exit(table.size, sizeof(struct delalloc_buffer));
+	init_locks(&table);
+	table.image = calloc_or_exit(table.size, sizeof(struct inode));
+	table.num_buffered_blocks = 0;
+	table.dirty_blocks = calloc_or_exit(sb->num_inode_blocks, 1);
+	init_published(&table);
+
+	flush_inode_table(&table);
+
+	return table;
+}
+
+struct inode_table sfs_inode_table_from_disk(struct super_block *sb, struct freebitmap *fbmp) {
+	struct inode_table table;
+
+	table.super_block = sb;
+	table.free_bitmap = fbmp;
+
+	table.size = sb->num_inode_blocks * sb->block_size / sizeof(struct inode);
+	table.entries = calloc_or_exit(table.size, sizeof(struct inode));
+	table.alloc_goals = calloc_or_exit(table.size, sizeof(disk_ptr));
+	table.delalloc = calloc_or_exit(table.size, sizeof(struct delalloc_buffer));
+	init_locks(&table);
+	table.image = calloc_or_exit(table.size, sizeof(struct inode));
+	table.num_buffered_blocks = 0;
+	table.dirty_blocks = calloc_or_exit(sb->num_inode_blocks, 1);
+	read_contiguous_bytes_from_disk(1, table.size * sizeof(struct inode), table.entries, sb->block_size);
+	memcpy(table.image, table.entries, table.size * sizeof(struct inode));
+	init_published(&table);
+
+	return table;
+}
+
+void sfs_inode_free_table(struct inode_table *table) {
+	if (table->entries != NULL) {
+		free(table->entries);
+	}
+	if (table->alloc_goals != NULL) {
+		free(table->alloc_goals);
+	}
+	if (table->delalloc != NULL) {
+		for (inode_idx i = 0; i < table->size; i++) {
+			struct delalloc_buffer *buffer = table->delalloc + i;
+			if (buffer->blocks == NULL) {
+				continue;
+			}
+			for (int j = 0; j < max_blocks_per_file(table->super_block); j++) {
+				if (buffer->blocks[j] != NULL) {
+					free(buffer->blocks[j]);
+				}
+			}
+			free(buffer->blocks);
+		}
+		free(table->delalloc);
+	}
+	if (table->locks != NULL) {
+		for (inode_idx i = 0; i < table->size; i++) {
+			pthread_rwlock_destroy(table->locks + i);
+		}
+		free(table->locks);
+	}
+	if (table->published != NULL) {
+		free(table->published);
+	}
+	if (table->image != NULL) {
+		free(table->image);
+	}
+	if (table->dirty_blocks != NULL) {
+		free(table->dirty_blocks);
+	}
+	pthread_mutex_destroy(&table->alloc_lock);
+	pthread_mutex_destroy(&table->lock);
+	memset(table, 0, sizeof *table);
+}
+
+void sfs_inode_read_lock(struct inode_table *table, inode_idx inode_idx) {
+	pthread_rwlock_rdlock(table->locks + inode_idx);
+}
+
+void sfs_inode_write_lock(struct inode_table *table, inode_idx inode_idx) {
+	pthread_rwlock_wrlock(table->locks + inode_idx);
+
+	// Readers without the lock ignore what they read from now on
+	struct published_inode *published = table->published + inode_idx;
+	__atomic_store_n(&published->seq, published->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void sfs_inode_unlock(struct inode_table *table, inode_idx inode_idx) {
+	// The sequence number is only odd for the holder of the write lock
+	struct published_inode *published = table->published + inode_idx;
+	unsigned int seq = __atomic_load_n(&published->seq, __ATOMIC_RELAXED);
+	if (seq % 2 != 0) {
+		copy_inode_atomically(&published->inode, table->entries + inode_idx);
+		__atomic_store_n(&published->seq, seq + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_rwlock_unlock(table->locks + inode_idx);
+}
+
+/*
+ * Does the work of sfs_inode_snapshot() and sets *seq to the sequence number
+ * that the copy was made at, for is_unchanged().
+ */
+static int take_snapshot(struct inode_table *table, inode_idx inode_idx, struct inode *inode, unsigned int *seq) {
+	if (inode_idx < 0 || inode_idx >= table->size) {
+		return 0;
+	}
+
+	struct published_inode *published = table->published + inode_idx;
+	*seq = __atomic_load_n(&published->seq, __ATOMIC_ACQUIRE);
+	if (*seq % 2 != 0) {
+		return 0;
+	}
+	copy_inode_atomically(inode, &published->inode);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&published->seq, __ATOMIC_RELAXED) == *seq;
+}
+
+/*
+ * Checks whether the write lock of the given inode has been taken since its
+ * sequence number was seq. Everything read before this call (including from
+ * the disk) is covered.
+ */
+static int is_unchanged(struct inode_table *table, inode_idx inode_idx, unsigned int seq) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&table->published[inode_idx].seq, __ATOMIC_RELAXED) == seq;
+}
+
+/*
+ * Checks whether a block pointer read without locks points to a block on the
+ * disk past the super block, so that following a stale one is harmless.
+ */
+static int is_on_disk(struct super_block *sb, disk_ptr block) {
+	return block > DISK_NULL && block < sb->num_blocks;
+}
+
+int sfs_inode_snapshot(struct inode_table *table, inode_idx inode_idx, struct inode *inode) {
+	unsigned int seq;
+	return take_snapshot(table, inode_idx, inode, &seq);
+}
+
+void sfs_inode_begin_batch(struct inode_table *table) {
+	// A batch on another table does not defer anything
+	if (batch_depth == 0) {
+		batch_table = table;
+	}
+	if (batch_table == table) {
+		batch_depth++;
+	}
+}
+
+void sfs_inode_end_batch(struct inode_table *table) {
+	const int num_blocks = table->super_block->num_inode_blocks;
+
+	if (batch_table != table) {
+		return;
+	}
+	batch_depth--;
+	if (batch_depth > 0) {
+		return;
+	}
+	batch_table = NULL;
+
+	// Adjacent dirty blocks are flushed together. This includes the blocks
+	// marked by batches that other threads still have open, which only
+	// writes their inodes earlier.
+	pthread_mutex_lock(&table->lock);
+	int i = 0;
+	while (i < num_blocks) {
+		if (!table->dirty_blocks[i]) {
+			i++;
+			continue;
+		}
+
+		int num_dirty = 1;
+		while (i + num_dirty < num_blocks && table->dirty_blocks[i + num_dirty]) {
+			num_dirty++;
+		}
+		write_image_blocks(table, i, i + num_dirty);
+
+		memset(table->dirty_blocks + i, 0, num_dirty);
+		i += num_dirty;
+	}
+	pthread_mutex_unlock(&table->lock);
+}
+
+inode_idx sfs_inode_reserve_inode(struct inode_table *table, int type) {
+	inode_idx reserved = INODE_NULL;
+	if (sfs_inode_reserve_inodes(table, type, 1, &reserved)) {
+		return reserved;
+	}
+	return INODE_NULL;
+}
+
+int sfs_inode_reserve_inodes(struct inode_table *table, int type, int n, inode_idx *inode_idxs) {
+	pthread_mutex_lock(&table->alloc_lock);
+
+	pthread_mutex_lock(&table->lock);
+	int num_reserved = 0;
+	for (inode_idx i = 0; i < table->size && num_reserved < n; i++) {
+		if (table->entries[i].type == INODE_TYPE_FREE) {
+			inode_idxs[num_reserved] = i;
+			num_reserved++;
+		}
+	}
+	pthread_mutex_unlock(&table->lock);
+	if (num_reserved < n) {
+		pthread_mutex_unlock(&table->alloc_lock);
+		return 0;
+	}
+
+	// A thread that still has the index of a deleted inode may be about to
+	// lock it
+	for (int i = 0; i < n; i++) {
+		sfs_inode_write_lock(table, inode_idxs[i]);
+		pthread_mutex_lock(&table->lock);
+		memset(table->entries + inode_idxs[i], 0, sizeof(struct inode));
+		table->entries[inode_idxs[i]].type = type;
+		table->image[inode_idxs[i]] = table->entries[inode_idxs[i]];
+		pthread_mutex_unlock(&table->lock);
+		sfs_inode_unlock(table, inode_idxs[i]);
+	}
+	if (n > 0) {
+		pthread_mutex_lock(&table->lock);
+		flush_image_range(table, inode_idxs[0], inode_idxs[n - 1] + 1, 1);
+		pthread_mutex_unlock(&table->lock);
+	}
+
+	pthread_mutex_unlock(&table->alloc_lock);
+	return 1;
+}
+
+void sfs_inode_set_alloc_goal(struct inode_table *table, inode_idx inode_idx, disk_ptr goal) {
+	if (inode_idx < 0 || inode_idx >= table->size) {
+		return;
+	}
+	table->alloc_goals[inode_idx] = goal;
+}
+
+void sfs_inode_delete_file(struct inode_table *table, inode_idx inode_idx) {
+	struct inode *inode = get_active_inode(table, inode_idx);
+	if (inode == NULL) {
+		// Nothing to do
+		return;
+	}
+
+	discard_buffered_blocks(table, inode_idx);
+
+	// Release the direct blocks
+	for (int i = 0; i < NUM_INODE_DIRECT_PTRS; i++) {
+		disk_ptr p = inode->direct_pointers[i];
+		if (p != DISK_NULL) {
+			sfs_freebitmap_release_block(table->free_bitmap, p);
+		}
+	}
+	// Release the indirect block
+	if (inode->indirect_pointer != DISK_NULL) {
+		// TODO: Move this to its own helper function?
+		const int disk_ptrs_per_block = table->super_block->block_size / sizeof(disk_ptr);
+		disk_ptr indirect_block[disk_ptrs_per_block];
+		read_contiguous_bytes_from_disk(inode->indirect_pointer, sizeof indirect_block, indirect_block, table->super_block->block_size);
+
+		for (int i = 0; i < disk_ptrs_per_block; i++) {
+			if (indirect_block[i] != DISK_NULL) {
+				sfs_freebitmap_release_block(table->free_bitmap, indirect_block[i]);
+			}
+		}
+
+		sfs_freebitmap_release_block(table->free_bitmap, inode->indirect_pointer);
+	}
+
+	pthread_mutex_lock(&table->lock);
+	memset(inode, 0, sizeof *inode);
+	pthread_mutex_unlock(&table->lock);
+	table->alloc_goals[inode_idx] = DISK_NULL;
+	flush_inode(table, inode_idx);
+}
+
+void sfs_inode_force_reserve(struct inode_table *table, inode_idx idx, int type) {
+	sfs_inode_write_lock(table, idx);
+	if (table->entries[idx].type != INODE_TYPE_FREE) {
+		fprintf(stderr, "WARNING: Inode %d was already in use. Existing data will be deleted.\n", idx);
+		sfs_inode_delete_file(table, idx);
+	}
+	pthread_mutex_lock(&table->lock);
+	table->entries[idx].type = type;
+	pthread_mutex_unlock(&table->lock);
+	flush_inode(table, idx);
+	sfs_inode_unlock(table, idx);
+}
+
+int sfs_inode_allocate(struct inode_table *table, inode_idx inode_idx, int start_byte, int num_bytes) {
+	struct super_block *sb = table->super_block;
+	const int block_size = sb->block_size;
+
+	struct inode *inode = get_active_inode(table, inode_idx);
+	// The end of the range must fit in an int before it is compared with the
+	// maximum file size
+	if (inode == NULL || start_byte < 0 || num_bytes <= 0 || num_bytes > INT_MAX - start_byte) {
+		return 0;
+	}
+
+	const int end_byte = start_byte + num_bytes;
+	if (ceil_div(end_byte, block_size) > max_blocks_per_file(sb)) {
+		return 0;
+	}
+
+	// Buffered blocks must be on disk before deciding which blocks are missing
+	if (table->delalloc[inode_idx].num_blocks > 0) {
+		sfs_inode_flush_buffered(table, inode_idx);
+	}
+
+	// Don't leave a gap of unallocated blocks when extending the file
+	const int old_size = inode->size;
+	if (end_byte > old_size) {
+		start_byte = min(start_byte, old_size);
+	}
+
+	const int first_block_idx = start_byte / block_size;
+	const int end_block_idx = ceil_div(end_byte, block_size);
+
+	const int disk_ptrs_per_block = block_size / sizeof(disk_ptr);
+	disk_ptr indirect_block[disk_ptrs_per_block];
+	memset(indirect_block, 0, disk_ptrs_per_block * sizeof(disk_ptr));
+	if (end_block_idx > NUM_INODE_DIRECT_PTRS) {
+		load_indirect_block(sb, inode, indirect_block);
+	}
+	int indirect_block_dirty = 0;
+
+	// The part of the old last block after the end of the file is about to
+	// become readable, so it must not contain stale data
+	if (end_byte > old_size && !zero_block_tail(table, inode_idx, old_size, indirect_block, &indirect_block_dirty)) {
+		return 0;
+	}
+
+	char newly_mapped[end_block_idx - first_block_idx];
+	int num_blocks = map_blocks_for_write(table, inode_idx, first_block_idx, end_block_idx, indirect_block, &indirect_block_dirty, newly_mapped);
+
+	// Zero out the new blocks, one run at a time
+	int block_idx = first_block_idx;
+	while (block_idx < first_block_idx + num_blocks) {
+		if (!newly_mapped[block_idx - first_block_idx]) {
+			block_idx++;
+			continue;
+		}
+
+		disk_ptr run_start = get_mapped_block(inode, block_idx, indirect_block);
+		int run_length = 1;
+		while (block_idx + run_length < first_block_idx + num_blocks
+				&& newly_mapped[block_idx + run_length - first_block_idx]
+				&& get_mapped_block(inode, block_idx + run_length, indirect_block) == run_start + run_length) {
+			run_length++;
+		}
+
+		char *zeroes = calloc_or_exit(run_length, block_size);
+		write_blocks(run_start, run_length, zeroes);
+		free(zeroes);
+
+		block_idx += run_length;
+	}
+
+	if (indirect_block_dirty) {
+		write_contiguous_bytes_to_disk(inode->indirect_pointer, disk_ptrs_per_block * sizeof(disk_ptr), indirect_block, block_size);
+	}
+
+	int success = num_blocks == end_block_idx - first_block_idx;
+	if (success) {
+		inode->size = max(inode->size, end_byte);
+	}
+
+	flush_inode(table, inode_idx);
+
+	return success;
 }
 
-static struct inode *get_active_inode(struct inode_table *table, inode_idx i) {
-	if (i < 0 || i >= table->size) {
-		return NULL;
+int sfs_inode_clone(struct inode_table *table, inode_idx src_idx, inode_idx dst_idx) {
+	struct super_block *sb = table->super_block;
+	const int block_size = sb->block_size;
+
+	struct inode *src = get_active_inode(table, src_idx);
+	struct inode *dst = get_active_inode(table, dst_idx);
+	if (src == NULL || dst == NULL || src == dst || dst->size != 0 || table->delalloc[dst_idx].num_blocks > 0) {
+		return 0;
 	}
 
-	struct inode *inode = table->entries + i;
-	if (!inode->active) {
-		return NULL;
+	// Only blocks on disk can be shared
+	if (table->delalloc[src_idx].num_blocks > 0) {
+		sfs_inode_flush_buffered(table, src_idx);
 	}
 
-	return inode;
-}
+	const int disk_ptrs_per_block = block_size / sizeof(disk_ptr);
+	disk_ptr indirect_block[disk_ptrs_per_block];
+	load_indirect_block(sb, src, indirect_block);
 
-// TODO: Implement function to flush just one inode?
-// Would need to figure out which block that inode belongs to, whether it spans multiple blocks, etc.
+	disk_ptr dst_indirect_pointer = DISK_NULL;
+	if (src->indirect_pointer != DISK_NULL) {
+		dst_indirect_pointer = allocate_block(table, dst_idx, src->indirect_pointer + 1);
+		if (dst_indirect_pointer == DISK_NULL) {
+			return 0;
+		}
+	}
 
-/*
- * Flushes the entire inode table to the disk.
- */
-static void flush_inode_table(struct inode_table *table) {
-	write_contiguous_bytes_to_disk(
-		1,
-		table->size * sizeof(struct inode),
-		table->entries,
-		table->super_block->block_size
-	);
+	int n = 0;
+	for (; n < max_blocks_per_file(sb); n++) {
+		disk_ptr block = get_mapped_block(src, n, indirect_block);
+		if (block != DISK_NULL && !sfs_freebitmap_share_block(table->free_bitmap, block)) {
+			break;
+		}
+	}
+	if (n < max_blocks_per_file(sb)) {
+		// Give back the references taken so far
+		for (int i = 0; i < n; i++) {
+			disk_ptr block = get_mapped_block(src, i, indirect_block);
+			if (block != DISK_NULL) {
+				sfs_freebitmap_release_block(table->free_bitmap, block);
+			}
+		}
+		if (dst_indirect_pointer != DISK_NULL) {
+			sfs_freebitmap_release_block(table->free_bitmap, dst_indirect_pointer);
+		}
+		return 0;
+	}
+
+	if (dst_indirect_pointer != DISK_NULL) {
+		write_contiguous_bytes_to_disk(dst_indirect_pointer, disk_ptrs_per_block * sizeof(disk_ptr), indirect_block, block_size);
+	}
+
+	// The type is left alone, since it only changes with table->lock held
+	dst->size = src->size;
+	memcpy(dst->direct_pointers, src->direct_pointers, sizeof dst->direct_pointers);
+	dst->indirect_pointer = dst_indirect_pointer;
+	table->alloc_goals[dst_idx] = table->alloc_goals[src_idx];
+	flush_inode(table, dst_idx);
+
+	return 1;
 }
 
+int sfs_inode_copy_range(struct inode_table *table, inode_idx src_idx, int src_start, inode_idx dst_idx, int dst_start, int num_bytes) {
+	struct super_block *sb = table->super_block;
+	const int block_size = sb->block_size;
 
-/*
- * Returns a pointer to the nth data block in the given inode.
- */
-static disk_ptr get_data_block_from_inode(struct super_block *sb, struct freebitmap *fbmp, struct inode *inode, int n, disk_ptr *indirect_block, int *indirect_block_fetched, int create) {
-	char tmp_buffer[sb->block_size];
-	const int disk_ptrs_per_block = sb->block_size / sizeof(disk_ptr);
+	struct inode *src = get_active_inode(table, src_idx);
+	struct inode *dst = get_active_inode(table, dst_idx);
+	if (src == NULL || dst == NULL || src_start < 0 || dst_start < 0 || dst_start > dst->size || num_bytes < 0) {
+		return -1;
+	}
 
-	// Use direct pointer
-	if (n < NUM_INODE_DIRECT_PTRS) {
-		if (inode->direct_pointers[n] == DISK_NULL && create) {
-			inode->direct_pointers[n] = sfs_freebitmap_reserve_block(fbmp);
-			if (inode->direct_pointers[n] == DISK_NULL) {
-				// No data blocks available
-				return DISK_NULL;
-			}
+	num_bytes = min(num_bytes, max(src->size - src_start, 0));
+	if (num_bytes == 0) {
+		return 0;
+	}
+	num_bytes = min(num_bytes, max_blocks_per_file(sb) * block_size - dst_start);
+	if (num_bytes <= 0) {
+		// Reached max file size
+		return -1;
+	}
+	if (src_idx == dst_idx && src_start < dst_start + num_bytes && dst_start < src_start + num_bytes) {
+		return -1;
+	}
+
+	// Only blocks on disk can be shared
+	if (table->delalloc[src_idx].num_blocks > 0) {
+		sfs_inode_flush_buffered(table, src_idx);
+	}
+	if (table->delalloc[dst_idx].num_blocks > 0) {
+		sfs_inode_flush_buffered(table, dst_idx);
+	}
+
+	const int disk_ptrs_per_block = block_size / sizeof(disk_ptr);
+	disk_ptr src_indirect_block[disk_ptrs_per_block];
+	disk_ptr dst_indirect_block[disk_ptrs_per_block];
+	load_indirect_block(sb, dst, dst_indirect_block);
+	disk_ptr *src_indirect = dst_indirect_block;
+	if (src_idx != dst_idx) {
+		load_indirect_block(sb, src, src_indirect_block);
+		src_indirect = src_indirect_block;
+	}
+	int dst_indirect_block_dirty = 0;
+
+	char *buffer = calloc_or_exit(COPY_BUFFER_BLOCKS, block_size);
+	int num_bytes_copied = 0;
+	while (num_bytes_copied < num_bytes) {
+		const int src_pos = src_start + num_bytes_copied;
+		const int dst_pos = dst_start + num_bytes_copied;
+
+		if (src_pos % block_size == 0 && dst_pos % block_size == 0 && num_bytes - num_bytes_copied >= block_size
+				&& clone_block(table, src_idx, src_pos / block_size, src_indirect, dst_idx, dst_pos / block_size, dst_indirect_block, &dst_indirect_block_dirty)) {
+			num_bytes_copied += block_size;
+			dst->size = max(dst->size, dst_pos + block_size);
+			continue;
 		}
-		else if (inode->direct_pointers[n] == DISK_NULL && !create) {
-			// Block before end of file is not allocated (sparse file?)
-			return DISK_NULL;
+
+		// sfs_inode_write() reads the destination's block map from the disk
+		if (dst_indirect_block_dirty) {
+			write_contiguous_bytes_to_disk(dst->indirect_pointer, disk_ptrs_per_block * sizeof(disk_ptr), dst_indirect_block, block_size);
+			dst_indirect_block_dirty = 0;
 		}
 
-		return inode->direct_pointers[n];
-	}
-	// Use indirect pointer
-	else {
-		if (inode->indirect_pointer == DISK_NULL && create) {
-			inode->indirect_pointer = sfs_freebitmap_reserve_block(fbmp);
-			if (inode->indirect_pointer == DISK_NULL) {
-				// No data blocks available
-				return DISK_NULL;
-			}
-			*indirect_block_fetched = 1;
+		int length = min(num_bytes - num_bytes_copied, COPY_BUFFER_BLOCKS * block_size);
+		if ((dst_pos - src_pos) % block_size == 0) {
+			// Stop at the next block boundary, since the block after it may be
+			// shared instead
+			length = min(length, block_size - dst_pos % block_size);
 		}
-		else if (inode->indirect_pointer == DISK_NULL && !create) {
-			// Block before end of file is not allocated (sparse file?)
-			return DISK_NULL;
+		sfs_inode_read(table, src_idx, src_pos, length, buffer);
+		int num_bytes_written = sfs_inode_write(table, dst_idx, dst_pos, length, buffer);
+		if (num_bytes_written > 0) {
+			num_bytes_copied += num_bytes_written;
 		}
-		// Load the indirect block from the disk if it hasn't been loaded yet
-		else if (!(*indirect_block_fetched)) {
-			read_blocks(inode->indirect_pointer, 1, tmp_buffer);
-			memcpy(indirect_block, tmp_buffer, disk_ptrs_per_block * sizeof(disk_ptr));
-			*indirect_block_fetched = 1;
+		if (num_bytes_written != length) {
+			break;
 		}
 
-		int indirect_block_idx = n - NUM_INODE_DIRECT_PTRS;
+		load_indirect_block(sb, dst, dst_indirect_block);
+	}
+	free(buffer);
+
+	if (dst_indirect_block_dirty) {
+		write_contiguous_bytes_to_disk(dst->indirect_pointer, disk_ptrs_per_block * sizeof(disk_ptr), dst_indirect_block, block_size);
+	}
+	flush_inode(table, dst_idx);
+
+	return num_bytes_copied > 0 ? num_bytes_copied : -1;
+}
+
+int sfs_inode_truncate(struct inode_table *table, inode_idx inode_idx, int size) {
+	struct super_block *sb = table->super_block;
+	const int block_size = sb->block_size;
+
+	struct inode *inode = get_active_inode(table, inode_idx);
+	if (inode == NULL || size < 0 || ceil_div(size, block_size) > max_blocks_per_file(sb)) {
+		return 0;
+	}
+	if (size == inode->size) {
+		return 1;
+	}
+	const struct inode old_inode = *inode;
+
+	const int disk_ptrs_per_block = block_size / sizeof(disk_ptr);
+	disk_ptr indirect_block[disk_ptrs_per_block];
+	load_indirect_block(sb, inode, indirect_block);
 
-		if (indirect_block_idx >= disk_ptrs_per_block) {
-			// Reached max file size
-			return DISK_NULL;
+	int indirect_block_dirty = 0;
+	if (size > inode->size) {
+		if (!zero_block_tail(table, inode_idx, inode->size, indirect_block, &indirect_block_dirty)) {
+			return 0;
 		}
+		if (indirect_block_dirty) {
+			write_contiguous_bytes_to_disk(inode->indirect_pointer, disk_ptrs_per_block * sizeof(disk_ptr), indirect_block, block_size);
+		}
+	}
+	else {
+		// Blocks past the end of the file can be mapped even before this
+		// (see sfs_inode_allocate()), so every one of them is checked
+		for (int n = ceil_div(size, block_size); n < max_blocks_per_file(sb); n++) {
+			discard_buffered_block(table, inode_idx, n);
 
-		if (indirect_block[indirect_block_idx] == DISK_NULL && create) {
-			indirect_block[indirect_block_idx] = sfs_freebitmap_reserve_block(fbmp);
-			if (indirect_block[indirect_block_idx] == DISK_NULL) {
-				// No data blocks available
-				return DISK_NULL;
+			disk_ptr block = get_mapped_block(inode, n, indirect_block);
+			if (block != DISK_NULL) {
+				sfs_freebitmap_release_block(table->free_bitmap, block);
+				set_mapped_block(inode, n, indirect_block, DISK_NULL);
+				indirect_block_dirty |= n >= NUM_INODE_DIRECT_PTRS;
 			}
 		}
-		else if (indirect_block[indirect_block_idx] == DISK_NULL && !create) {
-			// Block before end of file is not allocated (sparse file?)
-			return DISK_NULL;
+
+		if (inode->indirect_pointer != DISK_NULL && size <= NUM_INODE_DIRECT_PTRS * block_size) {
+			sfs_freebitmap_release_block(table->free_bitmap, inode->indirect_pointer);
+			inode->indirect_pointer = DISK_NULL;
+		}
+		else if (indirect_block_dirty) {
+			write_contiguous_bytes_to_disk(inode->indirect_pointer, disk_ptrs_per_block * sizeof(disk_ptr), indirect_block, block_size);
 		}
+	}
 
-		return indirect_block[indirect_block_idx];
+	inode->size = size;
+	if (memcmp(&old_inode, inode, sizeof *inode) != 0) {
+		flush_inode(table, inode_idx);
 	}
+
+	return 1;
 }
 
-struct inode_table sfs_inode_new_table(struct super_block *sb, struct freebitmap *fbmp) {
-	struct inode_table table;
+int sfs_inode_write(struct inode_table *table, inode_idx inode_idx, int start_byte, int num_bytes, const char *data) {
+	struct super_block *sb = table->super_block;
+	const int block_size = sb->block_size;
 
-	table.super_block = sb;
-	table.free_bitmap = fbmp;
+	struct inode *inode = get_active_inode(table, inode_idx);
+	if (inode == NULL || start_byte < 0 || num_bytes < 0) {
+		return -1;
+	}
+	if (num_bytes == 0) {
+		return 0;
+	}
 
-	table.size = sb->num_inode_blocks * sb->block_size / sizeof(struct inode);
-	table.entries = calloc_or_exit(table.size, sizeof(struct inode));
+	if (table->delalloc[inode_idx].num_blocks > 0) {
+		sfs_inode_flush_buffered(table, inode_idx);
+	}
+	const struct inode old_inode = *inode;
 
-	flush_inode_table(&table);
+	int first_block_idx = start_byte / block_size;
+	int end_block_idx = min(ceil_div(start_byte + num_bytes, block_size), max_blocks_per_file(sb));
+	if (first_block_idx >= end_block_idx) {
+		// Reached max file size
+		return -1;
+	}
 
-	return table;
-}
+	const int disk_ptrs_per_block = block_size / sizeof(disk_ptr);
+	disk_ptr indirect_block[disk_ptrs_per_block];
+	memset(indirect_block, 0, disk_ptrs_per_block * sizeof(disk_ptr));
+	if (end_block_idx > NUM_INODE_DIRECT_PTRS) {
+		load_indirect_block(sb, inode, indirect_block);
+	}
+	int indirect_block_dirty = 0;
 
-struct inode_table sfs_inode_table_from_disk(struct super_block *sb, struct freebitmap *fbmp) {
-	struct inode_table table;
+	char newly_mapped[end_block_idx - first_block_idx];
+	int num_blocks = map_blocks_for_write(table, inode_idx, first_block_idx, end_block_idx, indirect_block, &indirect_block_dirty, newly_mapped);
+	const int end_byte = min(start_byte + num_bytes, (first_block_idx + num_blocks) * block_size);
+	num_blocks = unshare_blocks(table, inode_idx, start_byte, end_byte, indirect_block, &indirect_block_dirty);
 
-	table.super_block = sb;
-	table.free_bitmap = fbmp;
+	int num_bytes_written = min(num_bytes, (first_block_idx + num_blocks) * block_size - start_byte);
+	if (num_bytes_written > 0) {
+		write_mapped_blocks(table, inode_idx, start_byte, num_bytes_written, data, indirect_block, newly_mapped);
+	}
 
-	table.size = sb->num_inode_blocks * sb->block_size / sizeof(struct inode);
-	table.entries = calloc_or_exit(table.size, sizeof(struct inode));
-	read_contiguous_bytes_from_disk(1, table.size * sizeof(struct inode), table.entries, sb->block_size);
+	if (indirect_block_dirty) {
+		write_contiguous_bytes_to_disk(inode->indirect_pointer, disk_ptrs_per_block * sizeof(disk_ptr), indirect_block, block_size);
+	}
 
-	return table;
-}
+	// after_final_byte_written is one more than the last byte written
+	int after_final_byte_written = start_byte + max(num_bytes_written, 0);
+	inode->size = max(inode->size, after_final_byte_written);
 
-void sfs_inode_free_table(struct inode_table *table) {
-	if (table->entries != NULL) {
-		free(table->entries);
+	// Overwriting existing data leaves the inode as it was
+	if (memcmp(&old_inode, inode, sizeof *inode) != 0) {
+		flush_inode(table, inode_idx);
 	}
-	memset(table, 0, sizeof *table);
-}
 
-inode_idx sfs_inode_reserve_inode(struct inode_table *table) {
-	for (inode_idx i = 0; i < table->size; i++) {
-		if (!table->entries[i].active) {
-			memset(table->entries + i, 0, sizeof(struct inode));
-			table->entries[i].active = 1;
-			flush_inode_table(table);
-			return i;
-		}
-	}
-	return INODE_NULL;
+	return num_bytes_written > 0 ? num_bytes_written : -1;
 }
 
-void sfs_inode_delete_file(struct inode_table *table, inode_idx inode_idx) {
+int sfs_inode_buffered_write(struct inode_table *table, inode_idx inode_idx, int start_byte, int num_bytes, const char *data) {
+	struct super_block *sb = table->super_block;
+	const int block_size = sb->block_size;
+
 	struct inode *inode = get_active_inode(table, inode_idx);
-	if (inode == NULL) {
-		// Nothing to do
-		return;
+	if (inode == NULL || start_byte < 0 || num_bytes < 0) {
+		return -1;
+	}
+	if (num_bytes == 0) {
+		return 0;
 	}
 
-	// Release the direct blocks
-	for (int i = 0; i < NUM_INODE_DIRECT_PTRS; i++) {
-		disk_ptr p = inode->direct_pointers[i];
-		if (p != DISK_NULL) {
-			sfs_freebitmap_release_block(table->free_bitmap, p);
-		}
+	int first_block_idx = start_byte / block_size;
+	int end_block_idx = min(ceil_div(start_byte + num_bytes, block_size), max_blocks_per_file(sb));
+	if (first_block_idx >= end_block_idx) {
+		// Reached max file size
+		return -1;
 	}
-	// Release the indirect block
-	if (inode->indirect_pointer != DISK_NULL) {
-		// TODO: Move this to its own helper function?
-		const int disk_ptrs_per_block = table->super_block->block_size / sizeof(disk_ptr);
-		disk_ptr indirect_block[disk_ptrs_per_block];
-		read_contiguous_bytes_from_disk(inode->indirect_pointer, sizeof indirect_block, indirect_block, table->super_block->block_size);
+	const int end_byte = min(start_byte + num_bytes, end_block_idx * block_size);
+	const struct inode old_inode = *inode;
 
-		for (int i = 0; i < disk_ptrs_per_block; i++) {
-			if (indirect_block[i] != DISK_NULL) {
-				sfs_freebitmap_release_block(table->free_bitmap, indirect_block[i]);
+	const int disk_ptrs_per_block = block_size / sizeof(disk_ptr);
+	disk_ptr indirect_block[disk_ptrs_per_block];
+	memset(indirect_block, 0, disk_ptrs_per_block * sizeof(disk_ptr));
+	if (end_block_idx > NUM_INODE_DIRECT_PTRS) {
+		load_indirect_block(sb, inode, indirect_block);
+	}
+	int indirect_block_dirty = 0;
+
+	int num_bytes_written = 0;
+	int n = first_block_idx;
+	while (n < end_block_idx) {
+		const int from = max(start_byte, n * block_size);
+
+		// Write straight through to blocks that already exist on disk
+		if (get_buffered_block(table, inode_idx, n) == NULL && get_mapped_block(inode, n, indirect_block) != DISK_NULL) {
+			int stretch_end = n + 1;
+			while (stretch_end < end_block_idx
+					&& get_buffered_block(table, inode_idx, stretch_end) == NULL
+					&& get_mapped_block(inode, stretch_end, indirect_block) != DISK_NULL) {
+				stretch_end++;
+			}
+
+			int to = min(end_byte, stretch_end * block_size);
+			const int num_unshared = unshare_blocks(table, inode_idx, from, to, indirect_block, &indirect_block_dirty);
+			// Stop at a shared block that could not be copied (the disk is full)
+			to = min(to, (n + num_unshared) * block_size);
+			if (to > from) {
+				write_mapped_blocks(table, inode_idx, from, to - from, data + (from - start_byte), indirect_block, NULL);
+				num_bytes_written += to - from;
 			}
+			if (num_unshared < stretch_end - n) {
+				break;
+			}
+			n = stretch_end;
+			continue;
 		}
 
-		sfs_freebitmap_release_block(table->free_bitmap, inode->indirect_pointer);
+		char *block = get_buffered_block(table, inode_idx, n);
+		if (block == NULL) {
+			block = create_buffered_block(table, inode_idx, n);
+			if (block == NULL) {
+				// No data blocks available
+				break;
+			}
+		}
+
+		const int to = min(end_byte, (n + 1) * block_size);
+		memcpy(block + (from - n * block_size), data + (from - start_byte), to - from);
+		num_bytes_written += to - from;
+		n++;
+	}
+
+	if (indirect_block_dirty) {
+		write_contiguous_bytes_to_disk(inode->indirect_pointer, disk_ptrs_per_block * sizeof(disk_ptr), indirect_block, block_size);
 	}
 
-	sfs_freebitmap_flush(table->free_bitmap);
+	// after_final_byte_written is one more than the last byte written
+	int after_final_byte_written = start_byte + num_bytes_written;
+	inode->size = max(inode->size, after_final_byte_written);
 
-	memset(inode, 0, sizeof *inode);
-	flush_inode_table(table);
-}
+	pthread_mutex_lock(&table->lock);
+	const int num_buffered_blocks = table->num_buffered_blocks;
+	pthread_mutex_unlock(&table->lock);
 
-void sfs_inode_force_reserve(struct inode_table *table, inode_idx idx) {
-	if (table->entries[idx].active) {
-		fprintf(stderr, "WARNING: Inode %d was already in use. Existing data will be deleted.\n", idx);
-		sfs_inode_delete_file(table, idx);
+	// Other inodes may be in use by other threads, so only this one is flushed
+	if (num_buffered_blocks > MAX_BUFFERED_BLOCKS && table->delalloc[inode_idx].num_blocks > 0) {
+		sfs_inode_flush_buffered(table, inode_idx);
 	}
-	else {
-		table->entries[idx].active = 1;
-		flush_inode_table(table);
+	else if (table->delalloc[inode_idx].num_blocks == 0 && memcmp(&old_inode, inode, sizeof *inode) != 0) {
+		flush_inode(table, inode_idx);
 	}
+
+	return num_bytes_written > 0 ? num_bytes_written : -1;
 }
 
-int sfs_inode_write(struct inode_table *table, inode_idx inode_idx, int start_byte, int num_bytes, const char *data) {
-	const int block_size = table->super_block->block_size;
+void sfs_inode_flush_buffered(struct inode_table *table, inode_idx inode_idx) {
+	struct super_block *sb = table->super_block;
+	const int block_size = sb->block_size;
 
 	struct inode *inode = get_active_inode(table, inode_idx);
-	if (inode == NULL) {
-		return -1;
+	struct delalloc_buffer *buffer = table->delalloc + inode_idx;
+	if (inode == NULL || buffer->num_blocks == 0) {
+		return;
 	}
 
-	disk_ptr block;
-	int block_idx = start_byte / block_size;
-	int position_in_block = start_byte % block_size;
-	int num_bytes_written = 0;
+	// The claimed blocks are about to be reserved for real
+	sfs_freebitmap_unclaim(table->free_bitmap, buffer->num_claimed);
+	buffer->num_claimed = 0;
+
+	int end_block_idx = max_blocks_per_file(sb);
+	while (buffer->blocks[end_block_idx - 1] == NULL) {
+		end_block_idx--;
+	}
 
-	char tmp_buffer[block_size];
 	const int disk_ptrs_per_block = block_size / sizeof(disk_ptr);
 	disk_ptr indirect_block[disk_ptrs_per_block];
 	memset(indirect_block, 0, disk_ptrs_per_block * sizeof(disk_ptr));
-	int indirect_block_fetched = 0;
-	int block_error = 0;
-	while (num_bytes > 0) {
-		block = get_data_block_from_inode(table->super_block, table->free_bitmap, inode, block_idx, indirect_block, &indirect_block_fetched, 1);
-		if (block == DISK_NULL) {
-			block_error = 1;
-			break;
+	if (end_block_idx > NUM_INODE_DIRECT_PTRS) {
+		load_indirect_block(sb, inode, indirect_block);
+	}
+	int indirect_block_dirty = 0;
+
+	int n = 0;
+	while (n < end_block_idx) {
+		if (buffer->blocks[n] == NULL) {
+			n++;
+			continue;
 		}
 
-		int bytes_this_block = min(num_bytes, block_size - position_in_block);
+		int stretch_end = n + 1;
+		while (stretch_end < end_block_idx && buffer->blocks[stretch_end] != NULL) {
+			stretch_end++;
+		}
 
-		read_blocks(block, 1, tmp_buffer);
-		memcpy(tmp_buffer + position_in_block, data, bytes_this_block);
-		write_blocks(block, 1, tmp_buffer);
+		int num_blocks = map_blocks_for_write(table, inode_idx, n, stretch_end, indirect_block, &indirect_block_dirty, NULL);
+		write_buffered_blocks(table, inode_idx, n, n + num_blocks, indirect_block);
+		if (num_blocks < stretch_end - n) {
+			// Should not happen since enough blocks were claimed
+			fprintf(stderr, "WARNING: Ran out of data blocks while flushing inode %d. Buffered data was lost.\n", inode_idx);
+			break;
+		}
 
-		num_bytes_written += bytes_this_block;
-		num_bytes -= bytes_this_block;
-		data += bytes_this_block;
-		block_idx++;
-		position_in_block = 0;
+		n = stretch_end;
 	}
 
-	if (num_bytes_written == 0 && block_error) {
-		return -1;
+	if (indirect_block_dirty) {
+		write_contiguous_bytes_to_disk(inode->indirect_pointer, disk_ptrs_per_block * sizeof(disk_ptr), indirect_block, block_size);
 	}
 
-	if (indirect_block_fetched) {
-		write_contiguous_bytes_to_disk(inode->indirect_pointer, disk_ptrs_per_block * sizeof(disk_ptr), indirect_block, block_size);
+	discard_buffered_blocks(table, inode_idx);
+
+	flush_inode(table, inode_idx);
+}
+
+void sfs_inode_sync(struct inode_table *table, inode_idx inode_idx) {
+	if (get_active_inode(table, inode_idx) == NULL) {
+		return;
 	}
 
-	// after_final_byte_written is one more than the last byte written
-	int after_final_byte_written = start_byte + num_bytes_written;
-	inode->size = max(inode->size, after_final_byte_written);
+	sfs_inode_flush_buffered(table, inode_idx);
 
-	flush_inode_table(table);
-	// TODO: should the free bitmap be flushed automatically?
-	sfs_freebitmap_flush(table->free_bitmap);
+	// Written even if a batch deferred the last flush of the inode
+	pthread_mutex_lock(&table->lock);
+	table->image[inode_idx] = table->entries[inode_idx];
+	flush_image_range(table, inode_idx, inode_idx + 1, 0);
+	pthread_mutex_unlock(&table->lock);
+}
 
-	return num_bytes_written;
+void sfs_inode_flush_all_buffered(struct inode_table *table) {
+	for (inode_idx i = 0; i < table->size; i++) {
+		if (table->delalloc[i].num_blocks > 0) {
+			sfs_inode_flush_buffered(table, i);
+		}
+	}
 }
 
 int sfs_inode_read(struct inode_table *table, inode_idx inode_idx, int start_byte, int num_bytes, char *data) {
@@ -281,17 +1468,73 @@ int sfs_inode_read(struct inode_table *table, inode_idx inode_idx, int start_byt
 	disk_ptr indirect_block[disk_ptrs_per_block];
 	memset(indirect_block, 0, disk_ptrs_per_block * sizeof(disk_ptr));
 	int indirect_block_fetched = 0;
-	int block_error = 0;
 	while (num_bytes > 0) {
-		block = get_data_block_from_inode(table->super_block, NULL, inode, block_idx, indirect_block, &indirect_block_fetched, 0);
-		if (block == DISK_NULL) {
-			block_error = 1;
-			break;
+		int bytes_this_block = min(num_bytes, block_size - position_in_block);
+
+		char *buffered_block = get_buffered_block(table, inode_idx, block_idx);
+		if (buffered_block != NULL) {
+			memcpy(data, buffered_block + position_in_block, bytes_this_block);
+		}
+		else if ((block = get_data_block_from_inode(table, inode_idx, block_idx, indirect_block, &indirect_block_fetched)) == DISK_NULL) {
+			// Hole in the file
+			memset(data, 0, bytes_this_block);
 		}
+		else {
+			// TODO: Move this to a helper function?
+			char tmp_buffer[block_size];
+			read_blocks(block, 1, tmp_buffer);
+			memcpy(data, tmp_buffer + position_in_block, bytes_this_block);
+		}
+
+		num_bytes_read += bytes_this_block;
+		num_bytes -= bytes_this_block;
+		data += bytes_this_block;
+		block_idx++;
+		position_in_block = 0;
+	}
+
+	return num_bytes_read;
+}
+
+int sfs_inode_read_unlocked(struct inode_table *table, inode_idx inode_idx, int start_byte, int num_bytes, char *data) {
+	struct super_block *sb = table->super_block;
+	const int block_size = sb->block_size;
+
+	struct inode inode;
+	unsigned int seq;
+	if (!take_snapshot(table, inode_idx, &inode, &seq) || inode.type != INODE_TYPE_FILE || start_byte < 0) {
+		return -1;
+	}
+
+	int block_idx = start_byte / block_size;
+	int position_in_block = start_byte % block_size;
+	int num_bytes_read = 0;
+
+	num_bytes = min(num_bytes, inode.size - start_byte);
+	num_bytes = max(num_bytes, 0);
 
+	const int disk_ptrs_per_block = block_size / sizeof(disk_ptr);
+	disk_ptr indirect_block[disk_ptrs_per_block];
+	int indirect_block_fetched = 0;
+	while (num_bytes > 0) {
 		int bytes_this_block = min(num_bytes, block_size - position_in_block);
 
-		// TODO: Move this to a helper function?
+		if (block_idx >= max_blocks_per_file(sb)) {
+			return -1;
+		}
+		if (block_idx >= NUM_INODE_DIRECT_PTRS && !indirect_block_fetched) {
+			if (!is_on_disk(sb, inode.indirect_pointer)) {
+				return -1;
+			}
+			load_indirect_block(sb, &inode, indirect_block);
+			indirect_block_fetched = 1;
+		}
+
+		// Holes and buffered data are left to sfs_inode_read()
+		disk_ptr block = get_mapped_block(&inode, block_idx, indirect_block);
+		if (!is_on_disk(sb, block)) {
+			return -1;
+		}
 		char tmp_buffer[block_size];
 		read_blocks(block, 1, tmp_buffer);
 		memcpy(data, tmp_buffer + position_in_block, bytes_this_block);
@@ -303,9 +1546,5 @@ int sfs_inode_read(struct inode_table *table, inode_idx inode_idx, int start_byt
 		position_in_block = 0;
 	}
 
-	if (num_bytes_read == 0 && block_error) {
-		return -1;
-	}
-
-	return num_bytes_read;
+	return is_unchanged(table, inode_idx, seq) ? num_bytes_read : -1;
 }
@@ -2,22 +2,76 @@
 #define SFS_INODE_H
 
 
+#include <pthread.h>
+
 #include "sfs_base.h"
 #include "sfs_freebitmap.h"
 
 
 #define NUM_INODE_DIRECT_PTRS 12
+// Maximum number of buffered data blocks (across all inodes) before the inode
+// being written is assigned blocks on disk and flushed
+#define MAX_BUFFERED_BLOCKS 256
+// Number of blocks sfs_inode_copy_range() copies at a time when it cannot
+// share them
+#define COPY_BUFFER_BLOCKS 16
+
+// Inode types. Inodes written before directories could be nested use 1 for
+// every active inode, so that must stay the value for regular files.
+#define INODE_TYPE_FREE 0
+#define INODE_TYPE_FILE 1
+#define INODE_TYPE_DIRECTORY 2
+// Hash index of a directory (see sfs_directory.c)
+#define INODE_TYPE_DIRECTORY_INDEX 3
 
 
 struct inode {
-	// Whether the inode is being used (i.e., represents a file or directory)
-	int active;
+	// What the inode represents (one of the INODE_TYPE_* values), or
+	// INODE_TYPE_FREE if it is not being used
+	int type;
 	// File size in bytes
 	int size;
 	disk_ptr direct_pointers[NUM_INODE_DIRECT_PTRS];
 	disk_ptr indirect_pointer;
 };
 
+/*
+ * Copy of an inode that other threads can read without locking it (see
+ * sfs_inode_snapshot()). It is refreshed when the write lock of the inode is
+ * released, so it is only current for inodes that are changed under their
+ * write lock: regular files, but not the directories that dir_lock in
+ * sfs_api.c covers. Each copy fills a cache line of its own, so writing one
+ * inode does not disturb the readers of another.
+ */
+struct published_inode {
+	// Odd while a thread holds the write lock of the inode, and incremented
+	// when it takes and releases it
+	unsigned int seq;
+	struct inode inode;
+} __attribute__((aligned(64)));
+
+// Data written to an inode that has not been assigned blocks on disk yet
+struct delalloc_buffer {
+	// Number of data blocks with buffered contents
+	int num_blocks;
+	// Number of blocks claimed from the free bitmap to back the buffered
+	// contents, including the indirect block if it will be needed
+	int num_claimed;
+	// Whether one of the claimed blocks is for the indirect block
+	int indirect_claimed;
+	// Buffered contents of each data block in the file, or NULL if that block
+	// has nothing buffered
+	char **blocks;
+};
+
+/*
+ * The functions below may be called from several threads at once as long as
+ * each caller holds the lock of the inodes it uses (see sfs_inode_read_lock()
+ * and sfs_inode_write_lock()): a read lock for sfs_inode_read() and a write
+ * lock for everything that changes an inode. Reserving an inode locks it
+ * internally. The state shared by every inode has locks of its own.
+ * sfs_inode_snapshot() and sfs_inode_read_unlocked() need no lock at all.
+ */
 struct inode_table {
 	// Defines the geometry of the inode table
 	struct super_block *super_block;
@@ -27,6 +81,33 @@ struct inode_table {
 	int size;
 	// inode data
 	struct inode *entries;
+	// Reader/writer lock of each inode, which covers its entry, allocation
+	// goal and buffered data
+	pthread_rwlock_t *locks;
+	// Copy of each entry for readers that take no lock
+	struct published_inode *published;
+	// Block near which each inode's next data block should be allocated, or
+	// DISK_NULL if there is no preference. This is not persisted.
+	disk_ptr *alloc_goals;
+	// Buffered data for each inode
+	struct delalloc_buffer *delalloc;
+	// Held while reserving inodes, so that two threads never pick the same
+	// free inode
+	pthread_mutex_t alloc_lock;
+	// Protects the fields below. The type of an inode also only changes while
+	// holding it (as well as the inode's write lock), so that the search for
+	// free inodes can read every type.
+	pthread_mutex_t lock;
+	// Copy of the inode table as it is (or will be at the end of the batch)
+	// on disk. Each inode is copied into it when it is flushed, so writing a
+	// block of the table never reads the entries of inodes that other threads
+	// are changing.
+	struct inode *image;
+	// Total number of buffered data blocks
+	int num_buffered_blocks;
+	// Whether each block of the inode table changed during a batch that has
+	// not ended yet
+	char *dirty_blocks;
 };
 
 
@@ -53,31 +134,217 @@ struct inode_table sfs_inode_table_from_disk(struct super_block *sb, struct free
 void sfs_inode_free_table(struct inode_table *table);
 
 /*
- * Reserves an inode, flushes the inode table, and returns the index of the
- * reserved inode.
+ * Locks the given inode for reading. Any number of threads can hold the read
+ * lock of an inode at once, but not while another thread holds its write
+ * lock.
+ */
+void sfs_inode_read_lock(struct inode_table *table, inode_idx inode_idx);
+
+/*
+ * Locks the given inode for writing, which excludes every other thread.
+ */
+void sfs_inode_write_lock(struct inode_table *table, inode_idx inode_idx);
+
+/*
+ * Releases the read or write lock of the given inode. Releasing the write lock
+ * publishes the inode for sfs_inode_snapshot().
  */
-inode_idx sfs_inode_reserve_inode(struct inode_table *table);
+void sfs_inode_unlock(struct inode_table *table, inode_idx inode_idx);
 
 /*
- * Reserves the given inode. Any existing data will be deleted.
+ * Copies the given inode, as it was when its write lock was last released,
+ * into inode without locking it. The copy is made optimistically and checked
+ * against the sequence number of the inode, so readers never write to memory
+ * shared with other threads.
+ *
+ * Returns zero if the inode is out of range or a thread holds (or took during
+ * the copy) its write lock, and a nonzero number on success.
  */
-void sfs_inode_force_reserve(struct inode_table *table, inode_idx inode_idx);
+int sfs_inode_snapshot(struct inode_table *table, inode_idx inode_idx, struct inode *inode);
+
+/*
+ * Starts deferring the inode flushes made by the calling thread: until
+ * sfs_inode_end_batch(), the blocks of the table holding inodes that it
+ * changes are only marked as dirty, so an inode changed by many operations is
+ * written once. Nothing else is deferred (buffered data is still flushed when
+ * there is too much of it), and the flushes of other threads are not either.
+ * Batches nest; a thread can only have batches open on one table at a time.
+ */
+void sfs_inode_begin_batch(struct inode_table *table);
+
+/*
+ * Ends a batch. Once the calling thread has no batch left, the blocks of the
+ * inode table that changed are flushed (adjacent ones together) and its
+ * flushes are no longer deferred.
+ */
+void sfs_inode_end_batch(struct inode_table *table);
+
+/*
+ * Reserves an inode of the given type, flushes it, and returns the index of
+ * the reserved inode.
+ */
+inode_idx sfs_inode_reserve_inode(struct inode_table *table, int type);
+
+/*
+ * Reserves n inodes of the given type at once and stores their indices (in
+ * increasing order) in inode_idxs. The part of the inode table between the
+ * first and last reserved inode is flushed in a single write (the inodes in
+ * between are written as they were last flushed).
+ *
+ * Returns zero if there are fewer than n free inodes, in which case nothing is
+ * reserved, and a nonzero number on success.
+ */
+int sfs_inode_reserve_inodes(struct inode_table *table, int type, int n, inode_idx *inode_idxs);
+
+/*
+ * Reserves the given inode with the given type. Any existing data will be
+ * deleted. This locks the inode itself.
+ */
+void sfs_inode_force_reserve(struct inode_table *table, inode_idx inode_idx, int type);
+
+/*
+ * Sets the block near which the next data block of the given inode should be
+ * allocated. The goal is only a hint: blocks that directly follow the file's
+ * previous block take priority and the goal moves forward as blocks are
+ * allocated. Use DISK_NULL to clear the goal.
+ */
+void sfs_inode_set_alloc_goal(struct inode_table *table, inode_idx inode_idx, disk_ptr goal);
 
 /*
  * Deletes the file defined by the given inode. All its data blocks will be
- * released (but not zeroed-out). The inode will be flushed.
+ * released (but not zeroed-out) and any buffered data is discarded. The inode
+ * will be flushed.
+ *
+ * The free bitmap is NOT flushed to the disk.
  */
 void sfs_inode_delete_file(struct inode_table *table, inode_idx inode_idx);
 
+/*
+ * Makes sure that bytes [start_byte, start_byte + num_bytes) of the file
+ * defined by the given inode are backed by data blocks, reserving them as
+ * contiguous runs. Newly-reserved blocks are zeroed out. If the range ends
+ * past the end of the file, the file is extended (the gap between the old end
+ * of the file and start_byte is allocated too). The inode is flushed once at
+ * the end.
+ *
+ * The free bitmap is NOT flushed to the disk.
+ *
+ * Returns zero on failure (e.g., the disk is full or the range exceeds the
+ * maximum file size) and a nonzero number on success. Blocks reserved before a
+ * failure are kept, but the file size is not changed.
+ */
+int sfs_inode_allocate(struct inode_table *table, inode_idx inode_idx, int start_byte, int num_bytes);
+
+/*
+ * Makes the file defined by dst_idx (which must be empty) a copy of the file
+ * defined by src_idx that shares its data blocks. Each file gets its own
+ * copy of a shared block the first time it writes to it. Only the indirect
+ * block (if any) is copied right away. Both inodes are flushed, and both must
+ * be write-locked since the buffered data of src_idx is flushed first.
+ *
+ * The free bitmap is NOT flushed to the disk.
+ *
+ * Returns zero on failure (e.g., the disk is full or a block is already
+ * shared by MAX_BLOCK_REFCOUNT files), in which case dst_idx is left empty,
+ * and a nonzero number on success.
+ */
+int sfs_inode_clone(struct inode_table *table, inode_idx src_idx, inode_idx dst_idx);
+
+/*
+ * Copies num_bytes (fewer if the source file ends first) from src_start in the
+ * file defined by src_idx to dst_start in the file defined by dst_idx, which
+ * must not be past the end of that file. Whole blocks at the same offset
+ * within a block in both files are shared (see sfs_inode_clone()) rather than
+ * copied, and the rest goes through a buffer of COPY_BUFFER_BLOCKS blocks.
+ * The two ranges must not overlap if both inodes are the same. Both inodes
+ * must be write-locked, as with sfs_inode_clone().
+ *
+ * The free bitmap is NOT flushed to the disk.
+ *
+ * Returns the number of bytes copied or a negative number on failure.
+ */
+int sfs_inode_copy_range(struct inode_table *table, inode_idx src_idx, int src_start, inode_idx dst_idx, int dst_start, int num_bytes);
+
+/*
+ * Sets the size of the file defined by the given inode. Shrinking releases
+ * only the data blocks (buffered or on disk) past the new end, and the
+ * indirect block if it is no longer needed. Extending allocates nothing: the
+ * new part of the file is a hole that reads as zeroes until it is written.
+ * The inode is flushed once at the end.
+ *
+ * The free bitmap is NOT flushed to the disk.
+ *
+ * Returns zero on failure (e.g., the size exceeds the maximum file size) and a
+ * nonzero number on success.
+ */
+int sfs_inode_truncate(struct inode_table *table, inode_idx inode_idx, int size);
+
 /*
  * Writes to the file defined by the given inode. Both the data blocks and the
- * inode itself will be updated and flushed.
+ * inode itself will be updated and flushed (the inode only if it changed, and
+ * only the block(s) of the inode table that hold it). Any data buffered by
+ * sfs_inode_buffered_write() for this inode is flushed first.
+ *
+ * The free bitmap is NOT flushed to the disk.
  *
  * Returns the number of bytes written or a negative number on failure.
  */
 int sfs_inode_write(struct inode_table *table, inode_idx inode_idx, int start_byte, int num_bytes, const char *data);
 
-/* Reads from the file defined by the given inode.
+/*
+ * Writes to the file defined by the given inode. Data for blocks that are
+ * already allocated is written to the disk immediately, like
+ * sfs_inode_write(). Data for unallocated blocks is only buffered in memory:
+ * free blocks are claimed for it, but the blocks on disk are not chosen until
+ * the buffered data is flushed. This allows the whole file to be assigned a
+ * single run of blocks.
+ *
+ * The inode is not flushed if any data was buffered. The free bitmap is NOT
+ * flushed to the disk.
+ *
+ * Returns the number of bytes written or a negative number on failure.
+ */
+int sfs_inode_buffered_write(struct inode_table *table, inode_idx inode_idx, int start_byte, int num_bytes, const char *data);
+
+/*
+ * Assigns blocks on disk to the buffered data of the given inode and writes
+ * it out. The inode is flushed as well.
+ *
+ * The free bitmap is NOT flushed to the disk.
+ */
+void sfs_inode_flush_buffered(struct inode_table *table, inode_idx inode_idx);
+
+/*
+ * Flushes the buffered data of the given inode and writes the inode to the
+ * disk, even if the calling thread is in a batch. Does nothing if the inode is
+ * free.
+ *
+ * The free bitmap is NOT flushed to the disk.
+ */
+void sfs_inode_sync(struct inode_table *table, inode_idx inode_idx);
+
+/*
+ * Calls sfs_inode_flush_buffered() for every inode with buffered data. The
+ * caller must make sure that no other thread is using the table.
+ */
+void sfs_inode_flush_all_buffered(struct inode_table *table);
+
+/*
+ * Reads from the regular file defined by the given inode, like
+ * sfs_inode_read(), without locking it. The block map comes from
+ * sfs_inode_snapshot() and the read only counts if the inode's write lock was
+ * not taken in the meantime, so this is meant for files that are read far
+ * more often than written.
+ *
+ * Returns the number of bytes read, or a negative number if the read must be
+ * done with sfs_inode_read() instead: the inode is not a regular file, was
+ * write-locked during the read, or has a block in the range that is not on
+ * disk (a hole or buffered data).
+ */
+int sfs_inode_read_unlocked(struct inode_table *table, inode_idx inode_idx, int start_byte, int num_bytes, char *data);
+
+/* Reads from the file defined by the given inode. Holes (blocks that were
+ * never written, see sfs_inode_truncate()) read as zeroes.
  *
  * Returns the number of bytes read or a negative number on failure.
  */
@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_ioqueue.h"
+
+
+struct ioqueue sfs_ioqueue_new(int num_entries) {
+	struct ioqueue queue;
+
+	queue.num_entries = num_entries;
+	queue.sq = calloc_or_exit(num_entries, sizeof(struct sfs_sqe));
+	queue.sq_head = 0;
+	queue.sq_count = 0;
+	queue.cq = calloc_or_exit(2 * num_entries, sizeof(struct sfs_cqe));
+	queue.cq_head = 0;
+	queue.cq_count = 0;
+
+	return queue;
+}
+
+void sfs_ioqueue_free(struct ioqueue *queue) {
+	if (queue->sq != NULL) {
+		free(queue->sq);
+	}
+	if (queue->cq != NULL) {
+		free(queue->cq);
+	}
+	memset(queue, 0, sizeof *queue);
+}
+
+struct sfs_sqe *sfs_ioqueue_get_sqe(struct ioqueue *queue) {
+	if (queue->sq_count == queue->num_entries) {
+		return NULL;
+	}
+
+	struct sfs_sqe *sqe = queue->sq + (queue->sq_head + queue->sq_count) % queue->num_entries;
+	memset(sqe, 0, sizeof *sqe);
+	queue->sq_count++;
+
+	return sqe;
+}
+
+int sfs_ioqueue_pop_sqe(struct ioqueue *queue, struct sfs_sqe *sqe) {
+	if (queue->sq_count == 0) {
+		return 0;
+	}
+
+	*sqe = queue->sq[queue->sq_head];
+	queue->sq_head = (queue->sq_head + 1) % queue->num_entries;
+	queue->sq_count--;
+
+	return 1;
+}
+
+int sfs_ioqueue_cq_space(struct ioqueue *queue) {
+	return 2 * queue->num_entries - queue->cq_count;
+}
+
+int sfs_ioqueue_push_cqe(struct ioqueue *queue, unsigned long user_data, int result) {
+	if (sfs_ioqueue_cq_space(queue) == 0) {
+		return 0;
+	}
+
+	struct sfs_cqe *cqe = queue->cq + (queue->cq_head + queue->cq_count) % (2 * queue->num_entries);
+	cqe->user_data = user_data;
+	cqe->result = result;
+	queue->cq_count++;
+
+	return 1;
+}
+
+int sfs_ioqueue_pop_cqe(struct ioqueue *queue, struct sfs_cqe *cqe) {
+	if (queue->cq_count == 0) {
+		return 0;
+	}
+
+	*cqe = queue->cq[queue->cq_head];
+	queue->cq_head = (queue->cq_head + 1) % (2 * queue->num_entries);
+	queue->cq_count--;
+
+	return 1;
+}
@@ -0,0 +1,102 @@
+#ifndef SFS_IOQUEUE_H
+#define SFS_IOQUEUE_H
+
+
+#include "sfs_base.h"
+
+
+// Operations that can be submitted through a ring (see sfs_ring_submit())
+#define SFS_OP_NOP 0
+// Opens (or creates) path. The result is the file descriptor.
+#define SFS_OP_OPEN 1
+#define SFS_OP_PREAD 2
+#define SFS_OP_PWRITE 3
+#define SFS_OP_CLOSE 4
+// Removes path
+#define SFS_OP_REMOVE 5
+
+
+// Submission queue entry: one operation to perform
+struct sfs_sqe {
+	int opcode;
+	// File descriptor for SFS_OP_PREAD, SFS_OP_PWRITE and SFS_OP_CLOSE
+	int fd;
+	// Path for SFS_OP_OPEN and SFS_OP_REMOVE
+	const char *path;
+	// Data for SFS_OP_PREAD and SFS_OP_PWRITE
+	char *buffer;
+	int length;
+	int offset;
+	// Passed back unchanged in the completion
+	unsigned long user_data;
+};
+
+// Completion queue entry: the outcome of one operation
+struct sfs_cqe {
+	unsigned long user_data;
+	// What the matching sfs_*() call would have returned
+	int result;
+};
+
+/*
+ * Pair of fixed-size circular queues: operations waiting to be performed and
+ * completions waiting to be reaped. The completion queue is twice as large as
+ * the submission queue, so that a full submission queue can be submitted while
+ * earlier completions are still waiting.
+ */
+struct ioqueue {
+	// Number of entries in the submission queue
+	int num_entries;
+	struct sfs_sqe *sq;
+	// Index of the oldest submission and number of submissions
+	int sq_head;
+	int sq_count;
+	struct sfs_cqe *cq;
+	// Index of the oldest completion and number of completions
+	int cq_head;
+	int cq_count;
+};
+
+
+/*
+ * Initializes empty queues with room for the given number of submissions.
+ */
+struct ioqueue sfs_ioqueue_new(int num_entries);
+
+/*
+ * Frees any dynamically-allocated memory and zeroes out the memory for the
+ * queues.
+ */
+void sfs_ioqueue_free(struct ioqueue *queue);
+
+/*
+ * Appends a zeroed-out submission and returns it so that the caller can fill
+ * it in. Returns NULL if the submission queue is full.
+ */
+struct sfs_sqe *sfs_ioqueue_get_sqe(struct ioqueue *queue);
+
+/*
+ * Removes the oldest submission and copies it into sqe. Returns zero if the
+ * submission queue is empty and a nonzero number on success.
+ */
+int sfs_ioqueue_pop_sqe(struct ioqueue *queue, struct sfs_sqe *sqe);
+
+/*
+ * Returns the number of completions that can still be added.
+ */
+int sfs_ioqueue_cq_space(struct ioqueue *queue);
+
+/*
+ * Appends a completion. Returns zero if the completion queue is full and a
+ * nonzero number on success.
+ */
+int sfs_ioqueue_push_cqe(struct ioqueue *queue, unsigned long user_data, int result);
+
+/*
+ * Removes the oldest completion and copies it into cqe. Returns zero if the
+ * completion queue is empty and a nonzero number on success.
+ */
+int sfs_ioqueue_pop_cqe(struct ioqueue *queue, struct sfs_cqe *cqe);
+
+
+#endif
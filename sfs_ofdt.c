@@ -1,37 +1,61 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "sfs_ofdt.h"
 
 
-// Reserves the first available OFDT entry and returns its index. Returns a negative number if no entries are available.
-static int get_first_unused_file_descriptor(struct ofdt *ofdt) {
-	for (int i = 0; i < ofdt->size; i++) {
-		if (!ofdt->entries[i].active) {
-			return i;
-		}
+// Adds the entries from first to end - 1 to the free list, so that the lowest
+// of them is handed out first
+static void push_free_entries(struct ofdt *ofdt, int first, int end) {
+	for (int i = end - 1; i >= first; i--) {
+		ofdt->entries[i].next_free = ofdt->first_free;
+		ofdt->first_free = i;
 	}
-	return -1;
 }
 
+/*
+ * Doubles the table. The new entries are published before the new size, so
+ * that sfs_ofdt_peek_inode() never sees a size larger than its array, and the
+ * old array is retired rather than freed.
+ */
 static void resize_ofdt(struct ofdt *ofdt) {
 	int old_size = ofdt->size;
 	int new_size = old_size * 2;
-	ofdt->size = new_size;
 
 	struct ofdt_entry *new_entries = calloc_or_exit(new_size, sizeof(struct ofdt_entry));
 	memcpy(new_entries, ofdt->entries, old_size * sizeof(struct ofdt_entry));
 
-	free(ofdt->entries);
-	ofdt->entries = new_entries;
+	ofdt->retired = realloc(ofdt->retired, (ofdt->num_retired + 1) * sizeof(struct ofdt_entry *));
+	if (ofdt->retired == NULL) {
+		fprintf(stderr, "Failed to allocate memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	ofdt->retired[ofdt->num_retired] = ofdt->entries;
+	ofdt->num_retired++;
+
+	__atomic_store_n(&ofdt->entries, new_entries, __ATOMIC_RELEASE);
+	__atomic_store_n(&ofdt->size, new_size, __ATOMIC_RELEASE);
+
+	push_free_entries(ofdt, old_size, new_size);
 }
 
 
-struct ofdt sfs_ofdt_new() {
+struct ofdt sfs_ofdt_new(int num_inodes) {
 	struct ofdt ofdt;
 
 	ofdt.size = 10;
 	ofdt.entries = calloc_or_exit(ofdt.size, sizeof(struct ofdt_entry));
+	ofdt.first_free = -1;
+	push_free_entries(&ofdt, 0, ofdt.size);
+	ofdt.num_retired = 0;
+	ofdt.retired = NULL;
+
+	ofdt.num_inodes = num_inodes;
+	ofdt.fd_by_inode = calloc_or_exit(num_inodes, sizeof(int));
+	for (int i = 0; i < num_inodes; i++) {
+		ofdt.fd_by_inode[i] = -1;
+	}
 
 	return ofdt;
 }
@@ -40,19 +64,30 @@ void sfs_ofdt_free(struct ofdt *ofdt) {
 	if (ofdt->entries != NULL) {
 		free(ofdt->entries);
 	}
+	if (ofdt->retired != NULL) {
+		for (int i = 0; i < ofdt->num_retired; i++) {
+			free(ofdt->retired[i]);
+		}
+		free(ofdt->retired);
+	}
+	if (ofdt->fd_by_inode != NULL) {
+		free(ofdt->fd_by_inode);
+	}
 	memset(ofdt, 0, sizeof *ofdt);
 }
 
 int sfs_ofdt_add_entry(struct ofdt *ofdt, inode_idx inode_idx, rw_pointer rw_pointer) {
-	int fd = get_first_unused_file_descriptor(ofdt);
-	if (fd < 0) {
-		fd = ofdt->size;
+	if (ofdt->first_free < 0) {
 		resize_ofdt(ofdt);
 	}
+	int fd = ofdt->first_free;
+	ofdt->first_free = ofdt->entries[fd].next_free;
 
-	ofdt->entries[fd].active = 1;
-	ofdt->entries[fd].inode_idx = inode_idx;
+	__atomic_store_n(&ofdt->entries[fd].inode_idx, inode_idx, __ATOMIC_RELAXED);
+	__atomic_store_n(&ofdt->entries[fd].active, 1, __ATOMIC_RELEASE);
 	ofdt->entries[fd].rw_pointer = rw_pointer;
+	ofdt->entries[fd].num_refs = 1;
+	ofdt->fd_by_inode[inode_idx] = fd;
 
 	return fd;
 }
@@ -70,23 +105,65 @@ struct ofdt_entry *sfs_ofdt_get_active_entry(struct ofdt *ofdt, int fd) {
 	return ofdt_entry;
 }
 
+inode_idx sfs_ofdt_peek_inode(struct ofdt *ofdt, int fd) {
+	int size = __atomic_load_n(&ofdt->size, __ATOMIC_ACQUIRE);
+	if (fd < 0 || fd >= size) {
+		return INODE_NULL;
+	}
+
+	struct ofdt_entry *ofdt_entry = __atomic_load_n(&ofdt->entries, __ATOMIC_ACQUIRE) + fd;
+	if (!__atomic_load_n(&ofdt_entry->active, __ATOMIC_ACQUIRE)) {
+		return INODE_NULL;
+	}
+	return __atomic_load_n(&ofdt_entry->inode_idx, __ATOMIC_RELAXED);
+}
+
 int sfs_ofdt_remove_entry(struct ofdt *ofdt, int fd) {
 	struct ofdt_entry *ofdt_entry = sfs_ofdt_get_active_entry(ofdt, fd);
 	if (ofdt_entry == NULL) {
 		return 0;
 	}
 
-	// Clear out the entire OFDT entry
-	memset(ofdt_entry, 0, sizeof *ofdt_entry);
+	ofdt->fd_by_inode[ofdt_entry->inode_idx] = -1;
+
+	// Clear out the OFDT entry and put it back on the free list. The inode is
+	// left as it was, so that sfs_ofdt_peek_inode() returns either it or
+	// INODE_NULL while the entry is being cleared.
+	__atomic_store_n(&ofdt_entry->active, 0, __ATOMIC_RELAXED);
+	ofdt_entry->rw_pointer = 0;
+	ofdt_entry->num_refs = 0;
+	ofdt_entry->next_free = ofdt->first_free;
+	ofdt->first_free = fd;
+
+	return 1;
+}
+
+int sfs_ofdt_ref_entry(struct ofdt *ofdt, int fd) {
+	struct ofdt_entry *ofdt_entry = sfs_ofdt_get_active_entry(ofdt, fd);
+	if (ofdt_entry == NULL) {
+		return 0;
+	}
+
+	ofdt_entry->num_refs++;
+	return 1;
+}
+
+int sfs_ofdt_unref_entry(struct ofdt *ofdt, int fd) {
+	struct ofdt_entry *ofdt_entry = sfs_ofdt_get_active_entry(ofdt, fd);
+	if (ofdt_entry == NULL) {
+		return 0;
+	}
 
+	ofdt_entry->num_refs--;
+	if (ofdt_entry->num_refs <= 0) {
+		sfs_ofdt_remove_entry(ofdt, fd);
+	}
 	return 1;
 }
 
 int sfs_ofdt_find_by_inode(struct ofdt *ofdt, inode_idx inode_idx) {
-	for (int i = 0; i < ofdt->size; i++) {
-		if (ofdt->entries[i].active && ofdt->entries[i].inode_idx == inode_idx) {
-			return i;
-		}
+	if (inode_idx < 0 || inode_idx >= ofdt->num_inodes) {
+		return -1;
 	}
-	return -1;
+	return ofdt->fd_by_inode[inode_idx];
 }
@@ -12,19 +12,45 @@ struct ofdt_entry {
 	inode_idx inode_idx;
 	// Current location within the file
 	rw_pointer rw_pointer;
+	// Number of references to the entry (see sfs_ofdt_ref_entry())
+	int num_refs;
+	// Next entry in the free list if this entry is not active
+	int next_free;
 };
 
+/*
+ * Open file descriptor table. Inactive entries are chained in a free list so
+ * that a file descriptor is allocated without scanning, and the descriptor of
+ * each inode is kept in an array indexed by inode, so every operation is
+ * constant time (apart from the occasional doubling of the table).
+ *
+ * Changes must be serialized by the caller, but sfs_ofdt_peek_inode() may run
+ * at the same time as them. For its sake, the entries that a doubling
+ * replaces are kept until the OFDT is freed, and the fields it reads are
+ * stored atomically.
+ */
 struct ofdt {
 	// Number of entries
 	int size;
 	struct ofdt_entry *entries;
+	// Arrays of entries replaced by a doubling of the table, which a thread in
+	// sfs_ofdt_peek_inode() may still be reading
+	int num_retired;
+	struct ofdt_entry **retired;
+	// First entry of the free list, or a negative number if every entry is
+	// active
+	int first_free;
+	// Number of inodes, i.e., of entries in fd_by_inode
+	int num_inodes;
+	// File descriptor of each inode, or a negative number if it is not open
+	int *fd_by_inode;
 };
 
 
 /*
- * Initializes a new OFDT.
+ * Initializes a new OFDT for a disk with the given number of inodes.
  */
-struct ofdt sfs_ofdt_new();
+struct ofdt sfs_ofdt_new(int num_inodes);
 
 /*
  * Frees any dynamically-allocated memory and zeroes out the memory for the
@@ -33,7 +59,8 @@ struct ofdt sfs_ofdt_new();
 void sfs_ofdt_free(struct ofdt *ofdt);
 
 /*
- * Adds a new OFDT entry and returns its file descriptor.
+ * Adds a new OFDT entry with a single reference and returns its file
+ * descriptor. The inode must not already be open.
  */
 int sfs_ofdt_add_entry(struct ofdt *ofdt, inode_idx inode_idx, rw_pointer rw_pointer);
 
@@ -43,11 +70,34 @@ int sfs_ofdt_add_entry(struct ofdt *ofdt, inode_idx inode_idx, rw_pointer rw_poi
 struct ofdt_entry *sfs_ofdt_get_active_entry(struct ofdt *ofdt, int fd);
 
 /*
- * Removes the OFDT entry with the given file descriptor. Returns zero if no
- * such entry exists and returns a non-zero number on success.
+ * Returns the inode open as the given file descriptor, or INODE_NULL if the
+ * descriptor is not open. Unlike the other functions, this may be called
+ * while another thread is changing the OFDT, without any lock, in which case
+ * the answer may already be out of date.
+ */
+inode_idx sfs_ofdt_peek_inode(struct ofdt *ofdt, int fd);
+
+/*
+ * Removes the OFDT entry with the given file descriptor, however many
+ * references it has. Returns zero if no such entry exists and returns a
+ * non-zero number on success.
  */
 int sfs_ofdt_remove_entry(struct ofdt *ofdt, int fd);
 
+/*
+ * Adds a reference to the OFDT entry with the given file descriptor, so that
+ * it stays open until every reference is dropped. Returns zero if no such
+ * entry exists and returns a non-zero number on success.
+ */
+int sfs_ofdt_ref_entry(struct ofdt *ofdt, int fd);
+
+/*
+ * Drops a reference to the OFDT entry with the given file descriptor and
+ * removes the entry once no reference is left. Returns zero if no such entry
+ * exists and returns a non-zero number on success.
+ */
+int sfs_ofdt_unref_entry(struct ofdt *ofdt, int fd);
+
 /*
  * Returns the file descriptor for the given inode, or a negative number if
  * there is no such existing OFDT entry.
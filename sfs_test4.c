@@ -0,0 +1,2288 @@
+/* sfs_test4.c
+ *
+ * Tests for the functions that were added on top of the original API and
+ * for the modules behind them. Each test_*() function returns the number of
+ * errors it found.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+#include "sfs_directory.h"
+#include "sfs_freebitmap.h"
+#include "sfs_inode.h"
+
+#define BITMAP_TEST_DISK "bitmap_test.sfs"
+#define DELALLOC_CHUNK_SIZE 4096
+#define MAX_DELALLOC_FILES 64
+#define ALLOC_TEST_DISK "alloc_test.sfs"
+#define NUM_ALLOC_ROUNDS 500
+#define NUM_ALLOC_PROBES 4
+#define MAX_ALLOC_RUNS 64
+#define MAX_ALLOC_RUN_LENGTH 32
+#define BATCH_TEST_DISK "batch_test.sfs"
+#define PREALLOC_SIZE 100000
+#define TOO_LARGE_SIZE 1000000
+#define NUM_DIR_FILES 600
+#define NUM_MISSING_PROBES 2000
+#define NUM_BULK_FILES 500
+#define NUM_LIST_FILES 40
+#define LIST_BATCH_SIZE 7
+#define NUM_OPEN_FILES 300
+#define BORROW_FILE_SIZE 3000
+#define TRUNCATE_FILE_SIZE 20000
+#define TRUNCATE_SHORT_SIZE 5000
+#define NUM_RING_FILES 3
+#define NUM_RING_WRITES 20
+#define NUM_ASYNC_WRITES 50
+#define CLONE_FILE_SIZE 16000
+#define COPY_FILE_SIZE 30000
+#define HOLE_FILE_SIZE 8192
+#define MAX_STALE_FILES 64
+#define NUM_VOLUMES 4
+#define NUM_VOLUME_WRITES 200
+#define OLD_DISK "old_format.sfs"
+#define STRESS_FILE_SIZE 20000
+#define NUM_STRESS_READERS 4
+#define NUM_STRESS_WRITERS 2
+#define NUM_STRESS_ROUNDS 200
+#define STRESS_CHUNK_SIZE 300
+
+static char digits[] = "0123456789";
+static char greeting[] = "hello";
+
+/* check_contents() - compare the whole file against the expected bytes.
+ */
+static int check_contents(const char *name, const char *expected, int size)
+{
+  int errors = 0;
+  int fd = sfs_fopen(name);
+  char *buffer = malloc(size);
+
+  if (sfs_getfilesize(name) != size) {
+    fprintf(stderr, "ERROR: %s has size %d, expected %d\n",
+            name, sfs_getfilesize(name), size);
+    errors++;
+  }
+
+  sfs_fseek(fd, 0);
+  if (sfs_fread(fd, buffer, size) != size) {
+    fprintf(stderr, "ERROR: short read from %s\n", name);
+    errors++;
+  }
+  else if (memcmp(buffer, expected, size) != 0) {
+    fprintf(stderr, "ERROR: wrong contents in %s\n", name);
+    errors++;
+  }
+
+  free(buffer);
+  sfs_fclose(fd);
+  return errors;
+}
+
+/* The free bitmap is driven directly, on a disk of its own, before the file
+ * system is mounted. */
+static int test_freebitmap_flush()
+{
+  int errors = 0;
+  struct super_block sb = {
+    .block_size = BLOCK_SIZE,
+    .num_blocks = NUM_BLOCKS,
+    .num_inode_blocks = NUM_INODE_BLOCKS,
+  };
+  struct freebitmap fbmp, reloaded;
+  char marker[BLOCK_SIZE];
+  char block[BLOCK_SIZE];
+  disk_ptr first_fbmp_block, changed;
+  int i;
+
+  init_fresh_disk(BITMAP_TEST_DISK, BLOCK_SIZE, NUM_BLOCKS);
+  fbmp = sfs_freebitmap_new(&sb);
+  first_fbmp_block = sb.num_blocks - fbmp.num_blocks;
+
+  /* Blocks changed between flushes all reach the disk. */
+  sfs_freebitmap_reserve_run(&fbmp, 100, 3);
+  sfs_freebitmap_flush(&fbmp);
+  sfs_freebitmap_reserve_run(&fbmp, 3 * BLOCK_SIZE, 2);
+  sfs_freebitmap_release_block(&fbmp, 101);
+  sfs_freebitmap_flush(&fbmp);
+  reloaded = sfs_freebitmap_from_disk(&sb);
+  if (memcmp(reloaded.data, fbmp.data, sb.num_blocks) != 0) {
+    fprintf(stderr, "ERROR: the reloaded free bitmap does not match the flushed one\n");
+    errors++;
+  }
+  sfs_freebitmap_free(&reloaded);
+
+  /* Only the bitmap blocks that changed are written. The bitmap on disk is
+   * overwritten with a marker to see which blocks a flush touches. */
+  memset(marker, 0x5a, BLOCK_SIZE);
+  for (i = 0; i < fbmp.num_blocks; i++) {
+    write_blocks(first_fbmp_block + i, 1, marker);
+  }
+  sfs_freebitmap_flush(&fbmp);
+  changed = sfs_freebitmap_reserve_run(&fbmp, 2 * BLOCK_SIZE + 10, 1).start;
+  sfs_freebitmap_flush(&fbmp);
+  for (i = 0; i < fbmp.num_blocks; i++) {
+    read_blocks(first_fbmp_block + i, 1, block);
+    if (i == changed / BLOCK_SIZE
+        ? memcmp(block, fbmp.data + i * BLOCK_SIZE, BLOCK_SIZE) != 0
+        : memcmp(block, marker, BLOCK_SIZE) != 0) {
+      fprintf(stderr, "ERROR: bitmap block %d was %s\n", i,
+              i == changed / BLOCK_SIZE ? "not written" : "written although it did not change");
+      errors++;
+    }
+  }
+
+  sfs_freebitmap_free(&fbmp);
+  close_disk();
+  unlink(BITMAP_TEST_DISK);
+  return errors;
+}
+
+/* read_at() - read length bytes of the file from offset.
+ */
+static int read_at(int fd, char *buffer, int length, int offset)
+{
+  if (sfs_fseek(fd, offset) != 0) {
+    return -1;
+  }
+  return sfs_fread(fd, buffer, length);
+}
+
+/* fill_pattern() - the contents of file number i of test_delayed_allocation().
+ */
+static void fill_pattern(char *buffer, int i, int offset, int length)
+{
+  int j;
+
+  for (j = 0; j < length; j++) {
+    buffer[j] = (char) ((i * 7 + offset + j) % 251);
+  }
+}
+
+static int test_delayed_allocation()
+{
+  int errors = 0;
+  char name[32];
+  char expected[DELALLOC_CHUNK_SIZE];
+  char buffer[DELALLOC_CHUNK_SIZE];
+  int fds[MAX_DELALLOC_FILES];
+  int sizes[MAX_DELALLOC_FILES];
+  int num_files, max_size;
+  int fd, i, offset, res;
+
+  /* Buffered data is read back before it has any blocks on disk. */
+  fd = sfs_fopen("delalloc.bin");
+  fill_pattern(expected, 0, 0, DELALLOC_CHUNK_SIZE);
+  if (sfs_fwrite(fd, expected, DELALLOC_CHUNK_SIZE) != DELALLOC_CHUNK_SIZE) {
+    fprintf(stderr, "ERROR: buffered write failed\n");
+    errors++;
+  }
+  if (read_at(fd, buffer, DELALLOC_CHUNK_SIZE, 0) != DELALLOC_CHUNK_SIZE ||
+      memcmp(buffer, expected, DELALLOC_CHUNK_SIZE) != 0) {
+    fprintf(stderr, "ERROR: wrong buffered data read back\n");
+    errors++;
+  }
+
+  if (sfs_fflush(fd) != 0) {
+    fprintf(stderr, "ERROR: sfs_fflush failed\n");
+    errors++;
+  }
+  if (read_at(fd, buffer, DELALLOC_CHUNK_SIZE, 0) != DELALLOC_CHUNK_SIZE ||
+      memcmp(buffer, expected, DELALLOC_CHUNK_SIZE) != 0) {
+    fprintf(stderr, "ERROR: wrong data read back after sfs_fflush\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+  if (sfs_fflush(fd) != -1) {
+    fprintf(stderr, "ERROR: sfs_fflush of a closed file succeeded\n");
+    errors++;
+  }
+
+  /* Data that was never flushed is written out when unmounting. Reopening
+   * the file appends to it. */
+  fd = sfs_fopen("delalloc.bin");
+  fill_pattern(expected, 1, 0, DELALLOC_CHUNK_SIZE);
+  sfs_fwrite(fd, expected, DELALLOC_CHUNK_SIZE);
+  sfs_fclose(fd);
+  mksfs(0);
+  fd = sfs_fopen("delalloc.bin");
+  if (sfs_getfilesize("delalloc.bin") != 2 * DELALLOC_CHUNK_SIZE ||
+      read_at(fd, buffer, DELALLOC_CHUNK_SIZE, DELALLOC_CHUNK_SIZE) != DELALLOC_CHUNK_SIZE ||
+      memcmp(buffer, expected, DELALLOC_CHUNK_SIZE) != 0) {
+    fprintf(stderr, "ERROR: buffered data was lost by remounting\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+  sfs_remove("delalloc.bin");
+
+  /* Fill the disk. The first file stops at the maximum file size, and the
+   * last one stops when no more free blocks can be claimed. */
+  max_size = 0;
+  for (num_files = 0; num_files < MAX_DELALLOC_FILES; num_files++) {
+    sprintf(name, "full%d.bin", num_files);
+    fds[num_files] = sfs_fopen(name);
+    for (offset = 0; ; offset += res) {
+      fill_pattern(buffer, num_files, offset, DELALLOC_CHUNK_SIZE);
+      res = sfs_fwrite(fds[num_files], buffer, DELALLOC_CHUNK_SIZE);
+      if (res <= 0) {
+        break;
+      }
+    }
+    sizes[num_files] = offset;
+    max_size = num_files == 0 ? offset : max_size;
+    if (offset < max_size) {
+      num_files++;
+      break;
+    }
+  }
+  if (num_files == MAX_DELALLOC_FILES) {
+    fprintf(stderr, "ERROR: buffered writes never ran out of space\n");
+    errors++;
+  }
+
+  /* Claimed blocks must always be there when the data is flushed. */
+  for (i = 0; i < num_files; i++) {
+    if (sfs_fflush(fds[i]) != 0) {
+      fprintf(stderr, "ERROR: sfs_fflush failed on a full disk\n");
+      errors++;
+    }
+  }
+  if (sfs_fwrite(fds[num_files - 1], expected, BLOCK_SIZE) > 0) {
+    fprintf(stderr, "ERROR: write succeeded after the disk was full\n");
+    errors++;
+  }
+
+  mksfs(0);
+  for (i = 0; i < num_files; i++) {
+    sprintf(name, "full%d.bin", i);
+    fd = sfs_fopen(name);
+    if (sfs_getfilesize(name) != sizes[i]) {
+      fprintf(stderr, "ERROR: %s has size %d, expected %d\n", name, sfs_getfilesize(name), sizes[i]);
+      errors++;
+    }
+    for (offset = 0; offset < sizes[i]; offset += DELALLOC_CHUNK_SIZE) {
+      res = sizes[i] - offset < DELALLOC_CHUNK_SIZE ? sizes[i] - offset : DELALLOC_CHUNK_SIZE;
+      fill_pattern(expected, i, offset, res);
+      if (read_at(fd, buffer, res, offset) != res || memcmp(buffer, expected, res) != 0) {
+        fprintf(stderr, "ERROR: wrong contents in %s at %d\n", name, offset);
+        errors++;
+        break;
+      }
+    }
+    sfs_fclose(fd);
+    sfs_remove(name);
+  }
+
+  /* Removing the files gave their blocks back. */
+  fd = sfs_fopen("delalloc.bin");
+  fill_pattern(expected, 0, 0, DELALLOC_CHUNK_SIZE);
+  if (sfs_fwrite(fd, expected, DELALLOC_CHUNK_SIZE) != DELALLOC_CHUNK_SIZE) {
+    fprintf(stderr, "ERROR: blocks of removed files were not given back\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+  sfs_remove("delalloc.bin");
+
+  return errors;
+}
+
+/* linear_find() - sfs_freeindex_find() done by scanning the free bitmap.
+ */
+static disk_ptr linear_find(const char *data, disk_ptr start, disk_ptr end, int length)
+{
+  disk_ptr b;
+  int n;
+
+  for (b = start; b + length <= end; b++) {
+    for (n = 0; n < length && data[b + n] == 1; n++) {
+    }
+    if (n == length) {
+      return b;
+    }
+  }
+  return DISK_NULL;
+}
+
+/* linear_longest_run() - sfs_freeindex_longest_run() done by scanning the
+ * free bitmap.
+ */
+static int linear_longest_run(const char *data, int num_blocks)
+{
+  int longest = 0, length = 0;
+  disk_ptr b;
+
+  for (b = 0; b < num_blocks; b++) {
+    length = data[b] == 1 ? length + 1 : 0;
+    longest = length > longest ? length : longest;
+  }
+  return longest;
+}
+
+/* check_freeindex() - compare the free extent index against the free bitmap
+ * it was built from.
+ */
+static int check_freeindex(struct freebitmap *fbmp, unsigned int *seed)
+{
+  const int num_blocks = fbmp->super_block->num_blocks;
+  disk_ptr start, end;
+  int i, length;
+
+  if (sfs_freeindex_longest_run(&fbmp->index) != linear_longest_run(fbmp->data, num_blocks)) {
+    return 1;
+  }
+  for (i = 0; i < NUM_ALLOC_PROBES; i++) {
+    start = rand_r(seed) % num_blocks;
+    end = start + rand_r(seed) % (num_blocks - start + 1);
+    length = 1 + rand_r(seed) % MAX_ALLOC_RUN_LENGTH;
+    if (sfs_freeindex_find(&fbmp->index, start, end, length) !=
+        linear_find(fbmp->data, start, end, length)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* The free bitmap and inode table are driven directly, on a disk of their
+ * own, so that the blocks they choose can be checked. */
+static int test_allocator()
+{
+  int errors = 0;
+  unsigned int seed = 30;
+  struct super_block sb = {
+    .block_size = BLOCK_SIZE,
+    .num_blocks = NUM_BLOCKS,
+    .num_inode_blocks = NUM_INODE_BLOCKS,
+  };
+  struct freebitmap fbmp;
+  struct inode_table table;
+  struct inode *inode_a, *inode_b;
+  struct block_run runs[MAX_ALLOC_RUNS];
+  char block[BLOCK_SIZE];
+  disk_ptr first, end, goal;
+  inode_idx a, b;
+  int num_runs = 0, mismatches = 0;
+  int i, j;
+
+  init_fresh_disk(ALLOC_TEST_DISK, BLOCK_SIZE, NUM_BLOCKS);
+
+  /* Reserve and release runs at random, comparing the index against a scan
+   * of the bitmap after every step. */
+  fbmp = sfs_freebitmap_new(&sb);
+  first = 1 + sb.num_inode_blocks;
+  end = sb.num_blocks - fbmp.num_blocks;
+  for (i = 0; i < NUM_ALLOC_ROUNDS; i++) {
+    if (num_runs < MAX_ALLOC_RUNS && (num_runs == 0 || rand_r(&seed) % 3 != 0)) {
+      goal = rand_r(&seed) % 2 ? DISK_NULL : rand_r(&seed) % sb.num_blocks;
+      runs[num_runs] = sfs_freebitmap_reserve_run(&fbmp, goal, 1 + rand_r(&seed) % MAX_ALLOC_RUN_LENGTH);
+      if (runs[num_runs].length > 0) {
+        num_runs++;
+      }
+    }
+    else {
+      j = rand_r(&seed) % num_runs;
+      while (runs[j].length > 0) {
+        runs[j].length--;
+        sfs_freebitmap_release_block(&fbmp, runs[j].start + runs[j].length);
+      }
+      runs[j] = runs[--num_runs];
+    }
+    mismatches += check_freeindex(&fbmp, &seed);
+  }
+  if (mismatches > 0) {
+    fprintf(stderr, "ERROR: the free extent index disagreed with the bitmap %d times\n", mismatches);
+    errors++;
+  }
+  sfs_freebitmap_free(&fbmp);
+
+  /* A search that starts near the end of the disk wraps around to its
+   * start, and the rotor then moves on from there. */
+  fbmp = sfs_freebitmap_new(&sb);
+  sfs_freebitmap_reserve_run(&fbmp, end - 5, 5);
+  sfs_freebitmap_reserve_run(&fbmp, end - 10, 5);
+  if (fbmp.rotor != end - 5 ||
+      sfs_freebitmap_reserve_block(&fbmp) != first ||
+      sfs_freebitmap_reserve_block(&fbmp) != first + 1) {
+    fprintf(stderr, "ERROR: the rotor did not wrap around to the start of the disk\n");
+    errors++;
+  }
+  sfs_freebitmap_free(&fbmp);
+
+  /* Files appended to in turn stay contiguous when one of them is given an
+   * allocation goal of its own. */
+  table = sfs_inode_new_table(&sb, &fbmp);
+  fbmp = sfs_freebitmap_new(&sb);
+  a = sfs_inode_reserve_inode(&table, INODE_TYPE_FILE);
+  b = sfs_inode_reserve_inode(&table, INODE_TYPE_FILE);
+  goal = first + (end - first) / 2;
+  sfs_inode_set_alloc_goal(&table, b, goal);
+  memset(block, 'x', BLOCK_SIZE);
+  for (i = 0; i < NUM_INODE_DIRECT_PTRS; i++) {
+    sfs_inode_write(&table, a, i * BLOCK_SIZE, BLOCK_SIZE, block);
+    sfs_inode_write(&table, b, i * BLOCK_SIZE, BLOCK_SIZE, block);
+  }
+  inode_a = table.entries + a;
+  inode_b = table.entries + b;
+  if (inode_b->direct_pointers[0] != goal) {
+    fprintf(stderr, "ERROR: the allocation goal was not used\n");
+    errors++;
+  }
+  for (i = 1; i < NUM_INODE_DIRECT_PTRS; i++) {
+    if (inode_a->direct_pointers[i] != inode_a->direct_pointers[0] + i ||
+        inode_b->direct_pointers[i] != inode_b->direct_pointers[0] + i) {
+      fprintf(stderr, "ERROR: appended blocks are not contiguous\n");
+      errors++;
+      break;
+    }
+  }
+  sfs_inode_free_table(&table);
+  sfs_freebitmap_free(&fbmp);
+
+  close_disk();
+  unlink(ALLOC_TEST_DISK);
+  return errors;
+}
+
+/* size_on_disk() - the size of an inode as the inode table on disk has it.
+ */
+static int size_on_disk(inode_idx inode_idx)
+{
+  const int offset = inode_idx * sizeof(struct inode);
+  char blocks[2 * BLOCK_SIZE];
+  struct inode inode;
+
+  read_blocks(1 + offset / BLOCK_SIZE, 2, blocks);
+  memcpy(&inode, blocks + offset % BLOCK_SIZE, sizeof(inode));
+  return inode.size;
+}
+
+struct batch_test {
+  struct inode_table *table;
+  inode_idx inode_idx;
+  pthread_barrier_t barrier;
+};
+
+/* Writes to an inode twice in a batch, syncing it after the second write, and
+ * waits for the main thread to check the disk after each step. */
+static void *write_in_batch(void *arg)
+{
+  struct batch_test *test = arg;
+
+  sfs_inode_begin_batch(test->table);
+  sfs_inode_write_lock(test->table, test->inode_idx);
+  sfs_inode_write(test->table, test->inode_idx, 0, 10, digits);
+  sfs_inode_unlock(test->table, test->inode_idx);
+  pthread_barrier_wait(&test->barrier);
+  pthread_barrier_wait(&test->barrier);
+  sfs_inode_write_lock(test->table, test->inode_idx);
+  sfs_inode_write(test->table, test->inode_idx, 10, 5, greeting);
+  sfs_inode_unlock(test->table, test->inode_idx);
+  sfs_inode_sync(test->table, test->inode_idx);
+  pthread_barrier_wait(&test->barrier);
+  pthread_barrier_wait(&test->barrier);
+  sfs_inode_end_batch(test->table);
+  return NULL;
+}
+
+/* A batch only defers the flushes of the thread that started it, and
+ * sfs_inode_sync() writes through it. */
+static int test_inode_batches()
+{
+  int errors = 0;
+  struct super_block sb = {
+    .block_size = BLOCK_SIZE,
+    .num_blocks = NUM_BLOCKS,
+    .num_inode_blocks = NUM_INODE_BLOCKS,
+  };
+  struct freebitmap fbmp;
+  struct inode_table table;
+  struct batch_test test;
+  pthread_t thread;
+  inode_idx other;
+
+  init_fresh_disk(BATCH_TEST_DISK, BLOCK_SIZE, NUM_BLOCKS);
+  table = sfs_inode_new_table(&sb, &fbmp);
+  fbmp = sfs_freebitmap_new(&sb);
+  test.table = &table;
+  test.inode_idx = sfs_inode_reserve_inode(&table, INODE_TYPE_FILE);
+  other = sfs_inode_reserve_inode(&table, INODE_TYPE_FILE);
+  pthread_barrier_init(&test.barrier, NULL, 2);
+  pthread_create(&thread, NULL, write_in_batch, &test);
+
+  pthread_barrier_wait(&test.barrier);
+  if (size_on_disk(test.inode_idx) != 0) {
+    fprintf(stderr, "ERROR: an inode changed in a batch was written before the batch ended\n");
+    errors++;
+  }
+  sfs_inode_write_lock(&table, other);
+  sfs_inode_write(&table, other, 0, 5, greeting);
+  sfs_inode_unlock(&table, other);
+  if (size_on_disk(other) != 5) {
+    fprintf(stderr, "ERROR: another thread's batch deferred an inode flush\n");
+    errors++;
+  }
+  pthread_barrier_wait(&test.barrier);
+
+  pthread_barrier_wait(&test.barrier);
+  if (size_on_disk(test.inode_idx) != 15) {
+    fprintf(stderr, "ERROR: sfs_inode_sync() did not write the inode in a batch\n");
+    errors++;
+  }
+  pthread_barrier_wait(&test.barrier);
+
+  pthread_join(thread, NULL);
+  pthread_barrier_destroy(&test.barrier);
+  sfs_inode_free_table(&table);
+  sfs_freebitmap_free(&fbmp);
+  close_disk();
+  unlink(BATCH_TEST_DISK);
+  return errors;
+}
+
+static int test_fallocate()
+{
+  int errors = 0;
+  char *expected = calloc(PREALLOC_SIZE, 1);
+  int fd = sfs_fopen("prealloc.bin");
+
+  sfs_fwrite(fd, digits, strlen(digits));
+  memcpy(expected, digits, strlen(digits));
+
+  if (sfs_fallocate(fd, 0, PREALLOC_SIZE) != 0) {
+    fprintf(stderr, "ERROR: sfs_fallocate of %d bytes failed\n", PREALLOC_SIZE);
+    errors++;
+  }
+  errors += check_contents("prealloc.bin", expected, PREALLOC_SIZE);
+
+  /* Writing into the preallocated range must not change the size. */
+  fd = sfs_fopen("prealloc.bin");
+  sfs_fseek(fd, 5000);
+  sfs_fwrite(fd, greeting, strlen(greeting));
+  memcpy(expected + 5000, greeting, strlen(greeting));
+  errors += check_contents("prealloc.bin", expected, PREALLOC_SIZE);
+
+  fd = sfs_fopen("prealloc.bin");
+  if (sfs_fallocate(fd, 0, TOO_LARGE_SIZE) == 0) {
+    fprintf(stderr, "ERROR: sfs_fallocate past the maximum file size succeeded\n");
+    errors++;
+  }
+  if (sfs_fallocate(fd, INT_MAX - 5, 100) == 0) {
+    fprintf(stderr, "ERROR: sfs_fallocate of a range ending past INT_MAX succeeded\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+
+  if (sfs_fallocate(fd, 0, 10) == 0) {
+    fprintf(stderr, "ERROR: sfs_fallocate on a closed file succeeded\n");
+    errors++;
+  }
+
+  /* The preallocated blocks must survive a remount. */
+  mksfs(0);
+  errors += check_contents("prealloc.bin", expected, PREALLOC_SIZE);
+
+  sfs_remove("prealloc.bin");
+  free(expected);
+  return errors;
+}
+
+/* count_entries() - count the names listed in the given directory.
+ */
+static int count_entries(const char *path)
+{
+  char filename[MAXFILENAME];
+  int count = 0;
+
+  while (sfs_getnextfilename_in(path, filename)) {
+    count++;
+  }
+  return count;
+}
+
+static int test_directories()
+{
+  int errors = 0;
+  char path[32];
+  int fd, i;
+
+  if (sfs_mkdir("/docs") != 0 || sfs_mkdir("/docs/old") != 0) {
+    fprintf(stderr, "ERROR: sfs_mkdir failed\n");
+    errors++;
+  }
+  if (sfs_mkdir("/docs") == 0 || errno != EEXIST) {
+    fprintf(stderr, "ERROR: sfs_mkdir of an existing directory succeeded\n");
+    errors++;
+  }
+  if (sfs_mkdir("/missing/dir") == 0 || errno != ENOENT) {
+    fprintf(stderr, "ERROR: sfs_mkdir with a missing parent succeeded\n");
+    errors++;
+  }
+  if (!sfs_isdir("/docs/old") || sfs_isdir("/docs/nothing")) {
+    fprintf(stderr, "ERROR: sfs_isdir gave the wrong answer\n");
+    errors++;
+  }
+
+  /* The same name can be used in different directories. */
+  fd = sfs_fopen("/docs/old/notes.txt");
+  sfs_fwrite(fd, digits, strlen(digits));
+  sfs_fclose(fd);
+  fd = sfs_fopen("notes.txt");
+  sfs_fwrite(fd, greeting, strlen(greeting));
+  sfs_fclose(fd);
+
+  errors += check_contents("/docs/old/notes.txt", digits, strlen(digits));
+  errors += check_contents("/notes.txt", greeting, strlen(greeting));
+
+  if (sfs_fopen("/docs") >= 0 || sfs_fopen("/notes.txt/x") >= 0) {
+    fprintf(stderr, "ERROR: opened a directory or a path through a file\n");
+    errors++;
+  }
+  if (sfs_remove("/docs/old") == 0) {
+    fprintf(stderr, "ERROR: sfs_remove of a directory succeeded\n");
+    errors++;
+  }
+  if (sfs_rmdir("/docs/old") == 0 || errno != ENOTEMPTY) {
+    fprintf(stderr, "ERROR: sfs_rmdir of a non-empty directory succeeded\n");
+    errors++;
+  }
+  if (sfs_mkdir("/notes.txt/dir") == 0 || errno != ENOTDIR ||
+      sfs_rmdir("/notes.txt") == 0 || errno != ENOTDIR ||
+      sfs_rmdir("/docs/nothing") == 0 || errno != ENOENT) {
+    fprintf(stderr, "ERROR: sfs_mkdir or sfs_rmdir failed with the wrong errno\n");
+    errors++;
+  }
+  if (count_entries("/docs/old") != 1 || count_entries("/docs") != 1) {
+    fprintf(stderr, "ERROR: wrong number of entries in the directories\n");
+    errors++;
+  }
+
+  /* Everything must survive a remount. */
+  mksfs(0);
+  errors += check_contents("docs//old/notes.txt", digits, strlen(digits));
+
+  if (sfs_remove("/docs/old/notes.txt") != 0 || sfs_rmdir("/docs/old") != 0 ||
+      sfs_rmdir("/docs/") != 0) {
+    fprintf(stderr, "ERROR: failed to remove a directory tree\n");
+    errors++;
+  }
+  if (sfs_getfilesize("/docs/old/notes.txt") != -1 || sfs_isdir("/docs")) {
+    fprintf(stderr, "ERROR: removed directory tree still exists\n");
+    errors++;
+  }
+  if (sfs_rmdir("/") == 0 || errno != EBUSY) {
+    fprintf(stderr, "ERROR: sfs_rmdir of the root directory succeeded\n");
+    errors++;
+  }
+
+  /* Running out of inodes is reported as such. */
+  sfs_mkdir("/full");
+  for (i = 0; ; i++) {
+    sprintf(path, "/full/d%d", i);
+    if (sfs_mkdir(path) != 0) {
+      break;
+    }
+  }
+  if (errno != ENOSPC) {
+    fprintf(stderr, "ERROR: sfs_mkdir on a full disk failed with errno %d\n", errno);
+    errors++;
+  }
+  while (--i >= 0) {
+    sprintf(path, "/full/d%d", i);
+    sfs_rmdir(path);
+  }
+  if (sfs_rmdir("/full") != 0) {
+    fprintf(stderr, "ERROR: failed to remove the directories made until the disk was full\n");
+    errors++;
+  }
+
+  sfs_remove("/notes.txt");
+  return errors;
+}
+
+static int test_large_directory()
+{
+  int errors = 0;
+  char name[64];
+  int i;
+
+  sfs_mkdir("/big");
+  for (i = 0; i < NUM_DIR_FILES; i++) {
+    sprintf(name, "/big/entry%d", i);
+    sfs_fclose(sfs_fopen(name));
+  }
+  for (i = 0; i < NUM_DIR_FILES; i += 2) {
+    sprintf(name, "/big/entry%d", i);
+    if (sfs_remove(name) != 0) {
+      fprintf(stderr, "ERROR: failed to remove %s\n", name);
+      errors++;
+    }
+  }
+
+  /* The hash index must survive a remount. */
+  mksfs(0);
+  for (i = 0; i < NUM_DIR_FILES; i++) {
+    sprintf(name, "/big/entry%d", i);
+    if ((sfs_getfilesize(name) == 0) != (i % 2 == 1)) {
+      fprintf(stderr, "ERROR: wrong lookup result for %s\n", name);
+      errors++;
+    }
+  }
+  if (count_entries("/big") != NUM_DIR_FILES / 2) {
+    fprintf(stderr, "ERROR: wrong number of entries in /big\n");
+    errors++;
+  }
+
+  for (i = 1; i < NUM_DIR_FILES; i += 2) {
+    sprintf(name, "/big/entry%d", i);
+    sfs_remove(name);
+  }
+  if (sfs_rmdir("/big") != 0) {
+    fprintf(stderr, "ERROR: failed to remove /big\n");
+    errors++;
+  }
+  return errors;
+}
+
+static int test_negative_lookups()
+{
+  int errors = 0;
+  char name[64];
+  struct sfs_dirstats stats;
+  int i;
+
+  sfs_mkdir("/probe");
+  for (i = 0; i < 200; i++) {
+    sprintf(name, "/probe/present%d", i);
+    sfs_fclose(sfs_fopen(name));
+  }
+  for (i = 0; i < NUM_MISSING_PROBES; i++) {
+    sprintf(name, "/probe/missing%d", i);
+    if (sfs_getfilesize(name) != -1) {
+      fprintf(stderr, "ERROR: found missing file %s\n", name);
+      errors++;
+    }
+  }
+  /* Removed names must be reported as missing again. */
+  sfs_remove("/probe/present0");
+  if (sfs_getfilesize("/probe/present0") != -1 ||
+      sfs_getfilesize("/probe/present1") != 0) {
+    fprintf(stderr, "ERROR: wrong lookup result after a removal\n");
+    errors++;
+  }
+
+  if (sfs_getdirstats("/probe", &stats) != 0) {
+    fprintf(stderr, "ERROR: sfs_getdirstats failed\n");
+    return errors + 1;
+  }
+  if (stats.num_filtered + stats.num_false_positives < NUM_MISSING_PROBES ||
+      stats.false_positive_rate > 0.05 || stats.filter_memory <= 0) {
+    fprintf(stderr, "ERROR: unexpected stats: %d filtered, %d false positives, rate %f, %d bytes\n",
+            stats.num_filtered, stats.num_false_positives,
+            stats.false_positive_rate, stats.filter_memory);
+    errors++;
+  }
+
+  for (i = 1; i < 200; i++) {
+    sprintf(name, "/probe/present%d", i);
+    sfs_remove(name);
+  }
+  sfs_rmdir("/probe");
+
+  /* A directory that never had an entry has no filter, so its lookups are
+   * counted but not credited to the filter. */
+  sfs_mkdir("/unused");
+  for (i = 0; i < 100; i++) {
+    sprintf(name, "/unused/absent%d", i);
+    sfs_getfilesize(name);
+  }
+  if (sfs_getdirstats("/unused", &stats) != 0 || stats.num_lookups != 100 ||
+      stats.num_filtered != 0 || stats.num_false_positives != 0 ||
+      stats.false_positive_rate != 0) {
+    fprintf(stderr, "ERROR: unexpected stats for an empty directory: %d lookups, %d filtered, %d false positives\n",
+            stats.num_lookups, stats.num_filtered, stats.num_false_positives);
+    errors++;
+  }
+  sfs_rmdir("/unused");
+  return errors;
+}
+
+static int test_create_many()
+{
+  int errors = 0;
+  char *names[NUM_BULK_FILES + 3];
+  int fds[NUM_BULK_FILES + 3];
+  int i;
+
+  sfs_mkdir("/bulk");
+  sfs_fclose(sfs_fopen("/bulk/existing"));
+  for (i = 0; i < NUM_BULK_FILES; i++) {
+    names[i] = malloc(MAXFILENAME);
+    sprintf(names[i], "/bulk/file%d", i);
+  }
+  names[NUM_BULK_FILES] = "/bulk/existing";
+  names[NUM_BULK_FILES + 1] = "/bulk/file7";
+  names[NUM_BULK_FILES + 2] = "/bulk/this_name_is_much_too_long_to_be_a_file";
+
+  if (sfs_create_many((const char **)names, NUM_BULK_FILES + 3, fds) != NUM_BULK_FILES + 2) {
+    fprintf(stderr, "ERROR: sfs_create_many opened the wrong number of files\n");
+    errors++;
+  }
+  if (fds[NUM_BULK_FILES + 1] != fds[7] || fds[NUM_BULK_FILES + 2] != -1) {
+    fprintf(stderr, "ERROR: sfs_create_many gave the wrong file descriptors\n");
+    errors++;
+  }
+  sfs_fwrite(fds[3], greeting, strlen(greeting));
+  for (i = 0; i < NUM_BULK_FILES + 2; i++) {
+    sfs_fclose(fds[i]);
+  }
+
+  /* The new entries must have been written out. */
+  mksfs(0);
+  if (count_entries("/bulk") != NUM_BULK_FILES + 1) {
+    fprintf(stderr, "ERROR: wrong number of entries in /bulk\n");
+    errors++;
+  }
+  errors += check_contents("/bulk/file3", greeting, strlen(greeting));
+
+  for (i = 0; i < NUM_BULK_FILES; i++) {
+    sfs_remove(names[i]);
+    free(names[i]);
+  }
+  sfs_remove("/bulk/existing");
+  if (sfs_rmdir("/bulk") != 0) {
+    fprintf(stderr, "ERROR: failed to remove /bulk\n");
+    errors++;
+  }
+  return errors;
+}
+
+/* check_dirents() - check a batch returned by sfs_readdir() against the
+ * files made by test_dir_cursors(), counting how often each one was seen.
+ */
+static int check_dirents(struct sfs_dirent *entries, int n, int *seen)
+{
+  int errors = 0;
+  int i, file_num;
+
+  for (i = 0; i < n; i++) {
+    if (strcmp(entries[i].name, "sub") == 0) {
+      if (!entries[i].is_dir) {
+        fprintf(stderr, "ERROR: sub is not listed as a directory\n");
+        errors++;
+      }
+      seen[NUM_LIST_FILES]++;
+    }
+    else if (sscanf(entries[i].name, "file%d", &file_num) == 1 &&
+             file_num >= 0 && file_num < NUM_LIST_FILES) {
+      if (entries[i].is_dir || entries[i].size != file_num % 6) {
+        fprintf(stderr, "ERROR: wrong size or type listed for %s\n",
+                entries[i].name);
+        errors++;
+      }
+      seen[file_num]++;
+    }
+    else {
+      fprintf(stderr, "ERROR: unexpected entry %s\n", entries[i].name);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+static int test_dir_cursors()
+{
+  int errors = 0;
+  char name[MAXFILENAME];
+  struct sfs_dirent entries[LIST_BATCH_SIZE];
+  struct sfs_dirent again[LIST_BATCH_SIZE];
+  int seen_a[NUM_LIST_FILES + 1] = {0};
+  int seen_b[NUM_LIST_FILES + 1] = {0};
+  int a, b, n, m, i, offset;
+
+  sfs_mkdir("/list");
+  for (i = 0; i < NUM_LIST_FILES; i++) {
+    int fd;
+    sprintf(name, "/list/file%d", i);
+    fd = sfs_fopen(name);
+    sfs_fwrite(fd, greeting, i % 6);
+    sfs_fclose(fd);
+  }
+  sfs_mkdir("/list/sub");
+
+  /* Two listings of the same directory must not disturb each other. */
+  a = sfs_opendir("/list");
+  b = sfs_opendir("/list");
+  if (a == -1 || b == -1 || a == b || sfs_opendir("/list/file1") != -1) {
+    fprintf(stderr, "ERROR: sfs_opendir returned the wrong handles\n");
+    errors++;
+  }
+
+  n = sfs_readdir(a, entries, LIST_BATCH_SIZE);
+  errors += check_dirents(entries, n, seen_a);
+  n = sfs_readdir(b, entries, LIST_BATCH_SIZE);
+  errors += check_dirents(entries, n, seen_b);
+
+  /* Removing files in the middle of the listings must not make them skip
+   * or repeat any other entry. file0 has been listed, file20 has not. */
+  sfs_remove("/list/file0");
+  sfs_remove("/list/file20");
+
+  /* Reading the same batch twice from a saved offset gives the same names. */
+  offset = sfs_telldir(b);
+  n = sfs_readdir(b, entries, LIST_BATCH_SIZE);
+  sfs_seekdir(b, offset);
+  m = sfs_readdir(b, again, LIST_BATCH_SIZE);
+  if (offset < 0 || n != m || sfs_telldir(b) != entries[n - 1].next_offset) {
+    fprintf(stderr, "ERROR: seekdir did not resume the listing\n");
+    errors++;
+  }
+  for (i = 0; i < n && i < m; i++) {
+    if (strcmp(entries[i].name, again[i].name) != 0) {
+      fprintf(stderr, "ERROR: seekdir did not resume the listing\n");
+      errors++;
+      break;
+    }
+  }
+  errors += check_dirents(entries, n, seen_b);
+
+  while ((n = sfs_readdir(a, entries, LIST_BATCH_SIZE)) > 0) {
+    errors += check_dirents(entries, n, seen_a);
+    if ((m = sfs_readdir(b, entries, LIST_BATCH_SIZE)) > 0) {
+      errors += check_dirents(entries, m, seen_b);
+    }
+  }
+  while ((m = sfs_readdir(b, entries, LIST_BATCH_SIZE)) > 0) {
+    errors += check_dirents(entries, m, seen_b);
+  }
+
+  for (i = 0; i <= NUM_LIST_FILES; i++) {
+    int expected = i == 20 ? 0 : 1;
+    if (seen_a[i] != expected || seen_b[i] != expected) {
+      fprintf(stderr, "ERROR: entry %d listed %d and %d times\n",
+              i, seen_a[i], seen_b[i]);
+      errors++;
+    }
+  }
+
+  if (sfs_closedir(a) != 0 || sfs_readdir(a, entries, 1) != -1) {
+    fprintf(stderr, "ERROR: closed directory handle still works\n");
+    errors++;
+  }
+  sfs_closedir(b);
+
+  for (i = 1; i < NUM_LIST_FILES; i++) {
+    sprintf(name, "/list/file%d", i);
+    sfs_remove(name);
+  }
+  sfs_rmdir("/list/sub");
+  if (sfs_rmdir("/list") != 0) {
+    fprintf(stderr, "ERROR: failed to remove /list\n");
+    errors++;
+  }
+  return errors;
+}
+
+static int test_many_open_files()
+{
+  int errors = 0;
+  char name[MAXFILENAME];
+  int fds[NUM_OPEN_FILES];
+  int i, fd;
+
+  sfs_mkdir("/open");
+  for (i = 0; i < NUM_OPEN_FILES; i++) {
+    sprintf(name, "/open/file%d", i);
+    fds[i] = sfs_fopen(name);
+  }
+
+  /* Opening a file that is already open gives its descriptor back. */
+  for (i = 0; i < NUM_OPEN_FILES; i += 37) {
+    sprintf(name, "/open/file%d", i);
+    if (sfs_fopen(name) != fds[i]) {
+      fprintf(stderr, "ERROR: reopening %s gave a new descriptor\n", name);
+      errors++;
+    }
+    if (sfs_remove(name) != -1) {
+      fprintf(stderr, "ERROR: removed %s while it was open\n", name);
+      errors++;
+    }
+  }
+
+  /* Closed descriptors are reused before the table grows. */
+  for (i = 0; i < NUM_OPEN_FILES; i += 2) {
+    sfs_fclose(fds[i]);
+  }
+  for (i = 0; i < NUM_OPEN_FILES; i += 2) {
+    sprintf(name, "/open/file%d", i);
+    fd = sfs_fopen(name);
+    if (fd < 0 || fd > fds[NUM_OPEN_FILES - 1]) {
+      fprintf(stderr, "ERROR: %s was given descriptor %d\n", name, fd);
+      errors++;
+    }
+    fds[i] = fd;
+  }
+
+  for (i = 0; i < NUM_OPEN_FILES; i++) {
+    if (sfs_fclose(fds[i]) != 0) {
+      fprintf(stderr, "ERROR: failed to close descriptor %d\n", fds[i]);
+      errors++;
+    }
+    sprintf(name, "/open/file%d", i);
+    if (sfs_remove(name) != 0) {
+      fprintf(stderr, "ERROR: failed to remove %s after closing it\n", name);
+      errors++;
+    }
+  }
+  sfs_rmdir("/open");
+  return errors;
+}
+
+static int test_shared_opens()
+{
+  int errors = 0;
+  int fd;
+
+  /* Each sfs_open() adds a reference, and the file stays open until every
+   * reference is released. */
+  fd = sfs_open("shared.bin");
+  if (fd < 0 || sfs_open("shared.bin") != fd) {
+    fprintf(stderr, "ERROR: sfs_open did not share the descriptor\n");
+    errors++;
+  }
+  if (sfs_release(fd) != 0 || sfs_pwrite(fd, digits, 10, 0) != 10 ||
+      sfs_remove("shared.bin") != -1) {
+    fprintf(stderr, "ERROR: releasing one reference closed the file\n");
+    errors++;
+  }
+  if (sfs_release(fd) != 0 || sfs_pwrite(fd, digits, 10, 0) != -1 ||
+      sfs_release(fd) != -1) {
+    fprintf(stderr, "ERROR: releasing the last reference did not close the file\n");
+    errors++;
+  }
+
+  /* sfs_fopen() starts with one reference and adds none, while sfs_fclose()
+   * closes the file whatever its references. */
+  fd = sfs_fopen("shared.bin");
+  if (sfs_fopen("shared.bin") != fd || sfs_open("shared.bin") != fd ||
+      sfs_release(fd) != 0 || sfs_release(fd) != 0 || sfs_fclose(fd) != -1) {
+    fprintf(stderr, "ERROR: sfs_fopen and sfs_open counted references wrong\n");
+    errors++;
+  }
+  fd = sfs_open("shared.bin");
+  sfs_open("shared.bin");
+  if (sfs_fclose(fd) != 0 || sfs_release(fd) != -1) {
+    fprintf(stderr, "ERROR: sfs_fclose left a shared file open\n");
+    errors++;
+  }
+
+  if (sfs_remove("shared.bin") != 0) {
+    fprintf(stderr, "ERROR: failed to remove a released file\n");
+    errors++;
+  }
+  return errors;
+}
+
+static int test_positional_io()
+{
+  int errors = 0;
+  char buffer[16];
+  int fd;
+
+  fd = sfs_fopen("positional.txt");
+  sfs_fwrite(fd, digits, strlen(digits));
+
+  /* Positional writes and reads leave the file pointer where it was. */
+  if (sfs_pwrite(fd, "abc", 3, 2) != 3 ||
+      sfs_pwrite(fd, "xyz", 3, strlen(digits)) != 3) {
+    fprintf(stderr, "ERROR: sfs_pwrite failed\n");
+    errors++;
+  }
+  if (sfs_pwrite(fd, "!", 1, 20) != -1 || sfs_pread(fd, buffer, 1, -1) != -1) {
+    fprintf(stderr, "ERROR: sfs_pwrite or sfs_pread accepted a bad offset\n");
+    errors++;
+  }
+  if (sfs_pread(fd, buffer, 4, 1) != 4 || memcmp(buffer, "1abc", 4) != 0) {
+    fprintf(stderr, "ERROR: sfs_pread returned the wrong data\n");
+    errors++;
+  }
+  if (sfs_pread(fd, buffer, sizeof(buffer), 11) != 2) {
+    fprintf(stderr, "ERROR: sfs_pread read past the end of the file\n");
+    errors++;
+  }
+  if (sfs_fwrite(fd, "!", 1) != 1) {
+    fprintf(stderr, "ERROR: sfs_fwrite failed after sfs_pwrite\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+
+  errors += check_contents("positional.txt", "01abc56789!yz", 13);
+  sfs_remove("positional.txt");
+  return errors;
+}
+
+static int test_vectored_io()
+{
+  int errors = 0;
+  char first[4], second[8], third[16];
+  struct iovec iov[3];
+  int fd;
+
+  fd = sfs_fopen("vectored.txt");
+  iov[0].iov_base = digits;
+  iov[0].iov_len = strlen(digits);
+  iov[1].iov_base = greeting;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = greeting;
+  iov[2].iov_len = strlen(greeting);
+  if (sfs_writev(fd, iov, 3) != 15 || sfs_writev(fd, iov, -1) != -1) {
+    fprintf(stderr, "ERROR: sfs_writev wrote the wrong number of bytes\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+  errors += check_contents("vectored.txt", "0123456789hello", 15);
+
+  /* The last buffer is only partly filled at the end of the file. */
+  fd = sfs_fopen("vectored.txt");
+  sfs_fseek(fd, 1);
+  iov[0].iov_base = first;
+  iov[0].iov_len = sizeof(first);
+  iov[1].iov_base = second;
+  iov[1].iov_len = sizeof(second);
+  iov[2].iov_base = third;
+  iov[2].iov_len = sizeof(third);
+  if (sfs_readv(fd, iov, 3) != 14 || memcmp(first, "1234", 4) != 0 ||
+      memcmp(second, "56789hel", 8) != 0 || memcmp(third, "lo", 2) != 0) {
+    fprintf(stderr, "ERROR: sfs_readv returned the wrong data\n");
+    errors++;
+  }
+  if (sfs_readv(fd, iov, 3) != 0) {
+    fprintf(stderr, "ERROR: sfs_readv read past the end of the file\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+
+  sfs_remove("vectored.txt");
+  return errors;
+}
+
+static int test_read_borrow()
+{
+  int errors = 0;
+  char expected[BORROW_FILE_SIZE];
+  struct sfs_segment segments[64];
+  struct sfs_segment more[4];
+  int i, n, m, fd, total;
+
+  for (i = 0; i < BORROW_FILE_SIZE; i++) {
+    expected[i] = 'a' + i % 26;
+  }
+  fd = sfs_fopen("borrow.bin");
+  sfs_fwrite(fd, expected, BORROW_FILE_SIZE);
+
+  /* The segments cover the range without copying it, up to the end of the
+   * file. */
+  n = sfs_read_borrow(fd, 500, BORROW_FILE_SIZE, segments, 64);
+  total = 0;
+  for (i = 0; i < n; i++) {
+    if (memcmp(segments[i].data, expected + 500 + total,
+               segments[i].length) != 0) {
+      fprintf(stderr, "ERROR: borrowed segment %d has the wrong data\n", i);
+      errors++;
+    }
+    total += segments[i].length;
+  }
+  if (n < 2 || total != BORROW_FILE_SIZE - 500) {
+    fprintf(stderr, "ERROR: sfs_read_borrow returned %d bytes in %d segments\n",
+            total, n);
+    errors++;
+  }
+
+  /* Writing to the file does not change what was already borrowed, but a
+   * new borrow sees the write. */
+  sfs_pwrite(fd, "ZZZZ", 4, 500);
+  if (memcmp(segments[0].data, expected + 500, 4) != 0) {
+    fprintf(stderr, "ERROR: borrowed data changed under the borrower\n");
+    errors++;
+  }
+  m = sfs_read_borrow(fd, 500, 4, more, 4);
+  if (m != 1 || more[0].length != 4 || memcmp(more[0].data, "ZZZZ", 4) != 0) {
+    fprintf(stderr, "ERROR: borrow after a write returned stale data\n");
+    errors++;
+  }
+  sfs_read_release(more, m);
+
+  if (sfs_read_release(segments, n) != 0 || sfs_read_release(segments, 1) != -1) {
+    fprintf(stderr, "ERROR: sfs_read_release did not release the segments\n");
+    errors++;
+  }
+  if (sfs_read_borrow(fd, BORROW_FILE_SIZE, 10, more, 4) != 0) {
+    fprintf(stderr, "ERROR: sfs_read_borrow returned data past the end\n");
+    errors++;
+  }
+
+  /* Only part of the block cache can be borrowed at once. */
+  for (n = 0; n < 64; n++) {
+    if (sfs_read_borrow(fd, 0, 1, segments + n, 1) != 1) {
+      break;
+    }
+  }
+  if (n == 64 || n == 0) {
+    fprintf(stderr, "ERROR: %d blocks could be borrowed at once\n", n);
+    errors++;
+  }
+  sfs_read_release(segments, n);
+  if (sfs_read_borrow(fd, 0, 1, more, 1) != 1) {
+    fprintf(stderr, "ERROR: could not borrow after releasing everything\n");
+    errors++;
+  }
+  sfs_read_release(more, 1);
+
+  sfs_fclose(fd);
+  sfs_remove("borrow.bin");
+  return errors;
+}
+
+static int test_truncate()
+{
+  int errors = 0;
+  char *expected = calloc(TRUNCATE_FILE_SIZE, 1);
+  int i, fd;
+
+  for (i = 0; i < TRUNCATE_SHORT_SIZE; i++) {
+    expected[i] = 'a' + i % 26;
+  }
+  fd = sfs_fopen("truncate.bin");
+  sfs_fwrite(fd, expected, TRUNCATE_SHORT_SIZE);
+  for (i = TRUNCATE_SHORT_SIZE; i < TRUNCATE_FILE_SIZE; i += 10) {
+    sfs_fwrite(fd, digits, 10);
+  }
+
+  /* Shrinking keeps the data before the new end. */
+  if (sfs_ftruncate(fd, TRUNCATE_SHORT_SIZE) != 0 ||
+      sfs_fseek(fd, TRUNCATE_SHORT_SIZE + 1) != -1) {
+    fprintf(stderr, "ERROR: sfs_ftruncate did not shrink the file\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+  errors += check_contents("truncate.bin", expected, TRUNCATE_SHORT_SIZE);
+
+  /* Extending leaves a hole that reads as zeroes, including the rest of the
+   * old last block. */
+  fd = sfs_fopen("truncate.bin");
+  if (sfs_ftruncate(fd, TRUNCATE_FILE_SIZE) != 0) {
+    fprintf(stderr, "ERROR: sfs_ftruncate did not extend the file\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+  errors += check_contents("truncate.bin", expected, TRUNCATE_FILE_SIZE);
+
+  /* Writing into the hole only fills the blocks written. */
+  fd = sfs_fopen("truncate.bin");
+  sfs_pwrite(fd, digits, 10, TRUNCATE_FILE_SIZE);
+  memcpy(expected + TRUNCATE_FILE_SIZE - 10, digits, 10);
+  sfs_pwrite(fd, digits, 10, TRUNCATE_FILE_SIZE - 10);
+  sfs_ftruncate(fd, TRUNCATE_FILE_SIZE);
+  if (sfs_ftruncate(fd, TOO_LARGE_SIZE) != -1) {
+    fprintf(stderr, "ERROR: sfs_ftruncate went past the maximum file size\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+  errors += check_contents("truncate.bin", expected, TRUNCATE_FILE_SIZE);
+
+  fd = sfs_fopen("truncate.bin");
+  sfs_ftruncate(fd, 0);
+  sfs_fclose(fd);
+  errors += check_contents("truncate.bin", expected, 0);
+
+  sfs_remove("truncate.bin");
+  free(expected);
+  return errors;
+}
+
+/* reap_all() - collect the completions of a ring into results, indexed by
+ * user_data. Returns the number of completions.
+ */
+static int reap_all(int ring, int *results, int max_results)
+{
+  struct sfs_cqe cqes[8];
+  int i, n, total = 0;
+
+  while ((n = sfs_ring_reap(ring, cqes, 8)) > 0) {
+    for (i = 0; i < n; i++) {
+      if (cqes[i].user_data < (unsigned long)max_results) {
+        results[cqes[i].user_data] = cqes[i].result;
+      }
+    }
+    total += n;
+  }
+  return total;
+}
+
+static int test_ring()
+{
+  int errors = 0;
+  char names[NUM_RING_FILES][MAXFILENAME];
+  char contents[NUM_RING_WRITES * 10];
+  char readback[NUM_RING_FILES][10];
+  int results[NUM_RING_FILES * NUM_RING_WRITES + 8];
+  int fds[NUM_RING_FILES];
+  static const int odd_lengths[4] = {-5, 10, 0, 10};
+  static const int odd_offsets[4] = {0, 0, 10, 10};
+  struct sfs_sqe *sqe;
+  int ring, i, j;
+
+  ring = sfs_ring_setup(NUM_RING_FILES * NUM_RING_WRITES + 8);
+  if (ring < 0 || sfs_ring_setup(0) != -1) {
+    fprintf(stderr, "ERROR: sfs_ring_setup failed\n");
+    return 1;
+  }
+
+  for (i = 0; i < NUM_RING_FILES; i++) {
+    sprintf(names[i], "ring%d.txt", i);
+    sqe = sfs_ring_get_sqe(ring);
+    sqe->opcode = SFS_OP_OPEN;
+    sqe->path = names[i];
+    sqe->user_data = i;
+  }
+  if (sfs_ring_submit(ring) != NUM_RING_FILES ||
+      reap_all(ring, fds, NUM_RING_FILES) != NUM_RING_FILES) {
+    fprintf(stderr, "ERROR: wrong number of opens completed\n");
+    errors++;
+  }
+
+  /* Appends to several files, interleaved, are merged per file. */
+  for (j = 0; j < NUM_RING_WRITES; j++) {
+    for (i = 0; i < NUM_RING_FILES; i++) {
+      sqe = sfs_ring_get_sqe(ring);
+      sqe->opcode = SFS_OP_PWRITE;
+      sqe->fd = fds[i];
+      sqe->buffer = digits;
+      sqe->length = 10;
+      sqe->offset = j * 10;
+      sqe->user_data = j * NUM_RING_FILES + i;
+    }
+  }
+  for (i = 0; i < NUM_RING_FILES; i++) {
+    sqe = sfs_ring_get_sqe(ring);
+    sqe->opcode = SFS_OP_PREAD;
+    sqe->fd = fds[i];
+    sqe->buffer = readback[i];
+    sqe->length = 10;
+    sqe->offset = (NUM_RING_WRITES - 1) * 10;
+    sqe->user_data = NUM_RING_FILES * NUM_RING_WRITES + i;
+  }
+  sqe = sfs_ring_get_sqe(ring);
+  sqe->opcode = 42;
+  sqe->user_data = NUM_RING_FILES * NUM_RING_WRITES + NUM_RING_FILES;
+  if (sfs_ring_submit(ring) != NUM_RING_FILES * (NUM_RING_WRITES + 1) + 1) {
+    fprintf(stderr, "ERROR: wrong number of operations submitted\n");
+    errors++;
+  }
+  reap_all(ring, results, NUM_RING_FILES * NUM_RING_WRITES + 8);
+  for (i = 0; i < NUM_RING_FILES * (NUM_RING_WRITES + 1); i++) {
+    if (results[i] != 10) {
+      fprintf(stderr, "ERROR: operation %d completed with %d\n", i, results[i]);
+      errors++;
+    }
+  }
+  if (results[NUM_RING_FILES * (NUM_RING_WRITES + 1)] != -1) {
+    fprintf(stderr, "ERROR: unknown operation did not fail\n");
+    errors++;
+  }
+  for (i = 0; i < NUM_RING_FILES; i++) {
+    if (memcmp(readback[i], digits, 10) != 0) {
+      fprintf(stderr, "ERROR: read after write in one submission failed\n");
+      errors++;
+    }
+  }
+
+  /* Writes of no bytes (or a negative number) are never merged with the
+   * writes after them, and complete as sfs_pwrite() would. */
+  for (i = 0; i < 4; i++) {
+    sqe = sfs_ring_get_sqe(ring);
+    sqe->opcode = SFS_OP_PWRITE;
+    sqe->fd = fds[0];
+    sqe->buffer = digits;
+    sqe->length = odd_lengths[i];
+    sqe->offset = odd_offsets[i];
+    sqe->user_data = i;
+  }
+  sfs_ring_submit(ring);
+  reap_all(ring, results, 4);
+  if (results[0] != sfs_pwrite(fds[0], digits, -5, 0) || results[1] != 10 ||
+      results[2] != 0 || results[3] != 10) {
+    fprintf(stderr, "ERROR: writes of %d and 0 bytes in a ring completed with %d, %d, %d and %d\n",
+            -5, results[0], results[1], results[2], results[3]);
+    errors++;
+  }
+
+  for (i = 0; i < NUM_RING_FILES; i++) {
+    sqe = sfs_ring_get_sqe(ring);
+    sqe->opcode = SFS_OP_CLOSE;
+    sqe->fd = fds[i];
+    sqe->user_data = i;
+  }
+  sfs_ring_submit(ring);
+  reap_all(ring, results, NUM_RING_FILES);
+
+  /* The writes must have reached the disk. */
+  mksfs(0);
+  for (j = 0; j < NUM_RING_WRITES; j++) {
+    memcpy(contents + j * 10, digits, 10);
+  }
+  for (i = 0; i < NUM_RING_FILES; i++) {
+    errors += check_contents(names[i], contents, sizeof(contents));
+  }
+  if (sfs_ring_get_sqe(ring) != NULL) {
+    fprintf(stderr, "ERROR: ring survived remounting\n");
+    errors++;
+  }
+
+  /* Operations beyond the size of the ring are refused. */
+  ring = sfs_ring_setup(2);
+  for (i = 0; i < NUM_RING_FILES; i++) {
+    sqe = sfs_ring_get_sqe(ring);
+    if (sqe == NULL) {
+      break;
+    }
+    sqe->opcode = SFS_OP_REMOVE;
+    sqe->path = names[i];
+    sqe->user_data = i;
+  }
+  if (i != 2) {
+    fprintf(stderr, "ERROR: ring accepted more operations than it holds\n");
+    errors++;
+  }
+  sfs_ring_submit(ring);
+  reap_all(ring, results, NUM_RING_FILES);
+  if (results[0] != 0 || results[1] != 0) {
+    fprintf(stderr, "ERROR: remove through the ring failed\n");
+    errors++;
+  }
+  sfs_remove(names[2]);
+  sfs_ring_destroy(ring);
+  return errors;
+}
+
+static void count_completion(int request, int result, void *arg)
+{
+  int *num_bytes = arg;
+  *num_bytes = result;
+}
+
+static volatile int callback_entered, callback_may_return;
+
+/* Holds its request until the test lets it go. */
+static void blocking_completion(int request, int result, void *arg)
+{
+  (void)request;
+  (void)result;
+  (void)arg;
+  __atomic_store_n(&callback_entered, 1, __ATOMIC_RELEASE);
+  while (!__atomic_load_n(&callback_may_return, __ATOMIC_ACQUIRE)) {
+    usleep(100);
+  }
+}
+
+static int test_async_io()
+{
+  int errors = 0;
+  char contents[NUM_ASYNC_WRITES * 10];
+  char readback[10];
+  int requests[NUM_ASYNC_WRITES];
+  int callback_result = 0;
+  int event_fd = sfs_aio_eventfd();
+  uint64_t count, total = 0;
+  int i, fd, result;
+
+  fd = sfs_fopen("async.txt");
+  memset(contents, '-', sizeof(contents));
+  sfs_fwrite(fd, contents, sizeof(contents));
+
+  /* Many writes in flight at once, completed by the worker threads. */
+  for (i = 0; i < NUM_ASYNC_WRITES; i++) {
+    requests[i] = sfs_awrite(fd, digits, 10, i * 10, NULL, NULL);
+    memcpy(contents + i * 10, digits, 10);
+  }
+  for (i = 0; i < NUM_ASYNC_WRITES; i++) {
+    if (sfs_aio_wait(requests[i]) != 10) {
+      fprintf(stderr, "ERROR: asynchronous write %d failed\n", i);
+      errors++;
+    }
+  }
+  if (sfs_aio_wait(requests[0]) != -1) {
+    fprintf(stderr, "ERROR: collected the result of a request twice\n");
+    errors++;
+  }
+
+  /* A read with a callback, waited for through the eventfd. */
+  sfs_aread(fd, readback, 10, 20, count_completion, &callback_result);
+  while (total < NUM_ASYNC_WRITES + 1) {
+    if (read(event_fd, &count, sizeof(count)) != sizeof(count)) {
+      fprintf(stderr, "ERROR: failed to read the eventfd\n");
+      errors++;
+      break;
+    }
+    total += count;
+  }
+  if (callback_result != 10 || memcmp(readback, digits, 10) != 0) {
+    fprintf(stderr, "ERROR: asynchronous read returned the wrong data\n");
+    errors++;
+  }
+
+  /* Polling a request until it is done. */
+  i = sfs_aread(fd, readback, 10, sizeof(contents), NULL, NULL);
+  while ((result = sfs_aio_poll(i, &callback_result)) == 0) {
+    usleep(100);
+  }
+  if (result != 1 || callback_result != 0) {
+    fprintf(stderr, "ERROR: polled read past the end returned %d\n",
+            callback_result);
+    errors++;
+  }
+
+  /* The handle of a request is not reused while its callback runs. */
+  callback_entered = 0;
+  callback_may_return = 0;
+  i = sfs_aread(fd, readback, 10, 0, blocking_completion, NULL);
+  while (!__atomic_load_n(&callback_entered, __ATOMIC_ACQUIRE)) {
+    usleep(100);
+  }
+  result = sfs_aread(fd, readback, 10, 0, NULL, NULL);
+  if (result == i) {
+    fprintf(stderr, "ERROR: request handle %d was reused during its callback\n", i);
+    errors++;
+  }
+  __atomic_store_n(&callback_may_return, 1, __ATOMIC_RELEASE);
+  sfs_aio_wait(result);
+
+  /* Remounting waits for the requests still in flight on the volume. */
+  for (i = 0; i < NUM_ASYNC_WRITES; i++) {
+    requests[i] = sfs_awrite(fd, digits + 1, 9, i * 10, NULL, NULL);
+    memcpy(contents + i * 10, digits + 1, 9);
+  }
+  mksfs(0);
+  for (i = 0; i < NUM_ASYNC_WRITES; i++) {
+    if (sfs_aio_poll(requests[i], &result) != 1 || result != 9) {
+      fprintf(stderr, "ERROR: asynchronous write %d was not done before remounting\n", i);
+      errors++;
+    }
+  }
+
+  errors += check_contents("async.txt", contents, sizeof(contents));
+  sfs_remove("async.txt");
+  return errors;
+}
+
+static int test_clone()
+{
+  int errors = 0;
+  char *original = malloc(CLONE_FILE_SIZE);
+  char *copy = malloc(CLONE_FILE_SIZE + 10);
+  int i, fd;
+
+  for (i = 0; i < CLONE_FILE_SIZE; i++) {
+    original[i] = 'a' + i % 26;
+  }
+  fd = sfs_fopen("original.txt");
+  sfs_fwrite(fd, original, CLONE_FILE_SIZE);
+  sfs_fclose(fd);
+
+  if (sfs_clone("original.txt", "clone.txt") != 0) {
+    fprintf(stderr, "ERROR: sfs_clone failed\n");
+    errors++;
+  }
+  if (sfs_clone("original.txt", "clone.txt") != -1 ||
+      sfs_clone("missing.txt", "other.txt") != -1) {
+    fprintf(stderr, "ERROR: sfs_clone replaced a file or cloned a missing one\n");
+    errors++;
+  }
+  errors += check_contents("clone.txt", original, CLONE_FILE_SIZE);
+
+  /* Writes to the clone (in a direct and in an indirect block, and past the
+   * end) must not show up in the original. */
+  memcpy(copy, original, CLONE_FILE_SIZE);
+  fd = sfs_fopen("clone.txt");
+  sfs_pwrite(fd, digits, 10, 5000);
+  memcpy(copy + 5000, digits, 10);
+  sfs_pwrite(fd, digits, 10, 14000);
+  memcpy(copy + 14000, digits, 10);
+  sfs_pwrite(fd, digits, 10, CLONE_FILE_SIZE);
+  memcpy(copy + CLONE_FILE_SIZE, digits, 10);
+  sfs_fclose(fd);
+  errors += check_contents("clone.txt", copy, CLONE_FILE_SIZE + 10);
+  errors += check_contents("original.txt", original, CLONE_FILE_SIZE);
+
+  /* Shrinking the original leaves the clone alone as well. */
+  fd = sfs_fopen("original.txt");
+  sfs_ftruncate(fd, 100);
+  sfs_fclose(fd);
+  errors += check_contents("clone.txt", copy, CLONE_FILE_SIZE + 10);
+
+  sfs_remove("original.txt");
+  errors += check_contents("clone.txt", copy, CLONE_FILE_SIZE + 10);
+  sfs_remove("clone.txt");
+  free(original);
+  free(copy);
+  return errors;
+}
+
+static int test_copy_range()
+{
+  int errors = 0;
+  char *source = malloc(COPY_FILE_SIZE);
+  char *expected = malloc(2 * COPY_FILE_SIZE);
+  int i, fd_in, fd_out;
+
+  for (i = 0; i < COPY_FILE_SIZE; i++) {
+    source[i] = 'a' + i % 26;
+  }
+  fd_in = sfs_fopen("source.txt");
+  sfs_fwrite(fd_in, source, COPY_FILE_SIZE);
+
+  /* Block-aligned copy of the whole file, whose blocks can be shared. */
+  fd_out = sfs_fopen("copy.txt");
+  if (sfs_copy_range(fd_in, 0, fd_out, 0, COPY_FILE_SIZE) != COPY_FILE_SIZE) {
+    fprintf(stderr, "ERROR: aligned sfs_copy_range failed\n");
+    errors++;
+  }
+  memcpy(expected, source, COPY_FILE_SIZE);
+
+  /* Unaligned copy over the middle and past the end of the copy; the length
+   * is cut short at the end of the source. */
+  if (sfs_copy_range(fd_in, 100, fd_out, COPY_FILE_SIZE - 5000,
+                     2 * COPY_FILE_SIZE) != COPY_FILE_SIZE - 100) {
+    fprintf(stderr, "ERROR: unaligned sfs_copy_range failed\n");
+    errors++;
+  }
+  memcpy(expected + COPY_FILE_SIZE - 5000, source + 100, COPY_FILE_SIZE - 100);
+
+  if (sfs_copy_range(fd_in, 0, fd_out, 2 * COPY_FILE_SIZE, 10) != -1) {
+    fprintf(stderr, "ERROR: sfs_copy_range left a gap in the file\n");
+    errors++;
+  }
+  if (sfs_copy_range(fd_in, 0, fd_in, 1000, 2000) != -1) {
+    fprintf(stderr, "ERROR: sfs_copy_range copied between overlapping ranges\n");
+    errors++;
+  }
+
+  /* Copying within a file. */
+  if (sfs_copy_range(fd_in, 0, fd_in, 4096, 2048) != 2048) {
+    fprintf(stderr, "ERROR: sfs_copy_range within a file failed\n");
+    errors++;
+  }
+  memcpy(source + 4096, source, 2048);
+  sfs_fclose(fd_in);
+  sfs_fclose(fd_out);
+
+  errors += check_contents("source.txt", source, COPY_FILE_SIZE);
+  errors += check_contents("copy.txt", expected, 2 * COPY_FILE_SIZE - 5100);
+  sfs_remove("source.txt");
+  errors += check_contents("copy.txt", expected, 2 * COPY_FILE_SIZE - 5100);
+  sfs_remove("copy.txt");
+  free(source);
+  free(expected);
+  return errors;
+}
+
+/* Writes into a hole land in blocks that other files used before, so the rest
+ * of those blocks must read back as zeroes. */
+static int test_copy_into_hole()
+{
+  int errors = 0;
+  char chunk[BLOCK_SIZE];
+  char expected[HOLE_FILE_SIZE];
+  char name[32];
+  int fds[MAX_STALE_FILES];
+  int num_files = 0, num_blocks;
+  int i, fd_in, fd_out;
+
+  /* Fill the disk with nonzero bytes and free it again. */
+  memset(chunk, 'x', BLOCK_SIZE);
+  while (num_files < MAX_STALE_FILES) {
+    sprintf(name, "stale%d.bin", num_files);
+    fds[num_files] = sfs_fopen(name);
+    num_blocks = 0;
+    while (sfs_fwrite(fds[num_files], chunk, BLOCK_SIZE) == BLOCK_SIZE) {
+      num_blocks++;
+    }
+    sfs_fflush(fds[num_files]);
+    num_files++;
+    if (num_blocks == 0) {
+      break;
+    }
+  }
+  for (i = 0; i < num_files; i++) {
+    sfs_fclose(fds[i]);
+    sprintf(name, "stale%d.bin", i);
+    sfs_remove(name);
+  }
+
+  fd_in = sfs_fopen("hole_src.txt");
+  sfs_fwrite(fd_in, greeting, 5);
+  fd_out = sfs_fopen("hole.txt");
+  memset(expected, 0, HOLE_FILE_SIZE);
+  if (sfs_ftruncate(fd_out, HOLE_FILE_SIZE) != 0) {
+    fprintf(stderr, "ERROR: failed to extend hole.txt\n");
+    errors++;
+  }
+  if (sfs_copy_range(fd_in, 0, fd_out, BLOCK_SIZE + 100, 5) != 5) {
+    fprintf(stderr, "ERROR: sfs_copy_range into a hole failed\n");
+    errors++;
+  }
+  memcpy(expected + BLOCK_SIZE + 100, greeting, 5);
+  if (sfs_pwrite(fd_out, greeting, 5, 4 * BLOCK_SIZE + 100) != 5) {
+    fprintf(stderr, "ERROR: sfs_pwrite into a hole failed\n");
+    errors++;
+  }
+  memcpy(expected + 4 * BLOCK_SIZE + 100, greeting, 5);
+  sfs_fclose(fd_in);
+  sfs_fclose(fd_out);
+
+  errors += check_contents("hole.txt", expected, HOLE_FILE_SIZE);
+  sfs_remove("hole_src.txt");
+  sfs_remove("hole.txt");
+  return errors;
+}
+
+/* fill_volume() - write a file whose bytes are all the volume's number, 10 at
+ * a time, and read it back. Runs on its own thread.
+ */
+static void *fill_volume(void *arg)
+{
+  sfs_t *fs = arg;
+  char data[10], readback[10];
+  long errors = 0;
+  int i, fd;
+
+  fd = sfs_fs_fopen(fs, "shard.bin");
+  sfs_fs_fseek(fs, fd, 0);
+  sfs_fs_fread(fs, fd, data, 1);
+  memset(data, data[0], sizeof(data));
+  for (i = 0; i < NUM_VOLUME_WRITES; i++) {
+    sfs_fs_fwrite(fs, fd, data, sizeof(data));
+  }
+  for (i = 0; i < NUM_VOLUME_WRITES; i++) {
+    if (sfs_fs_pread(fs, fd, readback, 10, 1 + i * 10) != 10 ||
+        memcmp(readback, data, 10) != 0) {
+      errors++;
+    }
+  }
+  sfs_fs_fclose(fs, fd);
+  return (void *)errors;
+}
+
+static int test_volumes()
+{
+  int errors = 0;
+  struct sfs_options fresh = {1};
+  sfs_t *volumes[NUM_VOLUMES];
+  pthread_t threads[NUM_VOLUMES];
+  char path[32], tag;
+  void *result;
+  int i, fd;
+
+  for (i = 0; i < NUM_VOLUMES; i++) {
+    sprintf(path, "volume%d.sfs", i);
+    volumes[i] = sfs_mount(path, &fresh);
+    tag = '0' + i;
+    fd = sfs_fs_fopen(volumes[i], "shard.bin");
+    sfs_fs_fwrite(volumes[i], fd, &tag, 1);
+    sfs_fs_fclose(volumes[i], fd);
+  }
+  if (sfs_mount("no/such/dir/volume.sfs", NULL) != NULL) {
+    fprintf(stderr, "ERROR: mounted a volume that does not exist\n");
+    errors++;
+  }
+
+  /* Each volume is driven by its own thread. */
+  for (i = 0; i < NUM_VOLUMES; i++) {
+    pthread_create(&threads[i], NULL, fill_volume, volumes[i]);
+  }
+  for (i = 0; i < NUM_VOLUMES; i++) {
+    pthread_join(threads[i], &result);
+    if (result != NULL) {
+      fprintf(stderr, "ERROR: volume %d read back the wrong data\n", i);
+      errors++;
+    }
+  }
+
+  /* Remounting finds each volume's own file, and the default volume is not
+   * affected. */
+  if (sfs_getfilesize("shard.bin") != -1) {
+    fprintf(stderr, "ERROR: a volume's file showed up in the default one\n");
+    errors++;
+  }
+  for (i = 0; i < NUM_VOLUMES; i++) {
+    sprintf(path, "volume%d.sfs", i);
+    if (sfs_unmount(volumes[i]) != 0 ||
+        (volumes[i] = sfs_mount(path, NULL)) == NULL) {
+      fprintf(stderr, "ERROR: failed to remount volume %d\n", i);
+      errors++;
+      continue;
+    }
+    fd = sfs_fs_fopen(volumes[i], "shard.bin");
+    if (sfs_fs_pread(volumes[i], fd, &tag, 1, 1 + NUM_VOLUME_WRITES * 10 - 1) != 1 ||
+        tag != '0' + i ||
+        sfs_fs_getfilesize(volumes[i], "shard.bin") != 1 + NUM_VOLUME_WRITES * 10) {
+      fprintf(stderr, "ERROR: volume %d did not keep its data\n", i);
+      errors++;
+    }
+    sfs_fs_fclose(volumes[i], fd);
+    sfs_unmount(volumes[i]);
+    unlink(path);
+  }
+  return errors;
+}
+
+/* write_old_disk() - write a volume the way the original file system laid it
+ * out: a flat array of entries in the root inode, with the names that the old
+ * FUSE wrapper stored ("/foo") next to plain ones.
+ */
+static int write_old_disk(const char *path)
+{
+  static const char *names[] = {"/foo", "", "bar"};
+  static const char *contents[] = {"old foo", "", "old bar"};
+  const int num_fbmp_blocks = (NUM_BLOCKS + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  const int first_data_block = 1 + NUM_INODE_BLOCKS;
+  struct super_block sb = {
+    .block_size = BLOCK_SIZE,
+    .num_blocks = NUM_BLOCKS,
+    .num_inode_blocks = NUM_INODE_BLOCKS,
+    .dir_inode_idx = 0,
+  };
+  struct inode *inodes;
+  struct directory_entry *entries;
+  char *image, *fbmp;
+  FILE *fp;
+  int i, written;
+
+  image = calloc(NUM_BLOCKS, BLOCK_SIZE);
+  memcpy(image, &sb, sizeof(sb));
+
+  /* The root directory is inode 0 and owns the first data block; each file
+   * gets the data block after it. */
+  inodes = (struct inode *)(image + BLOCK_SIZE);
+  entries = (struct directory_entry *)(image + first_data_block * BLOCK_SIZE);
+  inodes[0].type = 1;
+  inodes[0].size = 3 * sizeof(struct directory_entry);
+  inodes[0].direct_pointers[0] = first_data_block;
+  for (i = 0; i < 3; i++) {
+    strcpy(entries[i].filename, names[i]);
+    if (names[i][0] == '\0') {
+      entries[i].inode_idx = INODE_NULL;
+      continue;
+    }
+    entries[i].inode_idx = 1 + i;
+    inodes[1 + i].type = 1;
+    inodes[1 + i].size = strlen(contents[i]);
+    inodes[1 + i].direct_pointers[0] = first_data_block + 1 + i;
+    strcpy(image + (first_data_block + 1 + i) * BLOCK_SIZE, contents[i]);
+  }
+
+  /* One byte per block, nonzero if the block is free. */
+  fbmp = image + (NUM_BLOCKS - num_fbmp_blocks) * BLOCK_SIZE;
+  for (i = first_data_block + 4; i < NUM_BLOCKS - num_fbmp_blocks; i++) {
+    fbmp[i] = 1;
+  }
+  fbmp[first_data_block + 2] = 1;
+
+  fp = fopen(path, "wb");
+  if (fp == NULL) {
+    free(image);
+    return 0;
+  }
+  written = fwrite(image, BLOCK_SIZE, NUM_BLOCKS, fp);
+  fclose(fp);
+  free(image);
+  return written == NUM_BLOCKS;
+}
+
+/* check_old_file() - the file can be reached by its name without the slash
+ * that the old volume stored, and still holds its data.
+ */
+static int check_old_file(sfs_t *fs, const char *name, const char *expected)
+{
+  char buffer[16];
+  int length = strlen(expected);
+  int fd;
+
+  if (sfs_fs_getfilesize(fs, name) != length) {
+    fprintf(stderr, "ERROR: %s has the wrong size on the old volume\n", name);
+    return 1;
+  }
+  fd = sfs_fs_fopen(fs, name);
+  memset(buffer, 0, sizeof(buffer));
+  if (sfs_fs_pread(fs, fd, buffer, length, 0) != length ||
+      memcmp(buffer, expected, length) != 0) {
+    fprintf(stderr, "ERROR: %s has the wrong contents on the old volume\n", name);
+    sfs_fs_fclose(fs, fd);
+    return 1;
+  }
+  sfs_fs_fclose(fs, fd);
+  return 0;
+}
+
+static int test_old_disk()
+{
+  int errors = 0;
+  char filename[MAXFILENAME];
+  int round, num_listed;
+  sfs_t *fs;
+
+  if (!write_old_disk(OLD_DISK)) {
+    fprintf(stderr, "ERROR: failed to write %s\n", OLD_DISK);
+    return 1;
+  }
+
+  /* The directory is converted when it is first read, and the converted one
+   * is what a remount finds. */
+  for (round = 0; round < 2; round++) {
+    fs = sfs_mount(OLD_DISK, NULL);
+    if (fs == NULL) {
+      fprintf(stderr, "ERROR: failed to mount the old volume\n");
+      errors++;
+      break;
+    }
+    errors += check_old_file(fs, "foo", "old foo");
+    errors += check_old_file(fs, "/foo", "old foo");
+    errors += check_old_file(fs, "bar", "old bar");
+
+    num_listed = 0;
+    while (sfs_fs_getnextfilename(fs, filename)) {
+      if (filename[0] == '/') {
+        fprintf(stderr, "ERROR: the old volume lists %s\n", filename);
+        errors++;
+      }
+      num_listed++;
+    }
+    if (num_listed != 2) {
+      fprintf(stderr, "ERROR: the old volume lists %d files, expected 2\n", num_listed);
+      errors++;
+    }
+    sfs_unmount(fs);
+  }
+  unlink(OLD_DISK);
+  return errors;
+}
+
+static char stress_byte(int offset)
+{
+  return 'a' + (offset * 7) % 26;
+}
+
+static int stress_fd;
+
+/* Reads random ranges of the shared file, which nobody writes. */
+static void *stress_reader(void *arg)
+{
+  unsigned int seed = (unsigned int)(long)arg;
+  char buffer[STRESS_CHUNK_SIZE];
+  long errors = 0;
+  int i, j, offset;
+
+  for (i = 0; i < NUM_STRESS_ROUNDS; i++) {
+    offset = rand_r(&seed) % (STRESS_FILE_SIZE - STRESS_CHUNK_SIZE);
+    if (sfs_pread(stress_fd, buffer, STRESS_CHUNK_SIZE, offset) != STRESS_CHUNK_SIZE) {
+      errors++;
+      continue;
+    }
+    for (j = 0; j < STRESS_CHUNK_SIZE; j++) {
+      if (buffer[j] != stress_byte(offset + j)) {
+        errors++;
+        break;
+      }
+    }
+    if (sfs_getfilesize("stress/shared.bin") != STRESS_FILE_SIZE) {
+      errors++;
+    }
+  }
+  return (void *)errors;
+}
+
+/* Appends to a file of its own and reads back what it wrote. */
+static void *stress_writer(void *arg)
+{
+  int writer = (int)(long)arg;
+  char path[32], chunk[STRESS_CHUNK_SIZE], readback[STRESS_CHUNK_SIZE];
+  long errors = 0;
+  int i, fd;
+
+  sprintf(path, "stress/writer%d.bin", writer);
+  fd = sfs_fopen(path);
+  for (i = 0; i < NUM_STRESS_ROUNDS / 4; i++) {
+    memset(chunk, 'A' + (writer + i) % 26, sizeof(chunk));
+    if (sfs_fwrite(fd, chunk, sizeof(chunk)) != sizeof(chunk) ||
+        sfs_pread(fd, readback, sizeof(readback), i * STRESS_CHUNK_SIZE) != sizeof(readback) ||
+        memcmp(chunk, readback, sizeof(chunk)) != 0) {
+      errors++;
+    }
+  }
+  sfs_fclose(fd);
+  if (sfs_getfilesize(path) != NUM_STRESS_ROUNDS / 4 * STRESS_CHUNK_SIZE ||
+      sfs_remove(path) != 0) {
+    errors++;
+  }
+  return (void *)errors;
+}
+
+/* Creates and removes files next to the others. */
+static void *stress_churn(void *arg)
+{
+  char path[32];
+  long errors = 0;
+  int i, fd;
+
+  (void)arg;
+  for (i = 0; i < NUM_STRESS_ROUNDS / 4; i++) {
+    sprintf(path, "stress/churn%d", i % 5);
+    fd = sfs_fopen(path);
+    if (fd < 0 || sfs_fwrite(fd, greeting, sizeof(greeting)) != sizeof(greeting)) {
+      errors++;
+    }
+    sfs_fclose(fd);
+    if (sfs_remove(path) != 0 || sfs_getfilesize(path) != -1) {
+      errors++;
+    }
+  }
+  return (void *)errors;
+}
+
+/* Borrows blocks of the shared file while the readers read it. */
+static void *stress_borrower(void *arg)
+{
+  struct sfs_segment segments[4];
+  long errors = 0;
+  int i, j, k, n, offset;
+
+  (void)arg;
+  for (i = 0; i < NUM_STRESS_ROUNDS; i++) {
+    offset = (i * 997) % STRESS_FILE_SIZE;
+    n = sfs_read_borrow(stress_fd, offset, 4000, segments, 4);
+    for (j = 0; j < n; j++) {
+      for (k = 0; k < segments[j].length; k++) {
+        if (segments[j].data[k] != stress_byte(offset + k)) {
+          errors++;
+          break;
+        }
+      }
+      offset += segments[j].length;
+    }
+    if (n <= 0 || sfs_read_release(segments, n) != 0) {
+      errors++;
+    }
+  }
+  return (void *)errors;
+}
+
+static int test_concurrency()
+{
+  int errors = 0;
+  pthread_t threads[NUM_STRESS_READERS + NUM_STRESS_WRITERS + 2];
+  char *contents = malloc(STRESS_FILE_SIZE);
+  void *result;
+  int i, num_threads = 0;
+
+  sfs_mkdir("stress");
+  for (i = 0; i < STRESS_FILE_SIZE; i++) {
+    contents[i] = stress_byte(i);
+  }
+  stress_fd = sfs_fopen("stress/shared.bin");
+  sfs_fwrite(stress_fd, contents, STRESS_FILE_SIZE);
+  sfs_fflush(stress_fd);
+
+  /* Readers of the same file, writers of separate files, and path operations
+   * all run at once. */
+  for (i = 0; i < NUM_STRESS_READERS; i++) {
+    pthread_create(&threads[num_threads++], NULL, stress_reader, (void *)(long)(i + 1));
+  }
+  for (i = 0; i < NUM_STRESS_WRITERS; i++) {
+    pthread_create(&threads[num_threads++], NULL, stress_writer, (void *)(long)i);
+  }
+  pthread_create(&threads[num_threads++], NULL, stress_churn, NULL);
+  pthread_create(&threads[num_threads++], NULL, stress_borrower, NULL);
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], &result);
+    if (result != NULL) {
+      fprintf(stderr, "ERROR: thread %d of the stress test saw %ld errors\n", i, (long)result);
+      errors++;
+    }
+  }
+
+  errors += check_contents("stress/shared.bin", contents, STRESS_FILE_SIZE);
+  sfs_fclose(stress_fd);
+  sfs_remove("stress/shared.bin");
+  if (sfs_rmdir("stress") != 0) {
+    fprintf(stderr, "ERROR: the stress test left files behind\n");
+    errors++;
+  }
+  free(contents);
+  return errors;
+}
+
+static int torn_fd;
+/* Set once the rewriter is done, so the readers know when to stop. */
+static volatile int torn_done;
+
+/* Reads ranges of a file that the rewriter keeps overwriting, and checks that
+ * each read saw only one version of it. */
+static void *torn_reader(void *arg)
+{
+  unsigned int seed = (unsigned int)(long)arg;
+  char buffer[STRESS_CHUNK_SIZE];
+  long errors = 0;
+  int i, j, offset, version;
+
+  for (i = 0; i < NUM_STRESS_ROUNDS || !__atomic_load_n(&torn_done, __ATOMIC_RELAXED); i++) {
+    offset = rand_r(&seed) % (STRESS_FILE_SIZE - STRESS_CHUNK_SIZE);
+    if (sfs_pread(torn_fd, buffer, STRESS_CHUNK_SIZE, offset) != STRESS_CHUNK_SIZE) {
+      errors++;
+      continue;
+    }
+    version = buffer[0] == stress_byte(offset) ? 0 : 1;
+    for (j = 0; j < STRESS_CHUNK_SIZE; j++) {
+      if (buffer[j] != stress_byte(offset + j + version)) {
+        errors++;
+        break;
+      }
+    }
+    if (sfs_getfilesize("torn/shared.bin") != STRESS_FILE_SIZE ||
+        sfs_getfilesize("torn/sub/missing.bin") != -1) {
+      errors++;
+    }
+  }
+  return (void *)errors;
+}
+
+/* Overwrites the whole file with one version or the other. */
+static void *torn_rewriter(void *arg)
+{
+  char *contents = malloc(STRESS_FILE_SIZE);
+  long errors = 0;
+  int i, j;
+
+  (void)arg;
+  for (i = 0; i < NUM_STRESS_ROUNDS / 4; i++) {
+    for (j = 0; j < STRESS_FILE_SIZE; j++) {
+      contents[j] = stress_byte(j + i % 2);
+    }
+    if (sfs_pwrite(torn_fd, contents, STRESS_FILE_SIZE, 0) != STRESS_FILE_SIZE) {
+      errors++;
+    }
+  }
+  __atomic_store_n(&torn_done, 1, __ATOMIC_RELAXED);
+  free(contents);
+  return (void *)errors;
+}
+
+/* Opens and closes enough files to make the file descriptor table grow. */
+static void *torn_opener(void *arg)
+{
+  char path[32];
+  long errors = 0;
+  int i, j, fds[40];
+
+  (void)arg;
+  for (i = 0; i < 5; i++) {
+    for (j = 0; j < 40; j++) {
+      sprintf(path, "torn/sub/open%d", j);
+      fds[j] = sfs_fopen(path);
+      if (fds[j] < 0) {
+        errors++;
+      }
+    }
+    for (j = 0; j < 40; j++) {
+      sfs_fclose(fds[j]);
+      sprintf(path, "torn/sub/open%d", j);
+      sfs_remove(path);
+    }
+  }
+  return (void *)errors;
+}
+
+/* Reads and stats a file that is being rewritten, which mostly happens
+ * without locks. */
+static int test_unlocked_reads()
+{
+  int errors = 0;
+  pthread_t threads[NUM_STRESS_READERS + 2];
+  char *contents = malloc(STRESS_FILE_SIZE);
+  void *result;
+  int i, num_threads = 0;
+
+  sfs_mkdir("torn");
+  sfs_mkdir("torn/sub");
+  for (i = 0; i < STRESS_FILE_SIZE; i++) {
+    contents[i] = stress_byte(i);
+  }
+  torn_fd = sfs_fopen("torn/shared.bin");
+  sfs_fwrite(torn_fd, contents, STRESS_FILE_SIZE);
+  sfs_fflush(torn_fd);
+  torn_done = 0;
+
+  for (i = 0; i < NUM_STRESS_READERS; i++) {
+    pthread_create(&threads[num_threads++], NULL, torn_reader, (void *)(long)(i + 1));
+  }
+  pthread_create(&threads[num_threads++], NULL, torn_rewriter, NULL);
+  pthread_create(&threads[num_threads++], NULL, torn_opener, NULL);
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], &result);
+    if (result != NULL) {
+      fprintf(stderr, "ERROR: thread %d of the unlocked read test saw %ld errors\n", i, (long)result);
+      errors++;
+    }
+  }
+
+  sfs_fclose(torn_fd);
+  sfs_remove("torn/shared.bin");
+  if (sfs_rmdir("torn/sub") != 0 || sfs_rmdir("torn") != 0) {
+    fprintf(stderr, "ERROR: the unlocked read test left files behind\n");
+    errors++;
+  }
+  free(contents);
+  return errors;
+}
+
+int main()
+{
+  int error_count = 0;
+
+  error_count += test_freebitmap_flush();
+  error_count += test_allocator();
+  error_count += test_inode_batches();
+
+  mksfs(1);
+
+  error_count += test_delayed_allocation();
+  error_count += test_fallocate();
+  error_count += test_directories();
+  error_count += test_large_directory();
+  error_count += test_negative_lookups();
+  error_count += test_create_many();
+  error_count += test_dir_cursors();
+  error_count += test_many_open_files();
+  error_count += test_shared_opens();
+  error_count += test_positional_io();
+  error_count += test_vectored_io();
+  error_count += test_read_borrow();
+  error_count += test_truncate();
+  error_count += test_ring();
+  error_count += test_async_io();
+  error_count += test_clone();
+  error_count += test_copy_range();
+  error_count += test_copy_into_hole();
+  error_count += test_volumes();
+  error_count += test_old_disk();
+  error_count += test_concurrency();
+  error_count += test_unlocked_reads();
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return error_count;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_workers.h"
+
+
+static void *run_worker(void *arg) {
+	struct worker_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->head == NULL && !pool->stopping) {
+			pthread_cond_wait(&pool->has_work, &pool->lock);
+		}
+		if (pool->head == NULL) {
+			break;
+		}
+
+		struct work_item *item = pool->head;
+		pool->head = item->next;
+		if (pool->head == NULL) {
+			pool->tail = NULL;
+		}
+
+		// Run the item without holding the lock so that the other threads can
+		// take items in the meantime
+		pthread_mutex_unlock(&pool->lock);
+		item->function(item->arg);
+		free(item);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+
+void sfs_workers_start(struct worker_pool *pool, int num_threads) {
+	pool->num_threads = num_threads;
+	pool->threads = calloc_or_exit(num_threads, sizeof(pthread_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->has_work, NULL);
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->stopping = 0;
+
+	for (int i = 0; i < num_threads; i++) {
+		if (pthread_create(pool->threads + i, NULL, run_worker, pool) != 0) {
+			fprintf(stderr, "Failed to start a worker thread.\n");
+			exit(1);
+		}
+	}
+}
+
+void sfs_workers_stop(struct worker_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->num_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	free(pool->threads);
+	pthread_cond_destroy(&pool->has_work);
+	pthread_mutex_destroy(&pool->lock);
+	memset(pool, 0, sizeof *pool);
+}
+
+void sfs_workers_submit(struct worker_pool *pool, void (*function)(void *), void *arg) {
+	struct work_item *item = calloc_or_exit(1, sizeof(struct work_item));
+	item->function = function;
+	item->arg = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail == NULL) {
+		pool->head = item;
+	}
+	else {
+		pool->tail->next = item;
+	}
+	pool->tail = item;
+	pthread_cond_signal(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+}
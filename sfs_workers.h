@@ -0,0 +1,54 @@
+#ifndef SFS_WORKERS_H
+#define SFS_WORKERS_H
+
+
+#include <pthread.h>
+
+#include "sfs_base.h"
+
+
+struct work_item {
+	void (*function)(void *);
+	void *arg;
+	struct work_item *next;
+};
+
+/*
+ * Fixed set of threads that run work items in the order they were added. The
+ * pool is initialized in place (see sfs_workers_start()) since its threads
+ * keep a pointer to it.
+ */
+struct worker_pool {
+	// Number of threads
+	int num_threads;
+	pthread_t *threads;
+	// Protects everything below
+	pthread_mutex_t lock;
+	// Signalled when an item is added or the pool is stopping
+	pthread_cond_t has_work;
+	// Items waiting to be run, oldest first
+	struct work_item *head;
+	struct work_item *tail;
+	// Whether the threads should exit once the queue is empty
+	int stopping;
+};
+
+
+/*
+ * Initializes the given pool and starts its threads.
+ */
+void sfs_workers_start(struct worker_pool *pool, int num_threads);
+
+/*
+ * Waits for every item that was added to be run, stops the threads and zeroes
+ * out the memory for the pool.
+ */
+void sfs_workers_stop(struct worker_pool *pool);
+
+/*
+ * Adds an item that runs function(arg) on one of the threads.
+ */
+void sfs_workers_submit(struct worker_pool *pool, void (*function)(void *), void *arg);
+
+
+#endif